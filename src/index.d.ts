@@ -1,4 +1,5 @@
 import { ChildProcess } from "child_process";
+import { Socket } from "net";
 
 export interface AudioDevice {
   index: number;
@@ -6,25 +7,201 @@ export interface AudioDevice {
   name: string;
 }
 
+/** 単語ごとの認識結果（-words / -partial-words） */
+export interface VoskWord {
+  word: string;
+  conf?: number;
+  /** セッション開始からの秒数 */
+  start: number;
+  end: number;
+}
+
 export interface VoskOutput {
+  /** 複数デバイスを同時に認識している場合の、結果のデバイスのインデックス */
+  device?: number;
   text?: string;
   partial?: string;
   info?: string;
   error?: string;
+  /** サーバーモードのセッション番号 */
+  session?: number;
+  /** 起動の段階（info が "startup" の場合） */
+  phase?:
+    | "model_load"
+    | "recognizer_create"
+    | "warmup"
+    | "device_enumerate"
+    | "device_open"
+    | "first_packet"
+    | "first_partial"
+    | "speaker_model_load";
+  /** プロセス開始からの経過時間（ミリ秒） */
+  atMs?: number;
+  /** 段階にかかった時間（ミリ秒） */
+  durationMs?: number;
+  /** 差し替えた文法のフレーズ数（ack が "grammar" の場合） */
+  phrases?: number;
+  /** vosk_recognizer_set_grm にかかった時間（ミリ秒） */
+  swapMs?: number;
+  /** 制御コマンドの応答（コマンド名） */
+  ack?: string;
+  /** コマンドに付けた id */
+  id?: string | number;
+  /** コマンドが成功したか */
+  ok?: boolean;
+  /** コマンドを受け取ってから実行し終わるまでの時間（ミリ秒） */
+  latencyMs?: number;
+  /** 切り替えたデバイスのインデックス（ack が "device" の場合） */
+  index?: number;
+  /** 切り替えたデバイスを開くのにかかった時間（ミリ秒） */
+  openMs?: number;
+  /** 単語ごとの時刻（words を有効にした場合の最終結果） */
+  result?: VoskWord[];
+  /** 単語ごとの時刻（partialWords を有効にした場合の部分認識結果） */
+  partial_result?: VoskWord[];
+  /** 最初の単語の開始・最後の単語の終了（セッション開始からの秒数） */
+  start?: number;
+  end?: number;
+  /** start/end のUNIX時間（ミリ秒） */
+  startEpochMs?: number;
+  endEpochMs?: number;
+  /** セッションの時計の基準となるQPC時刻（100ns単位。info が "clock" の場合） */
+  qpcPosition?: number;
+  /** qpcPosition のUNIX時間（ミリ秒） */
+  epochMs?: number;
+  /** 話者ベクトル（spkModelPath を指定した場合の最終結果） */
+  spk?: number[];
+  /** 話者ベクトルを求めたフレーム数 */
+  spk_frames?: number;
+  /** 照合した話者のID（登録していない声は "S1" から。表が満杯なら null） */
+  speaker?: string | null;
+  /** 話者とのコサイン類似度 */
+  similarity?: number;
+}
+
+/** preloadCheck() の結果 */
+export interface VoskPreloadResult {
+  info: "preload";
+  ok: boolean;
+  model: string;
+  loadMs: number;
+  recognizerMs: number;
+  warmupMs: number;
+  /** プロセス開始からの合計時間 */
+  totalMs: number;
+  /** 段階ごとのイベント */
+  phases: VoskOutput[];
+}
+
+/** 差分モード（-partial-delta）で前回の部分認識結果の末尾に追加する行 */
+export interface VoskPartialAppend {
+  partial_append: string;
+}
+
+/** 差分モードで前回の部分認識結果の先頭 offset 文字（UTF-16単位）以降を置き換える行 */
+export interface VoskPartialReplace {
+  partial_replace: string;
+  offset: number;
 }
 
+export type VoskPartialDelta = VoskPartialAppend | VoskPartialReplace;
+
 export interface VoskOptions {
-  deviceIndex?: number;
+  /** 配列を指定すると複数のデバイスを1つのモデルで同時に認識する */
+  deviceIndex?: number | number[];
+  modelPath?: string;
+  /** 部分認識結果の最小出力間隔（ミリ秒） */
+  partialIntervalMs?: number;
+  /** 部分認識結果を差分で受け取る（onData には復元した partial を渡す） */
+  partialDelta?: boolean;
+  /** キャプチャの前に合成音声で認識器を慣らし運転する */
+  warmup?: boolean;
+  /** モデルのファイルをページキャッシュへ先読みしてから読み込む */
+  prefetch?: boolean;
+  /** 16ビットに量子化せず、floatのまま認識器に渡す */
+  floatSamples?: boolean;
+  /** 認識するフレーズの一覧（JSONの文字列の配列）のファイル */
+  grammarPath?: string;
+  /** 最終結果に単語ごとの時刻を付ける */
+  words?: boolean;
+  /** 部分認識結果に単語ごとの時刻を付ける */
+  partialWords?: boolean;
+  /** 話者モデルのパス（最終結果に話者のIDを付ける） */
+  spkModelPath?: string;
+  /** 同じ話者とみなすコサイン類似度（既定は 0.5） */
+  spkThreshold?: number;
+  /** あらかじめ登録する話者の一覧（1行に1人 {"id":...,"spk":[...]}） */
+  spkEnrollPath?: string;
+  /** sendCommand() で制御コマンドを受け付ける（既定は true） */
+  control?: boolean;
+  onData: (output: VoskOutput) => void;
+}
+
+/** 制御コマンドに共通の項目 */
+export interface VoskCommandTarget {
+  /** 対象のセッションのデバイス（省略するとすべて） */
+  device?: number;
+  /** 応答にそのまま付く値 */
+  id?: string | number;
+}
+
+/** 文法を差し替える制御コマンド（phrases が空の配列ならモデル全体に戻す） */
+export type VoskGrammarCommand = VoskCommandTarget &
+  ({ command: "grammar"; phrases: string[] } | { command: "grammar"; file: string });
+
+export type VoskControlCommand =
+  | VoskGrammarCommand
+  | (VoskCommandTarget & {
+      command: "pause" | "resume" | "finalize" | "reset";
+    })
+  | (VoskCommandTarget & { command: "partials"; enabled: boolean })
+  | (VoskCommandTarget & { command: "max_alternatives"; value: number })
+  | (VoskCommandTarget & { command: "device"; index: number });
+
+export interface VoskServerOptions {
+  /** 待ち受けるポート（127.0.0.1のみ、既定は2700、0で空いているポート） */
+  port?: number;
   modelPath?: string;
+  /** 同時に開けるセッション数の上限 */
+  maxSessions?: number;
+  /** 待ち受けの前に合成音声で認識器を慣らし運転する */
+  warmup?: boolean;
+  /** モデルのファイルをページキャッシュへ先読みしてから読み込む */
+  prefetch?: boolean;
+  /** サーバーの通知（{"info":"server","port":n} など） */
+  onData?: (output: VoskOutput) => void;
+}
+
+export interface VoskConnectOptions {
+  port?: number;
+  host?: string;
   onData: (output: VoskOutput) => void;
 }
 
+export interface VoskConnection {
+  socket: Socket;
+  /** セッションを開始する（既定は16000Hz） */
+  open: (sampleRate?: number) => void;
+  /** 16ビット・モノラルのPCMを送る */
+  write: (pcm: Buffer) => void;
+  /** セッションを終了し、最終結果を受け取る（同じ接続で再び open() できる） */
+  close: () => void;
+  /** 接続を閉じる */
+  end: () => void;
+}
 
 declare const Vosk: {
   getExePath: () => string;
   getVersion: () => string;
   getDevices: () => AudioDevice[];
+  preloadCheck: (options?: {
+    modelPath?: string;
+    prefetch?: boolean;
+  }) => VoskPreloadResult;
   start: (options: VoskOptions) => ChildProcess;
+  sendCommand: (child: ChildProcess, command: VoskControlCommand) => void;
+  startServer: (options?: VoskServerOptions) => ChildProcess;
+  connect: (options: VoskConnectOptions) => VoskConnection;
 };
 
 export default Vosk;
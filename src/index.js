@@ -1,5 +1,6 @@
 const path = require("path");
-const { execSync, spawn } = require("child_process");
+const net = require("net");
+const { execFileSync, execSync, spawn } = require("child_process");
 
 function getExePath() {
   return path.resolve(__dirname, "../bin/vosk-cli.exe");
@@ -27,11 +28,71 @@ function getDevices() {
   }
 }
 
-function start({ deviceIndex, modelPath, onData } = {}) {
-  const args = ["-d", (deviceIndex ?? 0).toString()];
+// 音声を開かずにモデルを読み込み、読み込み・認識器の作成・慣らし運転の
+// 時間を計測する。失敗した場合は例外を投げる
+function preloadCheck({ modelPath, prefetch } = {}) {
+  const args = ["-preload-check"];
   if (modelPath) args.push("-m", modelPath);
+  if (prefetch) args.push("-prefetch");
+  let output;
+  try {
+    // シェルを介さず引数の配列で渡す（パスの引用符や特殊文字をそのまま扱う）
+    output = execFileSync(getExePath(), args, { encoding: "utf8" });
+  } catch (error) {
+    output = error.stdout || "";
+  }
 
-  const child = spawn(getExePath(), args, { stdio: ["pipe", "pipe", "pipe"] });
+  const lines = output
+    .split("\n")
+    .map((line) => line.trim())
+    .filter((line) => line)
+    .map((line) => JSON.parse(line));
+  const result = lines.find((line) => line.info === "preload");
+  if (!result) {
+    const failure = lines.find((line) => line.error);
+    throw new Error(failure ? failure.error : "preload check failed");
+  }
+  result.phases = lines.filter((line) => line.info === "startup");
+  return result;
+}
+
+// サーバーモード（-server）の既定のポート
+const DEFAULT_SERVER_PORT = 2700;
+
+// 差分形式の部分認識結果を直前のテキストに適用し、通常の部分認識結果に戻す
+function applyPartialDelta(text, parsed) {
+  if (parsed.partial_append !== undefined) return text + parsed.partial_append;
+  return text.slice(0, parsed.offset) + parsed.partial_replace;
+}
+
+// 差分形式の部分認識結果を復元してから onData に渡す関数を作る
+function createEmitter(onData) {
+  // 差分を適用する直前の部分認識結果（デバイスごと）
+  const partialTexts = new Map();
+
+  return (parsed) => {
+    if (
+      parsed.partial_append !== undefined ||
+      parsed.partial_replace !== undefined
+    ) {
+      const text = applyPartialDelta(
+        partialTexts.get(parsed.device) ?? "",
+        parsed
+      );
+      partialTexts.set(parsed.device, text);
+      parsed =
+        parsed.device !== undefined
+          ? { device: parsed.device, partial: text }
+          : { partial: text };
+    } else if (parsed.text !== undefined) {
+      partialTexts.delete(parsed.device);
+    }
+    if (onData) onData(parsed);
+  };
+}
+
+// 子プロセスの標準出力をJSON行ごとに emit に渡す
+function readJsonLines(child, emit) {
   let buffer = "";
 
   child.stdout.on("data", (data) => {
@@ -44,8 +105,7 @@ function start({ deviceIndex, modelPath, onData } = {}) {
       line = line.trim();
       if (line) {
         try {
-          const parsed = JSON.parse(line);
-          if (onData) onData(parsed);
+          emit(JSON.parse(line));
         } catch (error) {
           // JSONパースエラーは無視（不完全なデータの可能性）
         }
@@ -56,22 +116,148 @@ function start({ deviceIndex, modelPath, onData } = {}) {
   child.on("close", (code) => {
     if (buffer.trim()) {
       try {
-        const parsed = JSON.parse(buffer.trim());
-        if (onData) onData(parsed);
+        emit(JSON.parse(buffer.trim()));
       } catch (error) {
         // JSONパースエラーは無視
       }
     }
   });
+}
+
+function start({
+  deviceIndex,
+  modelPath,
+  partialIntervalMs,
+  partialDelta,
+  warmup,
+  prefetch,
+  floatSamples,
+  grammarPath,
+  words,
+  partialWords,
+  spkModelPath,
+  spkThreshold,
+  spkEnrollPath,
+  control = true,
+  onData
+} = {}) {
+  // 配列を指定した場合は複数のデバイスを1つのモデルで同時に認識する
+  const devices = Array.isArray(deviceIndex)
+    ? deviceIndex.join(",")
+    : (deviceIndex ?? 0).toString();
+  const args = ["-d", devices];
+  if (modelPath) args.push("-m", modelPath);
+  if (partialIntervalMs > 0)
+    args.push("-partial-ms", partialIntervalMs.toString());
+  if (partialDelta) args.push("-partial-delta");
+  if (warmup) args.push("-warmup");
+  if (prefetch) args.push("-prefetch");
+  if (floatSamples) args.push("-pcm", "float");
+  if (grammarPath) args.push("-grammar", grammarPath);
+  if (words) args.push("-words");
+  if (partialWords) args.push("-partial-words");
+  if (spkModelPath) args.push("-spk", spkModelPath);
+  if (spkThreshold !== undefined)
+    args.push("-spk-threshold", spkThreshold.toString());
+  if (spkEnrollPath) args.push("-spk-enroll", spkEnrollPath);
+  if (control) args.push("-control");
+
+  const child = spawn(getExePath(), args, { stdio: ["pipe", "pipe", "pipe"] });
+  readJsonLines(child, createEmitter(onData));
+  return child;
+}
+
+// モデルを読み込んだまま常駐するサーバーを起動する
+// {"info":"server","port":n} が出力されたら connect() で接続できる
+function startServer({
+  port,
+  modelPath,
+  maxSessions,
+  warmup,
+  prefetch,
+  onData
+} = {}) {
+  const args = ["-server", (port ?? DEFAULT_SERVER_PORT).toString()];
+  if (modelPath) args.push("-m", modelPath);
+  if (maxSessions > 0) args.push("-sessions", maxSessions.toString());
+  if (warmup) args.push("-warmup");
+  if (prefetch) args.push("-prefetch");
 
+  const child = spawn(getExePath(), args, { stdio: ["pipe", "pipe", "pipe"] });
+  readJsonLines(child, (parsed) => onData && onData(parsed));
   return child;
 }
 
+// サーバーとのフレーム: [種類 1バイト][ペイロード長 4バイト(LE)][ペイロード]
+function encodeFrame(type, payload) {
+  const frame = Buffer.alloc(5 + payload.length);
+  frame.write(type, 0, "ascii");
+  frame.writeUInt32LE(payload.length, 1);
+  payload.copy(frame, 5);
+  return frame;
+}
+
+// 起動済みのサーバーに接続する。open() でセッションを開始し、
+// write() で16ビット・モノラルのPCMを送り、close() で最終結果を受け取る
+function connect({ port, host, onData } = {}) {
+  const socket = net.createConnection({
+    port: port ?? DEFAULT_SERVER_PORT,
+    host: host ?? "127.0.0.1"
+  });
+  socket.setNoDelay(true);
+  const emit = createEmitter(onData);
+  let buffer = Buffer.alloc(0);
+
+  socket.on("data", (data) => {
+    buffer = buffer.length ? Buffer.concat([buffer, data]) : data;
+    while (buffer.length >= 5) {
+      const length = buffer.readUInt32LE(1);
+      if (buffer.length < 5 + length) break;
+      if (buffer[0] === 0x4a) {
+        // "J": 結果・通知のJSON
+        try {
+          emit(JSON.parse(buffer.toString("utf8", 5, 5 + length)));
+        } catch (error) {
+          // JSONパースエラーは無視
+        }
+      }
+      buffer = buffer.subarray(5 + length);
+    }
+  });
+
+  return {
+    socket,
+    open(sampleRate) {
+      const payload = Buffer.alloc(4);
+      payload.writeUInt32LE(sampleRate ?? 16000);
+      socket.write(encodeFrame("O", payload));
+    },
+    write(pcm) {
+      socket.write(encodeFrame("A", pcm));
+    },
+    close() {
+      socket.write(encodeFrame("C", Buffer.alloc(0)));
+    },
+    end() {
+      socket.end();
+    }
+  };
+}
+
+// start({ control: true }) で起動したプロセスに制御コマンドを送る
+function sendCommand(child, command) {
+  child.stdin.write(JSON.stringify(command) + "\n");
+}
+
 const Vosk = {
   getExePath,
   getVersion,
   getDevices,
-  start
+  preloadCheck,
+  start,
+  sendCommand,
+  startServer,
+  connect
 };
 
 module.exports = Vosk;
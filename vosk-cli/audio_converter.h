@@ -0,0 +1,160 @@
+﻿//-----------------------------------------------------------------------------
+// ミックスフォーマット → 16kHzモノラル変換パイプライン
+// (形式, チャンネル数, 入力レート) ごとにテンプレートを実体化し、
+// ストリーム開始時に一度だけ選んで使います
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+//--
+#include <memory>
+
+#include "downmix.h"
+#include "resampler.h"
+
+/**
+ * @brief 16kHzモノラル変換器のインターフェース
+ *
+ * キャプチャループはこのインターフェースだけを呼び出し、
+ * 形式やチャンネル数による分岐はファクトリで一度だけ行います。
+ */
+class AudioConverter {
+ public:
+  virtual ~AudioConverter() {}
+
+  // 入力フレーム数に対する出力サンプル数の上限
+  virtual size_t maxOutputSize(size_t frames) const = 0;
+
+  /**
+   * @brief インターリーブされた入力を16kHzモノラルの16ビットPCMに変換する
+   *
+   * @param src 入力バッファ
+   * @param frames 入力フレーム数
+   * @param dst 出力先（maxOutputSize(frames)以上の領域が必要）
+   * @return size_t 書き込んだ出力サンプル数
+   */
+  virtual size_t convert(const uint8_t *src, size_t frames, short *dst) = 0;
+
+  /**
+   * @brief 16ビットPCMと同じ振幅のfloat（量子化・クリッピングなし）に変換する
+   *
+   * vosk_recognizer_accept_waveform_f に渡す経路で使います。
+   *
+   * @param src 入力バッファ
+   * @param frames 入力フレーム数
+   * @param dst 出力先（maxOutputSize(frames)以上の領域が必要）
+   * @return size_t 書き込んだ出力サンプル数
+   */
+  virtual size_t convert(const uint8_t *src, size_t frames, float *dst) = 0;
+
+  // リサンプラの履歴と位相を初期状態に戻す
+  virtual void reset() = 0;
+};
+
+/**
+ * @brief 形式・チャンネル数・入力レートを固定した変換器
+ *
+ * Channels と InputRate は0で実行時指定になります。
+ * ダウンミックスカーネルは構築時に一度だけ選択します。
+ */
+template <SampleFormat F, int Channels, int InputRate>
+class Mono16kConverter : public AudioConverter {
+ public:
+  Mono16kConverter(int numChannels, int inputRate)
+      : channels(Channels > 0 ? Channels : numChannels),
+        downmix(SelectDownmixKernel(F, channels)),
+        resampler(InputRate > 0 ? InputRate : inputRate) {}
+
+  size_t maxOutputSize(size_t frames) const override {
+    return resampler.maxOutputSize(frames);
+  }
+
+  size_t convert(const uint8_t *src, size_t frames, short *dst) override {
+    if (src == nullptr || frames == 0) return 0;
+    // 入力レートのままモノラル化し、リサンプラの入力領域へ直接書き込む
+    downmix(src, frames, Channels > 0 ? Channels : channels,
+            resampler.inputBuffer(frames));
+    return resampler.process(dst);
+  }
+
+  size_t convert(const uint8_t *src, size_t frames, float *dst) override {
+    if (src == nullptr || frames == 0) return 0;
+    downmix(src, frames, Channels > 0 ? Channels : channels,
+            resampler.inputBuffer(frames));
+    return resampler.processPcmScale(dst);
+  }
+
+  void reset() override { resampler.reset(); }
+
+ private:
+  int channels;
+  DownmixKernel downmix;
+  BasicPolyphaseResampler<InputRate> resampler;
+};
+
+// 入力レートごとの実体化（48k/44.1k/16kは固定、それ以外は実行時）
+template <SampleFormat F, int Channels>
+std::unique_ptr<AudioConverter> CreateConverterForRate(int channels,
+                                                       int sampleRate) {
+  switch (sampleRate) {
+    case 48000:
+      return std::unique_ptr<AudioConverter>(
+          new Mono16kConverter<F, Channels, 48000>(channels, sampleRate));
+    case 44100:
+      return std::unique_ptr<AudioConverter>(
+          new Mono16kConverter<F, Channels, 44100>(channels, sampleRate));
+    case 16000:
+      return std::unique_ptr<AudioConverter>(
+          new Mono16kConverter<F, Channels, 16000>(channels, sampleRate));
+    default:
+      return std::unique_ptr<AudioConverter>(
+          new Mono16kConverter<F, Channels, 0>(channels, sampleRate));
+  }
+}
+
+// チャンネル数ごとの実体化（モノラル/ステレオは固定、それ以外は実行時）
+template <SampleFormat F>
+std::unique_ptr<AudioConverter> CreateConverterForFormat(int channels,
+                                                         int sampleRate) {
+  switch (channels) {
+    case 1:
+      return CreateConverterForRate<F, 1>(channels, sampleRate);
+    case 2:
+      return CreateConverterForRate<F, 2>(channels, sampleRate);
+    default:
+      return CreateConverterForRate<F, 0>(channels, sampleRate);
+  }
+}
+
+/**
+ * @brief ミックスフォーマットに合った16kHzモノラル変換器を作成する関数
+ *
+ * @param format 入力のサンプル形式
+ * @param channels チャンネル数
+ * @param sampleRate 入力サンプリングレート
+ * @return std::unique_ptr<AudioConverter> 変換器。未対応の形式の場合はnullptr
+ */
+inline std::unique_ptr<AudioConverter> CreateMono16kConverter(
+    SampleFormat format, int channels, int sampleRate) {
+  if (channels <= 0 || sampleRate <= 0) return nullptr;
+  switch (format) {
+    case SampleFormat::UInt8:
+      return CreateConverterForFormat<SampleFormat::UInt8>(channels,
+                                                           sampleRate);
+    case SampleFormat::Int16:
+      return CreateConverterForFormat<SampleFormat::Int16>(channels,
+                                                           sampleRate);
+    case SampleFormat::Int24:
+      return CreateConverterForFormat<SampleFormat::Int24>(channels,
+                                                           sampleRate);
+    case SampleFormat::Int32:
+      return CreateConverterForFormat<SampleFormat::Int32>(channels,
+                                                           sampleRate);
+    case SampleFormat::Float32:
+      return CreateConverterForFormat<SampleFormat::Float32>(channels,
+                                                             sampleRate);
+    default:
+      return nullptr;
+  }
+}
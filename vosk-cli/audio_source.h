@@ -0,0 +1,321 @@
+﻿//-----------------------------------------------------------------------------
+// 音声入力元の抽象化
+// WASAPIキャプチャ以外に、標準入力や名前付きパイプから生PCM/WAVを読む入力元を提供します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+//--
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "downmix.h"
+#include "wav_reader.h"
+
+/**
+ * @brief 入力元が出力する音声の形式
+ */
+struct AudioFormat {
+  SampleFormat sampleFormat = SampleFormat::Unknown;  // サンプル形式
+  int channels = 0;                                   // チャンネル数
+  int sampleRate = 0;                                 // サンプリングレート
+  size_t frameBytes = 0;                              // 1フレームのバイト数
+};
+
+/**
+ * @brief 入力元から受け取る1パケット分のデータ
+ */
+struct AudioPacket {
+  const uint8_t *data = nullptr;  // インターリーブされたフレーム
+  size_t frames = 0;              // フレーム数
+  bool silent = false;            // 無音として扱うパケットか
+  uint64_t position = 0;          // 先頭フレームの入力開始からの位置
+  uint64_t qpcPosition = 0;       // 先頭フレームの録音時刻（100ns単位のQPC）
+};
+
+/**
+ * @brief acquire() の結果
+ */
+enum class AudioReadStatus {
+  Ok,     // パケットを取得した
+  Empty,  // まだデータがない（少し待って再度呼ぶ）
+  End,    // 入力の終端に達した
+  Error   // エラー（lastError() に内容）
+};
+
+/**
+ * @brief 音声入力元のインターフェース
+ *
+ * open() で入力を開始し、acquire() で取得したパケットは
+ * 処理後に必ず release() で返却します（WASAPIのGetBuffer/ReleaseBufferに対応）。
+ */
+class AudioSource {
+ public:
+  virtual ~AudioSource() {}
+
+  // 入力を開いて開始する（失敗時は lastError() に内容を設定）
+  virtual bool open() = 0;
+
+  // 入力の形式（open() 成功後に有効）
+  virtual AudioFormat format() const = 0;
+
+  // 1回の acquire() で返る最大フレーム数（変換先バッファの事前確保用）
+  virtual size_t maxPacketFrames() const = 0;
+
+  // 次のパケットを取得する
+  virtual AudioReadStatus acquire(AudioPacket *packet) = 0;
+
+  // acquire() で取得したパケットを返却する
+  virtual bool release(const AudioPacket &packet) = 0;
+
+  // 入力を停止する
+  virtual void stop() = 0;
+
+  // 実時間で届く入力か（falseの場合は認識が追いつくまで読み出しを待たせてよい）
+  virtual bool isRealtime() const { return true; }
+
+  const std::string &lastError() const { return error; }
+
+ protected:
+  std::string error;
+};
+
+/**
+ * @brief ストリームで受け取るデータの形式
+ */
+enum class StreamFormat {
+  Wav,    // WAVヘッダー付き（形式はヘッダーから取得）
+  S16le,  // 16ビット符号付き整数リトルエンディアン
+  F32le   // 32ビット浮動小数点リトルエンディアン
+};
+
+/**
+ * @brief 標準入力・名前付きパイプ・ファイルから音声を読む入力元
+ *
+ * ffmpegなどの上流プロセスからパイプで音声を受け取るためのものです。
+ * 大きなstdioバッファを設定し、100ms分ずつまとめて読み出します。
+ * 生PCMの場合はレートとチャンネル数を指定する必要があります。
+ */
+class StreamAudioSource : public AudioSource {
+ public:
+  /**
+   * @param path 入力のパス（"-" で標準入力。名前付きパイプのパスも可）
+   * @param streamFormat データの形式
+   * @param sampleRate 生PCMのサンプリングレート（WAVでは無視）
+   * @param channels 生PCMのチャンネル数（WAVでは無視）
+   */
+  StreamAudioSource(const std::string &path, StreamFormat streamFormat,
+                    int sampleRate, int channels)
+      : path(path), streamFormat(streamFormat), fp(nullptr),
+        ownsFile(false), blockFrames(0), position(0) {
+    audioFormat.sampleRate = sampleRate;
+    audioFormat.channels = channels;
+  }
+
+  ~StreamAudioSource() override { stop(); }
+
+  bool open() override {
+    if (path == "-") {
+      fp = stdin;
+#ifdef _WIN32
+      // テキストモードでは改行コードが変換されるためバイナリにする
+      _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    } else {
+#ifdef _MSC_VER
+      if (fopen_s(&fp, path.c_str(), "rb") != 0) fp = nullptr;
+#else
+      fp = fopen(path.c_str(), "rb");
+#endif
+      ownsFile = true;
+    }
+    if (fp == nullptr) {
+      error = "Failed to open input: " + path;
+      return false;
+    }
+    // パイプからの読み出し回数を減らすためバッファを大きくする
+    setvbuf(fp, nullptr, _IOFBF, kStreamBufferBytes);
+
+    if (streamFormat == StreamFormat::Wav) {
+      if (!wav.attach(fp)) {
+        error = "Unsupported WAV input: " + path;
+        return false;
+      }
+      audioFormat.sampleFormat = wav.sampleFormat();
+      audioFormat.channels = wav.numChannels();
+      audioFormat.sampleRate = wav.rate();
+      audioFormat.frameBytes = wav.frameSize();
+    } else {
+      if (audioFormat.sampleRate <= 0 || audioFormat.channels <= 0) {
+        error = "Invalid sample rate or channels for raw input";
+        return false;
+      }
+      bool isFloat = streamFormat == StreamFormat::F32le;
+      audioFormat.sampleFormat =
+          isFloat ? SampleFormat::Float32 : SampleFormat::Int16;
+      audioFormat.frameBytes =
+          static_cast<size_t>(audioFormat.channels) * (isFloat ? 4 : 2);
+    }
+
+    blockFrames = static_cast<size_t>(audioFormat.sampleRate / 10);
+    if (blockFrames == 0) blockFrames = 1;
+    buffer.resize(blockFrames * audioFormat.frameBytes);
+    return true;
+  }
+
+  AudioFormat format() const override { return audioFormat; }
+
+  size_t maxPacketFrames() const override { return blockFrames; }
+
+  AudioReadStatus acquire(AudioPacket *packet) override {
+    if (fp == nullptr) return AudioReadStatus::End;
+    size_t frames;
+    if (streamFormat == StreamFormat::Wav) {
+      frames = wav.read(buffer.data(), blockFrames);
+    } else {
+      // 途中で途切れた端数フレームは次回に持ち越さず捨てる（終端でのみ起こる）
+      frames = fread(buffer.data(), audioFormat.frameBytes, blockFrames, fp);
+    }
+    if (frames == 0) {
+      if (ferror(fp)) {
+        error = "Read error on input: " + path;
+        return AudioReadStatus::Error;
+      }
+      return AudioReadStatus::End;
+    }
+    packet->data = buffer.data();
+    packet->frames = frames;
+    packet->silent = false;
+    packet->position = position;
+    position += frames;
+    return AudioReadStatus::Ok;
+  }
+
+  bool release(const AudioPacket &) override { return true; }
+
+  // パイプは上流が書き込みを待つだけなので、取りこぼさずに待たせる
+  bool isRealtime() const override { return false; }
+
+  void stop() override {
+    wav.close();
+    if (fp && ownsFile) fclose(fp);
+    fp = nullptr;
+  }
+
+ private:
+  static const size_t kStreamBufferBytes = 1 << 20;  // 1MB
+
+  std::string path;
+  StreamFormat streamFormat;
+  FILE *fp;
+  bool ownsFile;
+  WavFileReader wav;  // WAV入力のヘッダー解析と読み出し
+  AudioFormat audioFormat;
+  size_t blockFrames;           // 1回に読むフレーム数（100ms分）
+  std::vector<uint8_t> buffer;  // 読み出し先
+  uint64_t position;            // これまでに読んだフレーム数
+};
+
+/**
+ * @brief 別の入力元を実時間の速さで少しずつ渡す入力元
+ *
+ * ファイルなどの入力元から読んだパケットを packetMs ごとに切り分け、
+ * 開始からの経過時間に届いているはずの分だけを返します。
+ * ベンチマークでマイク入力と同じ到着間隔を再現するために使います。
+ */
+class PacedAudioSource : public AudioSource {
+ public:
+  /**
+   * @param inner 読み出す入力元（このオブジェクトより長く存在すること）
+   * @param packetMs 1パケットの長さ（ミリ秒）
+   */
+  explicit PacedAudioSource(AudioSource *inner, int packetMs = 10)
+      : inner(inner), packetMs(packetMs), sliceFrames(0), offset(0),
+        remaining(0), delivered(0), started(false) {}
+
+  ~PacedAudioSource() override { stop(); }
+
+  bool open() override {
+    if (!inner->open()) {
+      error = inner->lastError();
+      return false;
+    }
+    sliceFrames =
+        static_cast<size_t>(inner->format().sampleRate) * packetMs / 1000;
+    if (sliceFrames == 0) sliceFrames = 1;
+    return true;
+  }
+
+  AudioFormat format() const override { return inner->format(); }
+
+  size_t maxPacketFrames() const override { return sliceFrames; }
+
+  AudioReadStatus acquire(AudioPacket *packet) override {
+    if (!started) {
+      startTime = std::chrono::steady_clock::now();
+      started = true;
+    }
+    // 次のパケットの末尾がまだ届いていない時刻なら待たせる
+    const double elapsed = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - startTime)
+                               .count();
+    if (static_cast<double>(delivered + sliceFrames) >
+        elapsed * inner->format().sampleRate)
+      return AudioReadStatus::Empty;
+
+    if (remaining == 0) {
+      AudioReadStatus status = inner->acquire(&current);
+      if (status != AudioReadStatus::Ok) {
+        if (status == AudioReadStatus::Error) error = inner->lastError();
+        return status;
+      }
+      offset = 0;
+      remaining = current.frames;
+    }
+    packet->data = current.data + offset * inner->format().frameBytes;
+    packet->frames = remaining < sliceFrames ? remaining : sliceFrames;
+    packet->silent = current.silent;
+    packet->position = current.position + offset;
+    packet->qpcPosition = 0;
+    if (current.qpcPosition != 0)
+      packet->qpcPosition = current.qpcPosition +
+                            offset * 10000000 / inner->format().sampleRate;
+    return AudioReadStatus::Ok;
+  }
+
+  bool release(const AudioPacket &packet) override {
+    offset += packet.frames;
+    remaining -= packet.frames;
+    delivered += packet.frames;
+    if (remaining > 0) return true;
+    if (inner->release(current)) return true;
+    error = inner->lastError();
+    return false;
+  }
+
+  void stop() override {
+    if (remaining > 0) inner->release(current);
+    remaining = 0;
+    inner->stop();
+  }
+
+  bool isRealtime() const override { return true; }
+
+ private:
+  AudioSource *inner;
+  int packetMs;
+  size_t sliceFrames;   // 1パケットのフレーム数
+  AudioPacket current;  // 切り分け中の入力元のパケット
+  size_t offset;        // current のうち渡し終えたフレーム数
+  size_t remaining;     // current のうちまだ渡していないフレーム数
+  uint64_t delivered;   // これまでに渡したフレーム数
+  bool started;
+  std::chrono::steady_clock::time_point startTime;
+};
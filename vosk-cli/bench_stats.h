@@ -0,0 +1,226 @@
+﻿//-----------------------------------------------------------------------------
+// ベンチマークの計測
+// 音声の到着から認識結果までの遅延、パーセンタイル、最大常駐メモリ、
+// 文字誤り率を求めます
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+//--
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "spsc_ring.h"
+
+/**
+ * @brief 値の集合のパーセンタイルを求める関数（最近接順位法）
+ *
+ * @param values 値（並べ替える）
+ * @param percent パーセンタイル（0〜100）
+ * @return double パーセンタイル値（値がない場合は0）
+ */
+inline double Percentile(std::vector<double> *values, double percent) {
+  if (values->empty()) return 0.0;
+  std::sort(values->begin(), values->end());
+  size_t rank = static_cast<size_t>(percent / 100.0 * values->size() + 0.999);
+  if (rank < 1) rank = 1;
+  if (rank > values->size()) rank = values->size();
+  return (*values)[rank - 1];
+}
+
+/**
+ * @brief プロセスの最大常駐メモリ（バイト）を返す関数
+ */
+inline uint64_t PeakResidentBytes() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;  // LinuxはKB単位
+#endif
+}
+
+/**
+ * @brief 認識結果のJSONから "text" の値を取り出して追記する関数
+ *
+ * エスケープは直後の1文字に戻すだけの簡易な処理です。比較用のため、
+ * 認識結果にほとんど現れない \n や \uXXXX は正しく戻しません。
+ *
+ * @param json 認識結果のJSON
+ * @param text 追記先
+ * @return bool "text" があればtrue
+ */
+inline bool AppendResultText(const std::string &json, std::string *text) {
+  static const char kKey[] = "\"text\":\"";
+  size_t position = json.find(kKey);
+  if (position == std::string::npos) return false;
+  for (position += sizeof(kKey) - 1; position < json.size(); position++) {
+    char c = json[position];
+    if (c == '"') break;
+    if (c == '\\' && position + 1 < json.size()) c = json[++position];
+    *text += c;
+  }
+  return true;
+}
+
+// UTF-8文字列を空白を除いたコードポイントの列にする
+inline std::vector<uint32_t> DecodeWithoutSpaces(const std::string &text) {
+  std::vector<uint32_t> codepoints;
+  codepoints.reserve(text.size());
+  for (size_t i = 0; i < text.size();) {
+    const unsigned char c = static_cast<unsigned char>(text[i]);
+    size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    if (i + length > text.size()) length = text.size() - i;
+    uint32_t codepoint = length == 1 ? c : c & (0x7F >> length);
+    for (size_t j = 1; j < length; j++)
+      codepoint = (codepoint << 6) | (text[i + j] & 0x3F);
+    i += length;
+    // 半角・全角の空白は認識器のトークン区切りのため比較に含めない
+    if (codepoint == ' ' || codepoint == '\t' || codepoint == '\n' ||
+        codepoint == '\r' || codepoint == 0x3000)
+      continue;
+    codepoints.push_back(codepoint);
+  }
+  return codepoints;
+}
+
+/**
+ * @brief 文字単位の編集距離（置換・挿入・削除の数）を求める関数
+ *
+ * 日本語は単語の区切りが認識器の辞書に依存するため、単語ではなく文字で
+ * 比べます。空白は無視します。文字誤り率は errors / 正解の文字数 です。
+ *
+ * @param reference 正解の文字列（UTF-8）
+ * @param hypothesis 認識結果の文字列（UTF-8）
+ * @param referenceLength 正解の文字数の格納先（nullptrの場合は格納しない）
+ * @return size_t 編集距離
+ */
+inline size_t CharacterErrors(const std::string &reference,
+                              const std::string &hypothesis,
+                              size_t *referenceLength = nullptr) {
+  const std::vector<uint32_t> ref = DecodeWithoutSpaces(reference);
+  const std::vector<uint32_t> hyp = DecodeWithoutSpaces(hypothesis);
+  if (referenceLength) *referenceLength = ref.size();
+
+  // 1行分の表だけを持つ動的計画法
+  std::vector<size_t> row(hyp.size() + 1);
+  for (size_t j = 0; j <= hyp.size(); j++) row[j] = j;
+  for (size_t i = 1; i <= ref.size(); i++) {
+    size_t diagonal = row[0];
+    row[0] = i;
+    for (size_t j = 1; j <= hyp.size(); j++) {
+      const size_t substitution = diagonal + (ref[i - 1] != hyp[j - 1]);
+      diagonal = row[j];
+      row[j] = (std::min)({substitution, row[j] + 1, row[j - 1] + 1});
+    }
+  }
+  return row[hyp.size()];
+}
+
+/**
+ * @brief 音声の到着から認識結果の出力までの遅延を記録するクラス
+ *
+ * キャプチャスレッドはリングバッファに書き込むたびに markArrival() で
+ * 書き込んだサンプルの累計と時刻を残します。認識スレッドは読み出した
+ * サンプルの累計を consumed() で伝え、結果を出力したときに record〜() を
+ * 呼ぶと、認識器に渡した最後のサンプルが届いてからの時間が記録されます。
+ * markArrival() はキャプチャスレッド、それ以外は認識スレッドから呼びます。
+ */
+class LatencyProbe {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  LatencyProbe()
+      : marks(kMaxMarks), hasPending(false), previousEnd(0),
+        consumedSamples(0), convertSeconds(0.0) {
+    partialMs.reserve(4096);
+    finalMs.reserve(1024);
+  }
+
+  // リングバッファに書き込んだ直後に、書き込んだサンプルの累計を渡す
+  void markArrival(uint64_t sampleEnd) {
+    ArrivalMark mark = {sampleEnd, Clock::now()};
+    marks.write(&mark, 1);
+  }
+
+  // リングバッファから読み出したサンプルの累計を渡す
+  void consumed(uint64_t sampleEnd) {
+    consumedSamples = sampleEnd;
+    for (;;) {
+      if (!hasPending) {
+        if (marks.read(&pending, 1) == 0) return;
+        hasPending = true;
+      }
+      // 読み出したサンプルを含むパケットなら、その到着時刻を使う
+      if (previousEnd < sampleEnd) lastArrival = pending.time;
+      if (pending.sampleEnd > sampleEnd) return;
+      previousEnd = pending.sampleEnd;
+      hasPending = false;
+    }
+  }
+
+  void recordPartial() { partialMs.push_back(sinceArrival()); }
+
+  // 確定結果の遅延を記録し、テキストを書き起こしに加える
+  void recordFinal(const std::string &resultJson) {
+    finalMs.push_back(sinceArrival());
+    AppendResultText(resultJson, &transcriptText);
+  }
+
+  // 1パケットの変換にかかった時間を加える（キャプチャスレッドから呼ぶ）
+  void recordConversion(Clock::duration elapsed) {
+    convertSeconds += std::chrono::duration<double>(elapsed).count();
+  }
+
+  // 読み出したサンプルの累計
+  uint64_t samples() const { return consumedSamples; }
+
+  // 確定結果のテキストをつなげた書き起こし
+  const std::string &transcript() const { return transcriptText; }
+
+  // 変換にかかった時間の合計（秒）
+  double conversionSeconds() const { return convertSeconds; }
+
+  std::vector<double> &partialLatencies() { return partialMs; }
+  std::vector<double> &finalLatencies() { return finalMs; }
+
+ private:
+  struct ArrivalMark {
+    uint64_t sampleEnd;  // このときまでに書き込んだサンプルの累計
+    Clock::time_point time;
+  };
+
+  // リングバッファにたまる最大パケット数より十分大きくする
+  static const size_t kMaxMarks = 4096;
+
+  double sinceArrival() const {
+    return std::chrono::duration<double, std::milli>(Clock::now() -
+                                                     lastArrival)
+        .count();
+  }
+
+  SpscRingBuffer<ArrivalMark> marks;
+  ArrivalMark pending;  // 読み出したがまだ消費していない到着記録
+  bool hasPending;
+  uint64_t previousEnd;  // 消費した到着記録の sampleEnd
+  Clock::time_point lastArrival;  // 認識器に渡した最後のサンプルの到着時刻
+  uint64_t consumedSamples;
+  std::vector<double> partialMs;  // 部分認識結果の遅延（ミリ秒）
+  std::vector<double> finalMs;    // 確定結果の遅延（ミリ秒）
+  std::string transcriptText;     // 確定結果のテキスト
+  double convertSeconds;          // 変換にかかった時間（秒）
+};
@@ -0,0 +1,141 @@
+﻿//-----------------------------------------------------------------------------
+// 長いファイルを無音付近で分割する位置の決定
+// 10ms単位のエネルギー列から、目標の長さ付近で最も静かな区間を探します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+//--
+#include <algorithm>
+#include <vector>
+
+/**
+ * @brief 16ビットPCMの平均二乗エネルギーを計算する関数
+ *
+ * @param samples サンプル列
+ * @param count サンプル数
+ * @return float 平均二乗値（-1..1 に正規化）
+ */
+inline float FrameEnergy(const short *samples, size_t count) {
+  if (count == 0) return 0.0f;
+  double sum = 0.0;
+  for (size_t i = 0; i < count; i++) {
+    double v = samples[i] / 32768.0;
+    sum += v * v;
+  }
+  return static_cast<float>(sum / count);
+}
+
+/**
+ * @brief float（-1..1）のサンプル列の平均二乗エネルギーを計算する関数
+ *
+ * @param samples サンプル列
+ * @param count サンプル数
+ * @return float 平均二乗値
+ */
+inline float FrameEnergy(const float *samples, size_t count) {
+  if (count == 0) return 0.0f;
+  double sum = 0.0;
+  for (size_t i = 0; i < count; i++) sum += samples[i] * samples[i];
+  return static_cast<float>(sum / count);
+}
+
+/**
+ * @brief 必要な区間のエネルギーだけを読み出しながら分割位置を決める関数
+ *
+ * 直前の分割位置から targetFrames 進んだ点を中心に ±searchFrames の範囲で、
+ * windowFrames 幅の平均エネルギーが最小になる区間を探し、その中央で分割します。
+ * 無音が見つからない場合でも範囲内で最も静かな位置を選ぶため、
+ * 1チャンクの長さは targetFrames ± searchFrames に収まります。
+ *
+ * エネルギーは探す範囲の分だけ readEnergy で読み出すため、
+ * 入力全体のうち読むのはおよそ 2 * searchFrames / targetFrames の割合です。
+ *
+ * @param total 入力全体のフレーム数
+ * @param targetFrames 1チャンクの目標フレーム数
+ * @param searchFrames 目標位置から前後に探すフレーム数（targetFrames未満）
+ * @param windowFrames 静かさを比べる区間のフレーム数
+ * @param readEnergy bool(size_t start, size_t count, float *energy) で
+ *                   フレーム start から count 個のエネルギーを読み出す関数
+ *                   （falseを返すとそれ以降は分割しない）
+ * @return std::vector<size_t> 分割位置（フレーム番号、昇順。先頭と末尾は含まない）
+ */
+template <typename EnergyReader>
+std::vector<size_t> PlanSilenceSplits(size_t total, size_t targetFrames,
+                                      size_t searchFrames, size_t windowFrames,
+                                      EnergyReader readEnergy) {
+  std::vector<size_t> splits;
+  if (windowFrames == 0) windowFrames = 1;
+  if (searchFrames >= targetFrames) searchFrames = targetFrames / 2;
+  if (total < windowFrames) return splits;
+
+  std::vector<float> energy;
+  std::vector<double> prefix;
+  size_t position = 0;
+  // 最後のチャンクが短くなりすぎないよう、残りが十分ある間だけ分割する
+  while (total - position > targetFrames + searchFrames) {
+    size_t center = position + targetFrames;
+    size_t lo = center - searchFrames;
+    size_t hi = center + searchFrames;
+    if (hi > total - windowFrames) hi = total - windowFrames;
+    if (hi < lo) break;
+
+    // 探す範囲のエネルギーを読み、区間和を定数時間で求めるための累積和を作る
+    const size_t count = hi - lo + windowFrames;
+    energy.resize(count);
+    if (!readEnergy(lo, count, energy.data())) break;
+    prefix.assign(count + 1, 0.0);
+    for (size_t i = 0; i < count; i++) prefix[i + 1] = prefix[i] + energy[i];
+
+    size_t best = 0;
+    double bestSum = prefix[windowFrames];
+    for (size_t w = 1; w <= hi - lo; w++) {
+      double sum = prefix[w + windowFrames] - prefix[w];
+      if (sum < bestSum) {
+        bestSum = sum;
+        best = w;
+      }
+    }
+
+    position = lo + best + windowFrames / 2;
+    splits.push_back(position);
+  }
+  return splits;
+}
+
+/**
+ * @brief エネルギー列全体から分割位置を決める関数
+ *
+ * @param energy フレームごとのエネルギー
+ * @param targetFrames 1チャンクの目標フレーム数
+ * @param searchFrames 目標位置から前後に探すフレーム数（targetFrames未満）
+ * @param windowFrames 静かさを比べる区間のフレーム数
+ * @return std::vector<size_t> 分割位置（フレーム番号、昇順。先頭と末尾は含まない）
+ */
+inline std::vector<size_t> PlanSilenceSplits(const std::vector<float> &energy,
+                                             size_t targetFrames,
+                                             size_t searchFrames,
+                                             size_t windowFrames) {
+  return PlanSilenceSplits(
+      energy.size(), targetFrames, searchFrames, windowFrames,
+      [&energy](size_t start, size_t count, float *out) {
+        std::copy(energy.begin() + start, energy.begin() + start + count, out);
+        return true;
+      });
+}
+
+/**
+ * @brief チャンクの単語の時刻をファイル先頭からの時刻に直す補正量を求める関数
+ *
+ * VOSKの単語の時刻は認識器を作成してから渡したサンプルの通算で数えられ、
+ * vosk_recognizer_reset() でも0に戻りません。1つの認識器で複数のチャンクを
+ * 続けて認識する場合は、それまでに渡した分を差し引く必要があります。
+ *
+ * @param chunkOffsetSeconds チャンクのファイル先頭からの開始時刻
+ * @param samplesFed チャンクの前にこの認識器へ渡した16kHzのサンプル数
+ * @return double 結果の時刻に加算する秒数（ShiftTimestamps() に渡す値）
+ */
+inline double ChunkTimeShift(double chunkOffsetSeconds, uint64_t samplesFed) {
+  return chunkOffsetSeconds - static_cast<double>(samplesFed) / 16000.0;
+}
@@ -0,0 +1,493 @@
+﻿//-----------------------------------------------------------------------------
+// 標準入力の制御チャネル
+// 1行1つのJSONコマンドを読み、実行中の認識セッションへ届けます
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+//--
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json_writer.h"
+
+/**
+ * @brief JSONの値を1つ読み飛ばし、終わりの位置を返す関数
+ *
+ * 文字列・数値・リテラル・配列・オブジェクトのいずれにも対応します。
+ *
+ * @param json JSON
+ * @param position 値の先頭（空白は読み飛ばす）
+ * @return size_t 値の直後の位置（不正な場合は std::string::npos）
+ */
+inline size_t SkipJsonValue(const std::string &json, size_t position) {
+  int depth = 0;
+  while (position < json.size()) {
+    const char c = json[position];
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n' ||
+        (depth > 0 && (c == ',' || c == ':'))) {
+      position++;
+      continue;
+    }
+    if (c == '"') {
+      for (position++; position < json.size(); position++) {
+        if (json[position] == '\\') {
+          position++;
+        } else if (json[position] == '"') {
+          break;
+        }
+      }
+      if (position >= json.size()) return std::string::npos;
+      position++;
+    } else if (c == '[' || c == '{') {
+      depth++;
+      position++;
+      continue;
+    } else if (c == ']' || c == '}') {
+      if (depth == 0) return std::string::npos;
+      depth--;
+      position++;
+    } else {
+      // 数値とリテラルは区切りまで読む
+      const size_t start = position;
+      position = json.find_first_of(",]} \t\r\n", position);
+      if (position == std::string::npos) position = json.size();
+      if (position == start) return std::string::npos;
+    }
+    if (depth == 0) return position;
+  }
+  return std::string::npos;
+}
+
+/**
+ * @brief JSON文字列（引用符を含む）のエスケープを戻す関数
+ *
+ * @param json JSON
+ * @param position 開き引用符の位置
+ * @param output 戻した文字列の格納先（UTF-8）
+ * @return size_t 閉じ引用符の直後の位置（不正な場合は std::string::npos）
+ */
+inline size_t ParseJsonString(const std::string &json, size_t position,
+                              std::string *output) {
+  output->clear();
+  if (position >= json.size() || json[position] != '"')
+    return std::string::npos;
+  for (position++; position < json.size(); position++) {
+    char c = json[position];
+    if (c == '"') return position + 1;
+    if (c != '\\') {
+      *output += c;
+      continue;
+    }
+    if (++position >= json.size()) break;
+    c = json[position];
+    switch (c) {
+      case 'n':
+        *output += '\n';
+        break;
+      case 't':
+        *output += '\t';
+        break;
+      case 'r':
+        *output += '\r';
+        break;
+      case 'b':
+        *output += '\b';
+        break;
+      case 'f':
+        *output += '\f';
+        break;
+      case 'u': {
+        if (position + 4 >= json.size()) return std::string::npos;
+        uint32_t codepoint =
+            strtoul(json.substr(position + 1, 4).c_str(), nullptr, 16);
+        position += 4;
+        // サロゲートペアは続く \uXXXX と組み合わせる
+        if (codepoint >= 0xD800 && codepoint < 0xDC00 &&
+            position + 6 < json.size() && json[position + 1] == '\\' &&
+            json[position + 2] == 'u') {
+          const uint32_t low =
+              strtoul(json.substr(position + 3, 4).c_str(), nullptr, 16);
+          codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+          position += 6;
+        }
+        if (codepoint < 0x80) {
+          *output += static_cast<char>(codepoint);
+        } else if (codepoint < 0x800) {
+          *output += static_cast<char>(0xC0 | (codepoint >> 6));
+          *output += static_cast<char>(0x80 | (codepoint & 0x3F));
+        } else if (codepoint < 0x10000) {
+          *output += static_cast<char>(0xE0 | (codepoint >> 12));
+          *output += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+          *output += static_cast<char>(0x80 | (codepoint & 0x3F));
+        } else {
+          *output += static_cast<char>(0xF0 | (codepoint >> 18));
+          *output += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+          *output += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+          *output += static_cast<char>(0x80 | (codepoint & 0x3F));
+        }
+        break;
+      }
+      default:  // \" \\ \/
+        *output += c;
+        break;
+    }
+  }
+  return std::string::npos;
+}
+
+/**
+ * @brief 文字列だけの配列のJSONを読む関数
+ *
+ * @param json ["...", "..."] の形のJSON
+ * @param values 要素の格納先
+ * @return bool 文字列だけの配列であればtrue
+ */
+inline bool ParseJsonStringArray(const std::string &json,
+                                 std::vector<std::string> *values) {
+  values->clear();
+  size_t position = json.find_first_not_of(" \t\r\n");
+  if (position == std::string::npos || json[position] != '[') return false;
+  position++;
+  std::string value;
+  for (;;) {
+    position = json.find_first_not_of(" \t\r\n", position);
+    if (position == std::string::npos) return false;
+    if (json[position] == ']' && values->empty()) break;
+    position = ParseJsonString(json, position, &value);
+    if (position == std::string::npos) return false;
+    values->push_back(value);
+    position = json.find_first_not_of(" \t\r\n", position);
+    if (position == std::string::npos) return false;
+    if (json[position] == ']') break;
+    if (json[position] != ',') return false;
+    position++;
+  }
+  return json.find_first_not_of(" \t\r\n", position + 1) == std::string::npos;
+}
+
+/**
+ * @brief 制御チャネルで受け取った1つのコマンド
+ *
+ * {"command":"名前","キー":値,...} の形の1段のオブジェクトです。
+ * 値は文字列ならエスケープを戻した文字列、それ以外はJSONのまま持ちます。
+ */
+class ControlCommand {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * @brief 1行のJSONを読む
+   *
+   * @param line コマンドの行
+   * @param error 不正な場合のメッセージの格納先
+   * @return bool 読めた場合はtrue
+   */
+  bool parse(const std::string &line, std::string *error) {
+    fields.clear();
+    received = Clock::now();
+    size_t position = line.find_first_not_of(" \t\r\n");
+    if (position == std::string::npos || line[position] != '{') {
+      *error = "Control command must be a JSON object";
+      return false;
+    }
+    position++;
+    std::string key;
+    for (;;) {
+      position = line.find_first_not_of(" \t\r\n,", position);
+      if (position == std::string::npos) break;
+      if (line[position] == '}') {
+        if (!has("command")) {
+          *error = "Control command has no \"command\"";
+          return false;
+        }
+        return true;
+      }
+      position = ParseJsonString(line, position, &key);
+      if (position != std::string::npos)
+        position = line.find_first_not_of(" \t\r\n", position);
+      if (position == std::string::npos || line[position] != ':') break;
+      position = line.find_first_not_of(" \t\r\n", position + 1);
+      if (position == std::string::npos) break;
+
+      Field &field = fields[key];
+      field.isString = line[position] == '"';
+      const size_t end = field.isString
+                             ? ParseJsonString(line, position, &field.text)
+                             : SkipJsonValue(line, position);
+      if (end == std::string::npos) break;
+      if (!field.isString) field.text.assign(line, position, end - position);
+      position = end;
+    }
+    *error = "Invalid control command: " + line;
+    return false;
+  }
+
+  // "command" の値
+  std::string name() const {
+    std::string value;
+    getString("command", &value);
+    return value;
+  }
+
+  bool has(const char *key) const { return fields.count(key) > 0; }
+
+  // 文字列の値を取り出す（文字列でなければfalse）
+  bool getString(const char *key, std::string *value) const {
+    auto field = fields.find(key);
+    if (field == fields.end() || !field->second.isString) return false;
+    *value = field->second.text;
+    return true;
+  }
+
+  // 整数の値を取り出す（整数でなければfalse）
+  bool getInt(const char *key, int *value) const {
+    auto field = fields.find(key);
+    if (field == fields.end() || field->second.isString) return false;
+    char *end = nullptr;
+    const long number = strtol(field->second.text.c_str(), &end, 10);
+    if (end == field->second.text.c_str() || *end != '\0') return false;
+    *value = static_cast<int>(number);
+    return true;
+  }
+
+  // 真偽値を取り出す（true/false でなければfalse）
+  bool getBool(const char *key, bool *value) const {
+    auto field = fields.find(key);
+    if (field == fields.end() || field->second.isString) return false;
+    if (field->second.text != "true" && field->second.text != "false")
+      return false;
+    *value = field->second.text == "true";
+    return true;
+  }
+
+  // 文字列以外の値をJSONのまま取り出す（配列など）
+  bool getJson(const char *key, std::string *value) const {
+    auto field = fields.find(key);
+    if (field == fields.end() || field->second.isString) return false;
+    *value = field->second.text;
+    return true;
+  }
+
+  /**
+   * @brief 応答 {"ack":"名前",...} を書き始める
+   *
+   * コマンドに "id" があれば同じ値を "id" に付け、受け取ってからの時間を
+   * "latencyMs" に書きます。呼び出し側は "ok" などを追加して閉じます。
+   *
+   * @param writer 書き込み先（clear() して使う）
+   * @param device 応答したセッションのデバイス（負の場合は付けない）
+   */
+  void beginAck(JsonWriter *writer, int device) const {
+    writer->clear();
+    writer->beginObject().key("ack").string(name());
+    auto id = fields.find("id");
+    if (id != fields.end()) {
+      writer->key("id");
+      if (id->second.isString)
+        writer->string(id->second.text);
+      else
+        writer->raw(id->second.text.data(), id->second.text.size());
+    }
+    if (device >= 0) writer->key("device").integer(device);
+    writer->key("latencyMs")
+        .number(std::chrono::duration<double, std::milli>(Clock::now() -
+                                                          received)
+                    .count(),
+                2);
+  }
+
+  Clock::time_point received;  // 行を受け取った時刻
+
+ private:
+  struct Field {
+    bool isString = false;
+    std::string text;
+  };
+  std::map<std::string, Field> fields;
+};
+
+/**
+ * @brief 認識セッションごとのコマンドの受け取り口
+ *
+ * 制御チャネルのスレッドが post() し、認識スレッドが pop() します。
+ * 認識スレッドは毎回ロックを取らないよう、まずフラグだけを確認します。
+ */
+class ControlMailbox {
+ public:
+  ControlMailbox() : pending(false) {}
+
+  void post(const ControlCommand &command) {
+    std::lock_guard<std::mutex> lock(mutex);
+    commands.push_back(command);
+    pending.store(true, std::memory_order_release);
+  }
+
+  // 届いているコマンドを1つ取り出す（なければfalse）
+  bool pop(ControlCommand *command) {
+    if (!pending.load(std::memory_order_acquire)) return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (commands.empty()) {
+      pending.store(false, std::memory_order_relaxed);
+      return false;
+    }
+    *command = commands.front();
+    commands.pop_front();
+    pending.store(!commands.empty(), std::memory_order_relaxed);
+    return true;
+  }
+
+ private:
+  std::mutex mutex;
+  std::deque<ControlCommand> commands;
+  std::atomic<bool> pending;
+};
+
+/**
+ * @brief 標準入力から制御コマンドを読み、セッションへ届けるチャネル
+ *
+ * 入力は1行1つのJSONオブジェクトです。"device" を指定したコマンドは
+ * そのデバイスのセッションだけに、指定しないコマンドはすべてのセッションに
+ * 届けます。JSONとして読めない行は {"error":"..."} を、未知のコマンドと
+ * 届け先のないコマンドは "ok":false の応答を出力して捨てます。
+ *
+ * 読み出しのスレッドは標準入力で止まったまま終了できないため切り離します。
+ * 状態は共有ポインタで持ち、チャネルを破棄した後の行は捨てます。
+ */
+class ControlChannel {
+ public:
+  /**
+   * @param output エラーの出力先
+   * @param commands 受け付けるコマンド名
+   */
+  ControlChannel(JsonLineOutput *output,
+                 const std::vector<std::string> &commands)
+      : state(std::make_shared<State>()) {
+    state->output = output;
+    state->commands = commands;
+  }
+
+  ~ControlChannel() {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->closed = true;
+    state->sessions.clear();
+  }
+
+  ControlChannel(const ControlChannel &) = delete;
+  ControlChannel &operator=(const ControlChannel &) = delete;
+
+  // 読み出しのスレッドを開始する
+  void start(FILE *input) {
+    std::thread(ReadLoop, state, input).detach();
+  }
+
+  /**
+   * @brief セッションの受け取り口を登録する
+   *
+   * @param device セッションのデバイスのインデックス（単一入力では-1）
+   * @param mailbox 受け取り口（unsubscribe() まで有効であること）
+   */
+  void subscribe(int device, ControlMailbox *mailbox) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->sessions.push_back(Session{device, mailbox});
+  }
+
+  void unsubscribe(ControlMailbox *mailbox) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    auto &sessions = state->sessions;
+    sessions.erase(std::remove_if(sessions.begin(), sessions.end(),
+                                  [mailbox](const Session &session) {
+                                    return session.mailbox == mailbox;
+                                  }),
+                   sessions.end());
+  }
+
+ private:
+  struct Session {
+    int device;
+    ControlMailbox *mailbox;
+  };
+
+  struct State {
+    std::mutex mutex;
+    JsonLineOutput *output = nullptr;
+    std::vector<std::string> commands;
+    std::vector<Session> sessions;
+    bool closed = false;
+  };
+
+  static void ReadLoop(std::shared_ptr<State> state, FILE *input) {
+    std::string line;
+    ControlCommand command;
+    std::string error;
+    for (;;) {
+      line.clear();
+      int c;
+      while ((c = fgetc(input)) != EOF && c != '\n')
+        line += static_cast<char>(c);
+      if (c == EOF && line.empty()) break;
+      if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+      if (!command.parse(line, &error)) {
+        Report(*state, error);
+        continue;
+      }
+      Dispatch(*state, command);
+    }
+  }
+
+  static void Dispatch(State &state, const ControlCommand &command) {
+    const std::string name = command.name();
+    if (std::find(state.commands.begin(), state.commands.end(), name) ==
+        state.commands.end()) {
+      Reject(state, command, "Unknown control command");
+      return;
+    }
+    int device = -1;
+    const bool targeted = command.getInt("device", &device);
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.closed) return;
+    bool delivered = false;
+    for (const Session &session : state.sessions) {
+      if (targeted && session.device != device) continue;
+      session.mailbox->post(command);
+      delivered = true;
+    }
+    if (!delivered) {
+      JsonWriter writer;
+      command.beginAck(&writer, -1);
+      writer.key("ok").boolean(false).key("error").string(
+          "No session for control command");
+      state.output->writeLine(writer.endObject());
+    }
+  }
+
+  static void Report(State &state, const std::string &message) {
+    JsonWriter writer;
+    writer.beginObject().key("error").string(message).endObject();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (!state.closed) state.output->writeLine(writer);
+  }
+
+  static void Reject(State &state, const ControlCommand &command,
+                     const char *message) {
+    JsonWriter writer;
+    command.beginAck(&writer, -1);
+    writer.key("ok").boolean(false).key("error").string(message).endObject();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (!state.closed) state.output->writeLine(writer);
+  }
+
+  std::shared_ptr<State> state;
+};
@@ -0,0 +1,608 @@
+﻿//-----------------------------------------------------------------------------
+// サンプル形式変換・ダウンミックスのカーネル群
+// (形式, チャンネル数) ごとに専用の関数を用意し、CPUに合わせて実行時に選択します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || \
+    defined(__i386__)
+#define DOWNMIX_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVCはオプションなしでAVX2組み込み関数を使えるが、GCC/Clangは関数単位の指定が必要
+#if defined(DOWNMIX_X86) && !defined(_MSC_VER)
+#define DOWNMIX_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define DOWNMIX_TARGET_AVX2
+#endif
+
+/**
+ * @brief 入力バッファのサンプル形式
+ */
+enum class SampleFormat {
+  Unknown,
+  UInt8,    // 8ビット符号なしPCM
+  Int16,    // 16ビット符号ありPCM
+  Int24,    // 24ビット符号ありPCM（3バイト詰め）
+  Int32,    // 32ビット符号ありPCM
+  Float32,  // IEEE 32ビット浮動小数点
+};
+
+/**
+ * @brief 使用するSIMD命令セット
+ */
+enum class SimdLevel {
+  Scalar,
+  SSE2,
+  AVX2,
+};
+
+/**
+ * @brief ダウンミックスカーネルの関数型
+ *
+ * インターリーブされた入力 frames フレームをチャンネル平均でモノラル化し、
+ * -1.0〜1.0 に正規化したfloatとして dst に書き込みます。
+ *
+ * @param src 入力バッファ
+ * @param frames フレーム数
+ * @param channels チャンネル数（固定チャンネル版では無視される）
+ * @param dst 出力先（frames 要素）
+ */
+typedef void (*DownmixKernel)(const uint8_t *src, size_t frames, int channels,
+                              float *dst);
+
+/**
+ * @brief サンプル形式ごとの読み出し方法と正規化係数
+ */
+template <SampleFormat F>
+struct SampleTraits;
+
+template <>
+struct SampleTraits<SampleFormat::UInt8> {
+  static const int kBytes = 1;
+  static float read(const uint8_t *p) { return (p[0] - 128) * (1.0f / 128); }
+};
+
+template <>
+struct SampleTraits<SampleFormat::Int16> {
+  static const int kBytes = 2;
+  static float read(const uint8_t *p) {
+    int16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v * (1.0f / 32768.0f);
+  }
+};
+
+template <>
+struct SampleTraits<SampleFormat::Int24> {
+  static const int kBytes = 3;
+  static int32_t readInt(const uint8_t *p) {
+    // 上位3バイトに詰めて符号をそのまま活かす（下位8ビットは0）
+    return static_cast<int32_t>((static_cast<uint32_t>(p[0]) << 8) |
+                                (static_cast<uint32_t>(p[1]) << 16) |
+                                (static_cast<uint32_t>(p[2]) << 24));
+  }
+  static float read(const uint8_t *p) {
+    return readInt(p) * (1.0f / 2147483648.0f);
+  }
+};
+
+template <>
+struct SampleTraits<SampleFormat::Int32> {
+  static const int kBytes = 4;
+  static float read(const uint8_t *p) {
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v * (1.0f / 2147483648.0f);
+  }
+};
+
+template <>
+struct SampleTraits<SampleFormat::Float32> {
+  static const int kBytes = 4;
+  static float read(const uint8_t *p) {
+    float v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+};
+
+//-----------------------------------------------------------------------------
+// スカラー版（全形式・全チャンネル数の基準実装）
+//-----------------------------------------------------------------------------
+
+/**
+ * @brief スカラー版ダウンミックス
+ *
+ * Channels > 0 のときはチャンネル数をコンパイル時定数として展開します。
+ */
+template <SampleFormat F, int Channels>
+void DownmixScalar(const uint8_t *src, size_t frames, int channels,
+                   float *dst) {
+  typedef SampleTraits<F> T;
+  const int ch = Channels > 0 ? Channels : channels;
+  const size_t stride = static_cast<size_t>(ch) * T::kBytes;
+  const float scale = 1.0f / ch;
+  for (size_t f = 0; f < frames; f++, src += stride) {
+    float sum = 0.0f;
+    for (int c = 0; c < ch; c++) sum += T::read(src + c * T::kBytes);
+    dst[f] = sum * scale;
+  }
+}
+
+#if defined(DOWNMIX_X86)
+//-----------------------------------------------------------------------------
+// SSE2版
+//-----------------------------------------------------------------------------
+
+/**
+ * @brief 4チャンネル分の連続サンプルを正規化前のfloatとして読むローダ
+ *
+ * scale は整数→-1.0〜1.0 の正規化係数です。
+ */
+template <SampleFormat F>
+struct Sse2Loader;
+
+template <>
+struct Sse2Loader<SampleFormat::Int16> {
+  static __m128 load4(const uint8_t *p) {
+    __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+  }
+  static float scale() { return 1.0f / 32768.0f; }
+};
+
+template <>
+struct Sse2Loader<SampleFormat::Int24> {
+  static __m128 load4(const uint8_t *p) {
+    typedef SampleTraits<SampleFormat::Int24> T;
+    return _mm_cvtepi32_ps(_mm_set_epi32(T::readInt(p + 9), T::readInt(p + 6),
+                                         T::readInt(p + 3), T::readInt(p)));
+  }
+  static float scale() { return 1.0f / 2147483648.0f; }
+};
+
+template <>
+struct Sse2Loader<SampleFormat::Int32> {
+  static __m128 load4(const uint8_t *p) {
+    return _mm_cvtepi32_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+  }
+  static float scale() { return 1.0f / 2147483648.0f; }
+};
+
+template <>
+struct Sse2Loader<SampleFormat::Float32> {
+  static __m128 load4(const uint8_t *p) {
+    return _mm_loadu_ps(reinterpret_cast<const float *>(p));
+  }
+  static float scale() { return 1.0f; }
+};
+
+// モノラル: 4サンプルずつ変換して正規化
+template <SampleFormat F>
+void DownmixMonoSse2(const uint8_t *src, size_t frames, int, float *dst) {
+  typedef SampleTraits<F> T;
+  const __m128 scale = _mm_set1_ps(Sse2Loader<F>::scale());
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    __m128 v = Sse2Loader<F>::load4(src + f * T::kBytes);
+    _mm_storeu_ps(dst + f, _mm_mul_ps(v, scale));
+  }
+  DownmixScalar<F, 1>(src + f * T::kBytes, frames - f, 1, dst + f);
+}
+
+// ステレオ: 4フレーム（8サンプル）を読み、偶数/奇数レーンを足し合わせる
+template <SampleFormat F>
+void DownmixStereoSse2(const uint8_t *src, size_t frames, int, float *dst) {
+  typedef SampleTraits<F> T;
+  const __m128 scale = _mm_set1_ps(Sse2Loader<F>::scale() * 0.5f);
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    const uint8_t *p = src + f * 2 * T::kBytes;
+    __m128 a = Sse2Loader<F>::load4(p);
+    __m128 b = Sse2Loader<F>::load4(p + 4 * T::kBytes);
+    __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(dst + f, _mm_mul_ps(_mm_add_ps(left, right), scale));
+  }
+  DownmixScalar<F, 2>(src + f * 2 * T::kBytes, frames - f, 2, dst + f);
+}
+
+// 16ビットステレオ: pmaddwd で隣接ペアを整数のまま加算
+inline void DownmixInt16StereoSse2(const uint8_t *src, size_t frames, int,
+                                   float *dst) {
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128 scale = _mm_set1_ps(1.0f / 65536.0f);
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    __m128i x =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + f * 4));
+    __m128i sum = _mm_madd_epi16(x, ones);
+    _mm_storeu_ps(dst + f, _mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+  }
+  DownmixScalar<SampleFormat::Int16, 2>(src + f * 4, frames - f, 2, dst + f);
+}
+
+// 4フレーム分のチャンネル和ベクトルを転置して、フレームごとの合計にする
+inline __m128 SumLanes4(__m128 a, __m128 b, __m128 c, __m128 d) {
+  _MM_TRANSPOSE4_PS(a, b, c, d);
+  return _mm_add_ps(_mm_add_ps(a, b), _mm_add_ps(c, d));
+}
+
+// 多チャンネル: 4チャンネル単位でベクトル加算し、端数チャンネルはスカラーで足す
+// Channels > 0 のときはグループ数がコンパイル時に決まり、ループが展開される
+template <SampleFormat F, int Channels>
+void DownmixMultiSse2(const uint8_t *src, size_t frames, int channels,
+                      float *dst) {
+  typedef SampleTraits<F> T;
+  const int ch = Channels > 0 ? Channels : channels;
+  const size_t stride = static_cast<size_t>(ch) * T::kBytes;
+  const int groups = ch / 4;
+  const int tailStart = groups * 4;
+  const __m128 scale = _mm_set1_ps(Sse2Loader<F>::scale() / ch);
+  const __m128 tailScale = _mm_set1_ps(1.0f / ch);
+
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    __m128 acc[4];
+    float tail[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < 4; i++) {
+      const uint8_t *p = src + (f + i) * stride;
+      __m128 sum = _mm_setzero_ps();
+      for (int g = 0; g < groups; g++)
+        sum = _mm_add_ps(sum, Sse2Loader<F>::load4(p + g * 4 * T::kBytes));
+      acc[i] = sum;
+      for (int c = tailStart; c < ch; c++) tail[i] += T::read(p + c * T::kBytes);
+    }
+    __m128 total =
+        _mm_mul_ps(SumLanes4(acc[0], acc[1], acc[2], acc[3]), scale);
+    // 端数チャンネルは読み出し時点で正規化済み
+    if (tailStart < ch)
+      total = _mm_add_ps(
+          total, _mm_mul_ps(_mm_setr_ps(tail[0], tail[1], tail[2], tail[3]),
+                            tailScale));
+    _mm_storeu_ps(dst + f, total);
+  }
+  DownmixScalar<F, Channels>(src + f * stride, frames - f, ch, dst + f);
+}
+
+// 5.1ch: 4フレーム（24サンプル）を6ベクトルで読み、フレーム境界をまたぐ
+// 中央のベクトルを上下に分けて足すことで、端数チャンネルのスカラー処理をなくす
+template <SampleFormat F>
+void DownmixSixSse2(const uint8_t *src, size_t frames, int, float *dst) {
+  typedef SampleTraits<F> T;
+  const size_t stride = 6 * T::kBytes;
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 scale = _mm_set1_ps(Sse2Loader<F>::scale() / 6);
+  size_t f = 0;
+  for (; f + 4 <= frames; f += 4) {
+    const uint8_t *p = src + f * stride;
+    __m128 v1 = Sse2Loader<F>::load4(p + 4 * T::kBytes);
+    __m128 v4 = Sse2Loader<F>::load4(p + 16 * T::kBytes);
+    __m128 a = _mm_add_ps(Sse2Loader<F>::load4(p), _mm_movelh_ps(v1, zero));
+    __m128 b = _mm_add_ps(Sse2Loader<F>::load4(p + 8 * T::kBytes),
+                          _mm_movehl_ps(zero, v1));
+    __m128 c = _mm_add_ps(Sse2Loader<F>::load4(p + 12 * T::kBytes),
+                          _mm_movelh_ps(v4, zero));
+    __m128 d = _mm_add_ps(Sse2Loader<F>::load4(p + 20 * T::kBytes),
+                          _mm_movehl_ps(zero, v4));
+    _mm_storeu_ps(dst + f, _mm_mul_ps(SumLanes4(a, b, c, d), scale));
+  }
+  DownmixScalar<F, 6>(src + f * stride, frames - f, 6, dst + f);
+}
+
+//-----------------------------------------------------------------------------
+// AVX2版
+//-----------------------------------------------------------------------------
+
+template <SampleFormat F>
+struct Avx2Loader;
+
+// load8 は8サンプル、load4 は4サンプルを正規化前のfloatとして読む
+template <>
+struct Avx2Loader<SampleFormat::Int16> {
+  static __m128 load4(const uint8_t *p) {
+    return Sse2Loader<SampleFormat::Int16>::load4(p);
+  }
+  DOWNMIX_TARGET_AVX2 static __m256 load8(const uint8_t *p) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(x));
+  }
+};
+
+template <>
+struct Avx2Loader<SampleFormat::Int24> {
+  // 12バイト（4サンプル）を各32ビットの上位3バイトへ並べ替える
+  DOWNMIX_TARGET_AVX2 static __m128i load4i(const uint8_t *p) {
+    const __m128i shuffle =
+        _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    return _mm_shuffle_epi8(x, shuffle);
+  }
+  DOWNMIX_TARGET_AVX2 static __m128 load4(const uint8_t *p) {
+    return _mm_cvtepi32_ps(load4i(p));
+  }
+  DOWNMIX_TARGET_AVX2 static __m256 load8(const uint8_t *p) {
+    __m256i x = _mm256_set_m128i(load4i(p + 12), load4i(p));
+    return _mm256_cvtepi32_ps(x);
+  }
+};
+
+template <>
+struct Avx2Loader<SampleFormat::Int32> {
+  static __m128 load4(const uint8_t *p) {
+    return Sse2Loader<SampleFormat::Int32>::load4(p);
+  }
+  DOWNMIX_TARGET_AVX2 static __m256 load8(const uint8_t *p) {
+    return _mm256_cvtepi32_ps(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+  }
+};
+
+template <>
+struct Avx2Loader<SampleFormat::Float32> {
+  static __m128 load4(const uint8_t *p) {
+    return Sse2Loader<SampleFormat::Float32>::load4(p);
+  }
+  DOWNMIX_TARGET_AVX2 static __m256 load8(const uint8_t *p) {
+    return _mm256_loadu_ps(reinterpret_cast<const float *>(p));
+  }
+};
+
+// 24ビットは16バイト読みで4バイト先まで触れるため、末尾のフレームを残して止める
+template <SampleFormat F>
+inline size_t Avx2SafeFrames(size_t frames, size_t frameBytes) {
+  if (F != SampleFormat::Int24) return frames;
+  size_t reserve = (4 + frameBytes - 1) / frameBytes;
+  return frames >= reserve ? frames - reserve : 0;
+}
+
+// モノラル: 8サンプルずつ変換して正規化
+template <SampleFormat F>
+DOWNMIX_TARGET_AVX2 void DownmixMonoAvx2(const uint8_t *src, size_t frames,
+                                         int, float *dst) {
+  typedef SampleTraits<F> T;
+  const __m256 scale = _mm256_set1_ps(Sse2Loader<F>::scale());
+  const size_t limit = Avx2SafeFrames<F>(frames, T::kBytes);
+  size_t f = 0;
+  for (; f + 8 <= limit; f += 8) {
+    __m256 v = Avx2Loader<F>::load8(src + f * T::kBytes);
+    _mm256_storeu_ps(dst + f, _mm256_mul_ps(v, scale));
+  }
+  DownmixScalar<F, 1>(src + f * T::kBytes, frames - f, 1, dst + f);
+}
+
+// ステレオ: 8フレーム（16サンプル）を水平加算し、レーン順を並べ直す
+template <SampleFormat F>
+DOWNMIX_TARGET_AVX2 void DownmixStereoAvx2(const uint8_t *src, size_t frames,
+                                           int, float *dst) {
+  typedef SampleTraits<F> T;
+  const __m256 scale = _mm256_set1_ps(Sse2Loader<F>::scale() * 0.5f);
+  const size_t limit = Avx2SafeFrames<F>(frames, 2 * T::kBytes);
+  size_t f = 0;
+  for (; f + 8 <= limit; f += 8) {
+    const uint8_t *p = src + f * 2 * T::kBytes;
+    __m256 a = Avx2Loader<F>::load8(p);
+    __m256 b = Avx2Loader<F>::load8(p + 8 * T::kBytes);
+    // [a01 a23 b01 b23 | a45 a67 b45 b67] -> 64ビット単位で 0,2,1,3 に並べ替え
+    __m256 sum = _mm256_hadd_ps(a, b);
+    sum = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sum),
+                                                 _MM_SHUFFLE(3, 1, 2, 0)));
+    _mm256_storeu_ps(dst + f, _mm256_mul_ps(sum, scale));
+  }
+  DownmixScalar<F, 2>(src + f * 2 * T::kBytes, frames - f, 2, dst + f);
+}
+
+// 16ビットステレオ: vpmaddwd で隣接ペアを整数のまま加算（8フレームずつ）
+DOWNMIX_TARGET_AVX2 inline void DownmixInt16StereoAvx2(const uint8_t *src,
+                                                       size_t frames, int,
+                                                       float *dst) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256 scale = _mm256_set1_ps(1.0f / 65536.0f);
+  size_t f = 0;
+  for (; f + 8 <= frames; f += 8) {
+    __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + f * 4));
+    __m256i sum = _mm256_madd_epi16(x, ones);
+    _mm256_storeu_ps(dst + f, _mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+  }
+  DownmixScalar<SampleFormat::Int16, 2>(src + f * 4, frames - f, 2, dst + f);
+}
+
+// 多チャンネル: 8チャンネル単位で加算し、4チャンネル単位・スカラーで端数を処理
+template <SampleFormat F, int Channels>
+DOWNMIX_TARGET_AVX2 void DownmixMultiAvx2(const uint8_t *src, size_t frames,
+                                          int channels, float *dst) {
+  typedef SampleTraits<F> T;
+  const int ch = Channels > 0 ? Channels : channels;
+  const size_t stride = static_cast<size_t>(ch) * T::kBytes;
+  const int groups8 = ch / 8;
+  const int groups4 = (ch - groups8 * 8) / 4;
+  const int tailStart = groups8 * 8 + groups4 * 4;
+  const __m128 scale = _mm_set1_ps(Sse2Loader<F>::scale() / ch);
+  const __m128 tailScale = _mm_set1_ps(1.0f / ch);
+  const size_t limit = Avx2SafeFrames<F>(frames, stride);
+
+  size_t f = 0;
+  for (; f + 4 <= limit; f += 4) {
+    __m128 acc[4];
+    float tail[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < 4; i++) {
+      const uint8_t *p = src + (f + i) * stride;
+      __m256 wide = _mm256_setzero_ps();
+      for (int g = 0; g < groups8; g++)
+        wide = _mm256_add_ps(wide, Avx2Loader<F>::load8(p + g * 8 * T::kBytes));
+      __m128 sum = _mm_add_ps(_mm256_castps256_ps128(wide),
+                              _mm256_extractf128_ps(wide, 1));
+      const uint8_t *q = p + groups8 * 8 * T::kBytes;
+      for (int g = 0; g < groups4; g++)
+        sum = _mm_add_ps(sum, Avx2Loader<F>::load4(q + g * 4 * T::kBytes));
+      acc[i] = sum;
+      for (int c = tailStart; c < ch; c++) tail[i] += T::read(p + c * T::kBytes);
+    }
+    __m128 total =
+        _mm_mul_ps(SumLanes4(acc[0], acc[1], acc[2], acc[3]), scale);
+    if (tailStart < ch)
+      total = _mm_add_ps(
+          total, _mm_mul_ps(_mm_setr_ps(tail[0], tail[1], tail[2], tail[3]),
+                            tailScale));
+    _mm_storeu_ps(dst + f, total);
+  }
+  DownmixScalar<F, Channels>(src + f * stride, frames - f, ch, dst + f);
+}
+// 5.1ch: SSE2版と同じ並べ方で、24ビットはpshufb版のローダを使う
+template <SampleFormat F>
+DOWNMIX_TARGET_AVX2 void DownmixSixAvx2(const uint8_t *src, size_t frames,
+                                        int, float *dst) {
+  typedef SampleTraits<F> T;
+  typedef Avx2Loader<F> L;
+  const size_t stride = 6 * T::kBytes;
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 scale = _mm_set1_ps(Sse2Loader<F>::scale() / 6);
+  const size_t limit = Avx2SafeFrames<F>(frames, stride);
+  size_t f = 0;
+  for (; f + 4 <= limit; f += 4) {
+    const uint8_t *p = src + f * stride;
+    __m128 v1 = L::load4(p + 4 * T::kBytes);
+    __m128 v4 = L::load4(p + 16 * T::kBytes);
+    __m128 a = _mm_add_ps(L::load4(p), _mm_movelh_ps(v1, zero));
+    __m128 b = _mm_add_ps(L::load4(p + 8 * T::kBytes), _mm_movehl_ps(zero, v1));
+    __m128 c =
+        _mm_add_ps(L::load4(p + 12 * T::kBytes), _mm_movelh_ps(v4, zero));
+    __m128 d =
+        _mm_add_ps(L::load4(p + 20 * T::kBytes), _mm_movehl_ps(zero, v4));
+    _mm_storeu_ps(dst + f, _mm_mul_ps(SumLanes4(a, b, c, d), scale));
+  }
+  DownmixScalar<F, 6>(src + f * stride, frames - f, 6, dst + f);
+}
+#endif  // DOWNMIX_X86
+
+//-----------------------------------------------------------------------------
+// 実行時選択
+//-----------------------------------------------------------------------------
+
+/**
+ * @brief 実行中のCPUが対応するSIMD命令セットを判定する関数
+ *
+ * @return SimdLevel 利用可能な最上位の命令セット
+ */
+inline SimdLevel DetectSimdLevel() {
+#if defined(DOWNMIX_X86)
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] >= 7) {
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0;
+    // OSがYMMレジスタを保存するかも確認する
+    if (osxsave && avx && avx2 && (_xgetbv(0) & 6) == 6)
+      return SimdLevel::AVX2;
+  }
+  return SimdLevel::SSE2;
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+  return SimdLevel::SSE2;
+#endif
+#else
+  return SimdLevel::Scalar;
+#endif
+}
+
+// 判定結果をプロセス内でキャッシュする
+inline SimdLevel CurrentSimdLevel() {
+  static const SimdLevel level = DetectSimdLevel();
+  return level;
+}
+
+inline const char *SimdLevelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::AVX2:
+      return "avx2";
+    case SimdLevel::SSE2:
+      return "sse2";
+    default:
+      return "scalar";
+  }
+}
+
+// 1形式分のカーネルを命令セットとチャンネル数から選ぶ
+template <SampleFormat F>
+DownmixKernel SelectDownmixKernelFor(int channels, SimdLevel level) {
+#if defined(DOWNMIX_X86)
+  // よく使われるチャンネル数（4.0 / 5.1 / 7.1）はチャンネル数固定版を使う
+  if (level == SimdLevel::AVX2) {
+    if (channels == 1) return DownmixMonoAvx2<F>;
+    if (channels == 2) return DownmixStereoAvx2<F>;
+    if (channels == 4) return DownmixMultiAvx2<F, 4>;
+    if (channels == 6) return DownmixSixAvx2<F>;
+    if (channels == 8) return DownmixMultiAvx2<F, 8>;
+    return DownmixMultiAvx2<F, 0>;
+  }
+  if (level == SimdLevel::SSE2) {
+    if (channels == 1) return DownmixMonoSse2<F>;
+    if (channels == 2) return DownmixStereoSse2<F>;
+    if (channels == 4) return DownmixMultiSse2<F, 4>;
+    if (channels == 6) return DownmixSixSse2<F>;
+    if (channels == 8) return DownmixMultiSse2<F, 8>;
+    return DownmixMultiSse2<F, 0>;
+  }
+#else
+  (void)level;
+#endif
+  if (channels == 1) return DownmixScalar<F, 1>;
+  if (channels == 2) return DownmixScalar<F, 2>;
+  if (channels == 6) return DownmixScalar<F, 6>;
+  if (channels == 8) return DownmixScalar<F, 8>;
+  return DownmixScalar<F, 0>;
+}
+
+/**
+ * @brief サンプル形式とチャンネル数に合ったダウンミックスカーネルを選ぶ関数
+ *
+ * @param format 入力のサンプル形式
+ * @param channels チャンネル数
+ * @param level 使用する命令セット（省略時は実行中のCPUで判定）
+ * @return DownmixKernel カーネル。未対応の形式の場合はnullptr
+ */
+inline DownmixKernel SelectDownmixKernel(
+    SampleFormat format, int channels,
+    SimdLevel level = CurrentSimdLevel()) {
+  if (channels <= 0) return nullptr;
+  switch (format) {
+    case SampleFormat::UInt8:
+      // 8ビットは実機でほぼ使われないためスカラー版のみ
+      if (channels == 1) return DownmixScalar<SampleFormat::UInt8, 1>;
+      if (channels == 2) return DownmixScalar<SampleFormat::UInt8, 2>;
+      return DownmixScalar<SampleFormat::UInt8, 0>;
+    case SampleFormat::Int16:
+#if defined(DOWNMIX_X86)
+      if (channels == 2 && level == SimdLevel::AVX2)
+        return DownmixInt16StereoAvx2;
+      if (channels == 2 && level == SimdLevel::SSE2)
+        return DownmixInt16StereoSse2;
+#endif
+      return SelectDownmixKernelFor<SampleFormat::Int16>(channels, level);
+    case SampleFormat::Int24:
+      return SelectDownmixKernelFor<SampleFormat::Int24>(channels, level);
+    case SampleFormat::Int32:
+      return SelectDownmixKernelFor<SampleFormat::Int32>(channels, level);
+    case SampleFormat::Float32:
+      return SelectDownmixKernelFor<SampleFormat::Float32>(channels, level);
+    default:
+      return nullptr;
+  }
+}
@@ -0,0 +1,289 @@
+﻿//-----------------------------------------------------------------------------
+// ストリーミングJSONライタと行単位の標準出力バッファ
+// 1行分のJSONを使い回すバッファに組み立て、まとめて書き出します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+//--
+#include <chrono>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief JSON文字列としてエスケープして追記する関数
+ *
+ * 引用符・バックスラッシュ・制御文字をエスケープします。
+ * UTF-8のマルチバイト文字はそのまま残します。
+ *
+ * @param input エスケープする文字列（UTF-8）
+ * @param length バイト数
+ * @param output 追記先（前後の引用符は追加しない）
+ */
+inline void AppendJsonEscaped(const char *input, size_t length,
+                              std::string *output) {
+  static const char kHex[] = "0123456789abcdef";
+  size_t plain = 0;  // まだコピーしていないエスケープ不要な部分の先頭
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = static_cast<unsigned char>(input[i]);
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+    output->append(input + plain, i - plain);
+    plain = i + 1;
+    switch (c) {
+      case '"':
+        output->append("\\\"", 2);
+        break;
+      case '\\':
+        output->append("\\\\", 2);
+        break;
+      case '\n':
+        output->append("\\n", 2);
+        break;
+      case '\r':
+        output->append("\\r", 2);
+        break;
+      case '\t':
+        output->append("\\t", 2);
+        break;
+      default: {
+        char escaped[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf]};
+        output->append(escaped, sizeof(escaped));
+        break;
+      }
+    }
+  }
+  output->append(input + plain, length - plain);
+}
+
+/**
+ * @brief 1つのJSON値を組み立てるストリーミングライタ
+ *
+ * 要素間のカンマとキーの後のコロンはライタが補います。
+ * clear() は内容だけを消して容量を残すため、同じライタを使い回せば
+ * 定常状態ではヒープ割り当てが発生しません。
+ *
+ * 使い方:
+ *   writer.clear();
+ *   writer.beginObject().key("info").string("ring").key("overruns")
+ *       .integer(n).endObject();
+ */
+class JsonWriter {
+ public:
+  JsonWriter() : depth(0), elementBits(0), afterKey(false) {}
+
+  // 内容を消して新しい値を書き始める
+  void clear() {
+    buffer.clear();
+    depth = 0;
+    elementBits = 0;
+    afterKey = false;
+  }
+
+  const std::string &str() const { return buffer; }
+  const char *data() const { return buffer.data(); }
+  size_t size() const { return buffer.size(); }
+
+  JsonWriter &beginObject() { return open('{'); }
+  JsonWriter &endObject() { return close('}'); }
+  JsonWriter &beginArray() { return open('['); }
+  JsonWriter &endArray() { return close(']'); }
+
+  // オブジェクトのキーを書く（次に書く値がこのキーの値になる）
+  JsonWriter &key(const char *name) {
+    separate();
+    buffer += '"';
+    AppendJsonEscaped(name, strlen(name), &buffer);
+    buffer.append("\":", 2);
+    afterKey = true;
+    return *this;
+  }
+
+  JsonWriter &string(const char *value, size_t length) {
+    separate();
+    buffer += '"';
+    AppendJsonEscaped(value, length, &buffer);
+    buffer += '"';
+    return *this;
+  }
+  JsonWriter &string(const char *value) {
+    return string(value, value ? strlen(value) : 0);
+  }
+  JsonWriter &string(const std::string &value) {
+    return string(value.data(), value.size());
+  }
+
+  JsonWriter &integer(long long value) {
+    char number[24];
+    int length = snprintf(number, sizeof(number), "%lld", value);
+    return raw(number, static_cast<size_t>(length));
+  }
+
+  // 小数点以下 decimals 桁の数値を書く
+  JsonWriter &number(double value, int decimals = 2) {
+    char number[32];
+    int length = snprintf(number, sizeof(number), "%.*f", decimals, value);
+    return raw(number, static_cast<size_t>(length));
+  }
+
+  JsonWriter &boolean(bool value) {
+    return value ? raw("true", 4) : raw("false", 5);
+  }
+
+  /**
+   * @brief JSONとして正しい値をそのまま書く
+   *
+   * VOSKの認識結果のように、すでにJSONになっている値を埋め込む場合に使います。
+   *
+   * @param json 値のJSON
+   * @param length バイト数
+   */
+  JsonWriter &raw(const char *json, size_t length) {
+    separate();
+    buffer.append(json, length);
+    return *this;
+  }
+
+ private:
+  // 値の前に必要なカンマを補う
+  void separate() {
+    if (afterKey) {
+      afterKey = false;
+      return;
+    }
+    if (depth == 0) return;
+    const uint64_t bit = uint64_t(1) << ((depth - 1) & 63);
+    if (elementBits & bit) buffer += ',';
+    elementBits |= bit;
+  }
+
+  JsonWriter &open(char bracket) {
+    separate();
+    buffer += bracket;
+    depth++;
+    elementBits &= ~(uint64_t(1) << ((depth - 1) & 63));
+    return *this;
+  }
+
+  JsonWriter &close(char bracket) {
+    buffer += bracket;
+    if (depth > 0) depth--;
+    return *this;
+  }
+
+  std::string buffer;
+  int depth;             // 入れ子の深さ
+  uint64_t elementBits;  // 各深さで要素をすでに書いたか
+  bool afterKey;         // 直前にキーを書いたか
+};
+
+/**
+ * @brief 行の書き出しタイミング
+ */
+enum class FlushPolicy {
+  Immediate,  // 1行ごとに書き出す
+  Interval,   // 前回の書き出しから一定時間たったら書き出す
+  Lines,      // 一定行数たまったら書き出す
+};
+
+/**
+ * @brief JSON行をためてまとめて書き出す出力先
+ *
+ * 行は内部のバッファに追記し、ポリシーに従って1回のfwrite/fflushで
+ * 書き出します。部分認識結果が高頻度で出ても行ごとのシステムコールが
+ * 発生しません。緊急（urgent）の行はポリシーに関係なく、それまでに
+ * たまった行と一緒に直ちに書き出します。
+ * 複数スレッドから呼び出せます。
+ */
+class JsonLineOutput {
+ public:
+  explicit JsonLineOutput(FILE *stream)
+      : stream(stream), policy(FlushPolicy::Immediate), intervalMs(0),
+        maxLines(1), pendingLines(0),
+        lastFlush(std::chrono::steady_clock::now()) {}
+
+  ~JsonLineOutput() { flush(); }
+
+  /**
+   * @brief 書き出しタイミングを設定する
+   *
+   * @param newPolicy ポリシー
+   * @param value Intervalではミリ秒、Linesでは行数（Immediateでは無視）
+   */
+  void setPolicy(FlushPolicy newPolicy, unsigned value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    policy = newPolicy;
+    intervalMs = value;
+    maxLines = value > 0 ? value : 1;
+  }
+
+  /**
+   * @brief 1行を書き込む（改行は自動で付ける）
+   *
+   * @param line 行の内容
+   * @param length バイト数
+   * @param urgent trueの場合はポリシーに関係なく直ちに書き出す
+   */
+  void writeLine(const char *line, size_t length, bool urgent) {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer.append(line, length);
+    buffer += '\n';
+    pendingLines++;
+    if (urgent || due()) flushLocked();
+  }
+  void writeLine(const char *line, bool urgent = true) {
+    writeLine(line, strlen(line), urgent);
+  }
+  void writeLine(const std::string &line, bool urgent = true) {
+    writeLine(line.data(), line.size(), urgent);
+  }
+  void writeLine(const JsonWriter &writer, bool urgent = true) {
+    writeLine(writer.data(), writer.size(), urgent);
+  }
+
+  // Intervalポリシーで期限を過ぎた行があれば書き出す（出力のない間も呼ぶ）
+  void poll() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pendingLines > 0 && due()) flushLocked();
+  }
+
+  // たまっている行をすべて書き出す
+  void flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    flushLocked();
+  }
+
+ private:
+  bool due() const {
+    switch (policy) {
+      case FlushPolicy::Interval:
+        return std::chrono::steady_clock::now() - lastFlush >=
+               std::chrono::milliseconds(intervalMs);
+      case FlushPolicy::Lines:
+        return pendingLines >= maxLines;
+      default:
+        return true;
+    }
+  }
+
+  void flushLocked() {
+    if (!buffer.empty()) {
+      fwrite(buffer.data(), 1, buffer.size(), stream);
+      fflush(stream);
+      buffer.clear();  // 容量は残して次回に使い回す
+    }
+    pendingLines = 0;
+    lastFlush = std::chrono::steady_clock::now();
+  }
+
+  FILE *stream;
+  std::string buffer;
+  FlushPolicy policy;
+  unsigned intervalMs;    // Intervalポリシーの間隔
+  unsigned maxLines;      // Linesポリシーの行数
+  unsigned pendingLines;  // まだ書き出していない行数
+  std::chrono::steady_clock::time_point lastFlush;
+  std::mutex mutex;
+};
@@ -0,0 +1,254 @@
+﻿//-----------------------------------------------------------------------------
+// メモリマップによるWAVファイルの読み出し
+// ファイルを一定サイズの窓ごとにマップし、dataチャンクをコピーせずに参照します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "downmix.h"
+#include "wav_reader.h"
+
+/**
+ * @brief メモリマップでWAVファイルを読み出すクラス
+ *
+ * ファイル全体ではなく kViewBytes ずつの窓をマップし、読み進めるにつれて
+ * 窓をずらすため、ファイルが何GBあっても常駐メモリはほぼ一定です。
+ * next() はマップした領域を直接指すポインタを返すので、stdioバッファへの
+ * コピーは発生しません。16kHzモノラル16ビットのファイルであれば、
+ * このポインタをそのまま認識器に渡せます。
+ */
+class MappedWavReader {
+ public:
+  MappedWavReader()
+      :
+#ifdef _WIN32
+        file(INVALID_HANDLE_VALUE), mapping(nullptr),
+#else
+        fd(-1),
+#endif
+        fileSize(0), view(nullptr), viewOffset(0), viewLength(0),
+        format(SampleFormat::Unknown), channels(0), sampleRate(0),
+        frameBytes(0), dataOffset(0), dataBytes(0), position(0) {}
+
+  ~MappedWavReader() { close(); }
+
+  MappedWavReader(const MappedWavReader &) = delete;
+  MappedWavReader &operator=(const MappedWavReader &) = delete;
+
+  /**
+   * @brief ファイルをマップしてヘッダーを検証する
+   *
+   * @param path WAVファイルのパス
+   * @return bool 対応する形式のWAVファイルであればtrue
+   */
+  bool open(const char *path) {
+    close();
+    if (!openFile(path) || !parseHeader()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    unmapView();
+#ifdef _WIN32
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+#endif
+    fileSize = 0;
+  }
+
+  SampleFormat sampleFormat() const { return format; }
+  int numChannels() const { return channels; }
+  int rate() const { return sampleRate; }
+  size_t frameSize() const { return frameBytes; }
+  uint64_t totalFrames() const {
+    return frameBytes ? dataBytes / frameBytes : 0;
+  }
+
+  // 変換せずにそのまま認識器へ渡せる形式（16kHzモノラル16ビット）か
+  bool isMono16k() const {
+    return format == SampleFormat::Int16 && channels == 1 &&
+           sampleRate == 16000;
+  }
+
+  /**
+   * @brief dataチャンク内の指定フレームへ移動する
+   *
+   * @param frame 移動先のフレーム番号（先頭が0）
+   * @return bool 成功時はtrue
+   */
+  bool seek(uint64_t frame) {
+    if (frameBytes == 0 || frame * frameBytes > dataBytes) return false;
+    position = frame * frameBytes;
+    return true;
+  }
+
+  /**
+   * @brief 次のフレームを指すポインタを取得する（コピーなし）
+   *
+   * 返したポインタは次に next() か seek() を呼ぶまで有効です。
+   *
+   * @param maxFrames 取得する最大フレーム数
+   * @param frames 取得したフレーム数の格納先（終端では0）
+   * @return const uint8_t* フレームの先頭（終端やエラーではnullptr）
+   */
+  const uint8_t *next(size_t maxFrames, size_t *frames) {
+    *frames = 0;
+    if (frameBytes == 0) return nullptr;
+    uint64_t bytes = static_cast<uint64_t>(maxFrames) * frameBytes;
+    if (bytes > kMaxBlockBytes)
+      bytes = kMaxBlockBytes - kMaxBlockBytes % frameBytes;
+    uint64_t remaining = dataBytes - position;
+    if (bytes > remaining) bytes = remaining - remaining % frameBytes;
+    if (bytes == 0) return nullptr;
+
+    const uint8_t *p = map(dataOffset + position, static_cast<size_t>(bytes));
+    if (p == nullptr) return nullptr;
+    position += bytes;
+    *frames = static_cast<size_t>(bytes / frameBytes);
+    return p;
+  }
+
+ private:
+  // 1つの窓の大きさと窓の開始位置の境界（Windowsの割り当て粒度に合わせる）
+  static const uint64_t kViewBytes = 64ull << 20;
+  static const uint64_t kViewAlignment = 64ull << 10;
+  // 1回の next() で返す上限（窓の中に必ず収まる大きさ）
+  static const uint64_t kMaxBlockBytes = 16ull << 20;
+
+  bool openFile(const char *path) {
+#ifdef _WIN32
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0) return false;
+    fileSize = static_cast<uint64_t>(size.QuadPart);
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    return mapping != nullptr;
+#else
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) return false;
+    fileSize = static_cast<uint64_t>(st.st_size);
+    return true;
+#endif
+  }
+
+  // [offset, offset + length) を含む窓をマップしてその位置を返す
+  const uint8_t *map(uint64_t offset, size_t length) {
+    if (offset + length > fileSize) return nullptr;
+    if (view && offset >= viewOffset &&
+        offset + length <= viewOffset + viewLength)
+      return view + (offset - viewOffset);
+
+    unmapView();
+    uint64_t base = offset - offset % kViewAlignment;
+    uint64_t size = fileSize - base;
+    if (size > kViewBytes) size = kViewBytes;
+#ifdef _WIN32
+    void *p = MapViewOfFile(mapping, FILE_MAP_READ,
+                            static_cast<DWORD>(base >> 32),
+                            static_cast<DWORD>(base & 0xFFFFFFFFu),
+                            static_cast<size_t>(size));
+    if (p == nullptr) return nullptr;
+#else
+    void *p = mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_PRIVATE,
+                   fd, static_cast<off_t>(base));
+    if (p == MAP_FAILED) return nullptr;
+    madvise(p, static_cast<size_t>(size), MADV_SEQUENTIAL);
+#endif
+    view = static_cast<const uint8_t *>(p);
+    viewOffset = base;
+    viewLength = size;
+    return view + (offset - viewOffset);
+  }
+
+  void unmapView() {
+    if (view == nullptr) return;
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+#else
+    munmap(const_cast<uint8_t *>(view), static_cast<size_t>(viewLength));
+#endif
+    view = nullptr;
+    viewLength = 0;
+  }
+
+  // RIFFヘッダーとチャンクを検証し、dataチャンクの位置を求める
+  bool parseHeader() {
+    const uint8_t *riff = map(0, 12);
+    if (riff == nullptr || memcmp(riff, "RIFF", 4) != 0 ||
+        memcmp(riff + 8, "WAVE", 4) != 0)
+      return false;
+
+    bool hasFormat = false;
+    uint64_t offset = 12;
+    for (;;) {
+      const uint8_t *chunk = map(offset, 8);
+      if (chunk == nullptr) return false;
+      uint32_t size = WavReadLe32(chunk + 4);
+      bool isFormat = memcmp(chunk, "fmt ", 4) == 0;
+      bool isData = memcmp(chunk, "data", 4) == 0;
+      offset += 8;
+
+      if (isFormat) {
+        if (size < 16) return false;
+        size_t n = size < 40 ? size : 40;
+        const uint8_t *fmt = map(offset, n);
+        if (fmt == nullptr ||
+            !ParseWavFormatChunk(fmt, n, &format, &channels, &sampleRate,
+                                 &frameBytes))
+          return false;
+        hasFormat = true;
+      } else if (isData) {
+        if (!hasFormat) return false;
+        // サイズが未確定（0xFFFFFFFF）やファイル末尾を越える場合は実サイズに切り詰める
+        dataOffset = offset;
+        dataBytes = fileSize - offset;
+        if (size != 0xFFFFFFFFu && size < dataBytes) dataBytes = size;
+        dataBytes -= dataBytes % frameBytes;
+        position = 0;
+        return true;
+      }
+      offset += static_cast<uint64_t>(size) + (size & 1);
+    }
+  }
+
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+  uint64_t fileSize;
+  const uint8_t *view;  // 現在マップしている窓
+  uint64_t viewOffset;  // 窓のファイル内位置
+  uint64_t viewLength;  // 窓の大きさ
+  SampleFormat format;
+  int channels;
+  int sampleRate;
+  size_t frameBytes;
+  uint64_t dataOffset;  // dataチャンク本体のファイル内位置
+  uint64_t dataBytes;   // dataチャンク本体のバイト数（フレーム単位に切り詰め）
+  uint64_t position;    // dataチャンク内の読み出し位置
+};
@@ -0,0 +1,229 @@
+﻿//-----------------------------------------------------------------------------
+// モデルファイルの先読み
+// モデルのディレクトリを並列に読み、vosk_model_new の前にページキャッシュへ載せます
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+//--
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief 先読みの統計
+ */
+struct PrefetchStats {
+  size_t files = 0;         // 先読みしたファイル数
+  uint64_t bytes = 0;       // 先読みしたバイト数
+  double durationMs = 0.0;  // 開始から完了までの時間
+};
+
+/**
+ * @brief モデルのディレクトリのファイルをページキャッシュへ先読みするクラス
+ *
+ * コールドブート直後のモデル読み込みは、am/final.mdl や graph/HCLG.fst などへの
+ * ランダムな読み出しで待たされます。start() はバックグラウンドで
+ * ディレクトリを再帰的にたどり、大きいファイルから順に複数のスレッドで
+ * 読み込みます。各ファイルは窓ごとにマップし、先読みのヒント
+ * （Windows は PrefetchVirtualMemory、それ以外は madvise(MADV_WILLNEED)）を
+ * 出したうえで全ページに触れるため、完了した時点でデータはキャッシュに
+ * 載っています。
+ *
+ * 呼び出し側は start() の後にデバイスの列挙など別の処理を行い、
+ * vosk_model_new の直前に wait() で完了を待ちます。
+ */
+class ModelPrefetcher {
+ public:
+  /**
+   * @param directory モデルのディレクトリ
+   * @param numThreads 読み込みに使うスレッド数
+   */
+  explicit ModelPrefetcher(const std::string &directory, size_t numThreads = 4)
+      : directory(directory), numThreads((std::max)(numThreads, size_t(1))),
+        nextFile(0) {}
+
+  ~ModelPrefetcher() { wait(); }
+
+  ModelPrefetcher(const ModelPrefetcher &) = delete;
+  ModelPrefetcher &operator=(const ModelPrefetcher &) = delete;
+
+  // バックグラウンドで先読みを開始する
+  void start() {
+    if (coordinator.joinable()) return;
+    coordinator = std::thread(&ModelPrefetcher::run, this);
+  }
+
+  /**
+   * @brief 先読みの完了を待つ
+   *
+   * @return const PrefetchStats& 先読みの統計
+   */
+  const PrefetchStats &wait() {
+    if (coordinator.joinable()) coordinator.join();
+    return stats;
+  }
+
+ private:
+  struct FileEntry {
+    std::string path;
+    uint64_t size;
+  };
+
+  // 1回にマップする大きさ（割り当て単位の倍数）
+  static const uint64_t kViewBytes = 64ull << 20;
+  static const size_t kPageBytes = 4096;
+
+  void run() {
+    auto start = std::chrono::steady_clock::now();
+    listFiles(directory, &files);
+    // 大きいファイルを先に配り、スレッド間の偏りを減らす
+    std::sort(files.begin(), files.end(),
+              [](const FileEntry &a, const FileEntry &b) {
+                return a.size > b.size;
+              });
+
+    std::vector<std::thread> workers;
+    const size_t count = (std::min)(numThreads, files.size());
+    for (size_t i = 0; i < count; i++) {
+      workers.emplace_back([this]() {
+        for (;;) {
+          size_t index = nextFile.fetch_add(1);
+          if (index >= files.size()) break;
+          prefetchFile(files[index]);
+        }
+      });
+    }
+    for (auto &worker : workers) worker.join();
+
+    stats.files = files.size();
+    for (const FileEntry &file : files) stats.bytes += file.size;
+    stats.durationMs = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+  }
+
+  // マップした領域の全ページに触れて読み込みを完了させる
+  static void touchPages(const void *data, size_t length) {
+    const volatile unsigned char *bytes =
+        static_cast<const volatile unsigned char *>(data);
+    unsigned char sum = 0;
+    for (size_t i = 0; i < length; i += kPageBytes) sum ^= bytes[i];
+    volatile unsigned char sink = sum;  // 読み出しを最適化で消させない
+    (void)sink;
+  }
+
+#ifdef _WIN32
+  static void listFiles(const std::string &directory,
+                        std::vector<FileEntry> *files) {
+    std::string base = directory;
+    if (!base.empty() && base.back() != '\\' && base.back() != '/')
+      base += '\\';
+
+    WIN32_FIND_DATAA findData;
+    HANDLE find = FindFirstFileA((base + "*").c_str(), &findData);
+    if (find == INVALID_HANDLE_VALUE) return;
+    do {
+      if (!strcmp(findData.cFileName, ".") ||
+          !strcmp(findData.cFileName, ".."))
+        continue;
+      if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+        listFiles(base + findData.cFileName, files);
+      } else {
+        uint64_t size = (static_cast<uint64_t>(findData.nFileSizeHigh) << 32) |
+                        findData.nFileSizeLow;
+        if (size > 0) files->push_back({base + findData.cFileName, size});
+      }
+    } while (FindNextFileA(find, &findData));
+    FindClose(find);
+  }
+
+  static void prefetchFile(const FileEntry &entry) {
+    HANDLE file = CreateFileA(entry.path.c_str(), GENERIC_READ,
+                              FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return;
+    HANDLE mapping =
+        CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping) {
+      for (uint64_t offset = 0; offset < entry.size; offset += kViewBytes) {
+        uint64_t remaining = entry.size - offset;
+        if (remaining > kViewBytes) remaining = kViewBytes;
+        const size_t length = static_cast<size_t>(remaining);
+        void *view = MapViewOfFile(mapping, FILE_MAP_READ,
+                                   static_cast<DWORD>(offset >> 32),
+                                   static_cast<DWORD>(offset), length);
+        if (!view) break;
+        // まとめて読み込むよう先に要求してから、完了を待つ
+        WIN32_MEMORY_RANGE_ENTRY range = {view, length};
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+        touchPages(view, length);
+        UnmapViewOfFile(view);
+      }
+      CloseHandle(mapping);
+    }
+    CloseHandle(file);
+  }
+#else
+  static void listFiles(const std::string &directory,
+                        std::vector<FileEntry> *files) {
+    std::string base = directory;
+    if (!base.empty() && base.back() != '/') base += '/';
+
+    DIR *dir = opendir(directory.c_str());
+    if (!dir) return;
+    while (dirent *entry = readdir(dir)) {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+        continue;
+      std::string path = base + entry->d_name;
+      struct stat info;
+      if (stat(path.c_str(), &info) != 0) continue;
+      if (S_ISDIR(info.st_mode)) {
+        listFiles(path, files);
+      } else if (S_ISREG(info.st_mode) && info.st_size > 0) {
+        files->push_back({path, static_cast<uint64_t>(info.st_size)});
+      }
+    }
+    closedir(dir);
+  }
+
+  static void prefetchFile(const FileEntry &entry) {
+    int fd = open(entry.path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    for (uint64_t offset = 0; offset < entry.size; offset += kViewBytes) {
+      uint64_t remaining = entry.size - offset;
+      if (remaining > kViewBytes) remaining = kViewBytes;
+      const size_t length = static_cast<size_t>(remaining);
+      void *view = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd,
+                        static_cast<off_t>(offset));
+      if (view == MAP_FAILED) break;
+      // まとめて読み込むよう先に要求してから、完了を待つ
+      madvise(view, length, MADV_WILLNEED);
+      touchPages(view, length);
+      munmap(view, length);
+    }
+    close(fd);
+  }
+#endif
+
+  std::string directory;
+  size_t numThreads;
+  std::vector<FileEntry> files;
+  std::atomic<size_t> nextFile;  // 次に読み込むファイルの位置
+  PrefetchStats stats;
+  std::thread coordinator;
+};
@@ -0,0 +1,206 @@
+﻿//-----------------------------------------------------------------------------
+// 部分認識結果の間引きと差分出力
+// 一定間隔より頻繁な部分結果をまとめ、前回からの変化分だけを出力します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+//--
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+/**
+ * @brief 部分認識結果を間引き・差分化して出力行を作るクラス
+ *
+ * 入力は CompactResultJson で詰めた {"partial":"..."} の行です。
+ * -partial-words の単語の時刻（"partial_result" や結果全体の "start"/"end"）
+ * など "partial" 以外のフィールドを含む行は、差分にせず行全体を出力しますが、
+ * 同じテキストの除外と間隔による間引きは "partial" のテキストで行います。
+ *
+ * 間隔（intervalMs）を指定すると、前回の出力から間隔がたつまでは最新の結果を
+ * 保留し、期限が来たときに最新の1件だけを出力します。
+ *
+ * 差分モードでは、前回出力したテキストとの差分を次のどちらかで出力します。
+ * - {"partial_append":"追加分"} 前回のテキストの末尾に追加する
+ * - {"partial_replace":"置換分","offset":n} 前回のテキストの先頭n文字を残し、
+ *   それ以降を置き換える（nはJavaScriptの文字列と同じUTF-16単位）
+ * 最終結果の後（reset()の後）の最初の出力は必ず offset 0 の置換にするため、
+ * 受け取り側は最終結果の有無にかかわらずテキストを復元できます。
+ */
+class PartialResultEncoder {
+ public:
+  /**
+   * @param intervalMs 出力の最小間隔（0の場合は間引かない）
+   * @param delta trueの場合は差分を出力する
+   */
+  PartialResultEncoder(unsigned intervalMs, bool delta)
+      : interval(intervalMs), delta(delta), hasPending(false),
+        pendingHasFields(false), emittedSinceReset(false) {}
+
+  /**
+   * @brief 新しい部分認識結果を渡す
+   *
+   * @param partialJson 詰めた部分認識結果のJSON（空の結果は無視する）
+   * @param line 出力する行の格納先（容量は使い回す）
+   * @return bool 出力する行があればtrue
+   */
+  bool update(const std::string &partialJson, std::string *line) {
+    const char *text;
+    size_t length;
+    bool hasFields;
+    if (!extractText(partialJson, &text, &length, &hasFields)) {
+      // 想定外の形式はそのまま出力する
+      line->assign(partialJson);
+      return true;
+    }
+    if (length == 0) return false;
+    if (length == current().size() &&
+        memcmp(text, current().data(), length) == 0) {
+      // 前回（保留中を含む）と同じ。保留中なら単語の時刻だけ新しくしておく
+      if (hasPending && hasFields) pendingLine.assign(partialJson);
+      return false;
+    }
+
+    pending.assign(text, length);
+    pendingHasFields = hasFields;
+    if (hasFields) pendingLine.assign(partialJson);
+    hasPending = true;
+    return poll(line);
+  }
+
+  /**
+   * @brief 保留中の結果の期限が来ていれば出力する（結果が変わらない間も呼ぶ）
+   *
+   * @param line 出力する行の格納先
+   * @return bool 出力する行があればtrue
+   */
+  bool poll(std::string *line) {
+    if (!hasPending) return false;
+    auto now = std::chrono::steady_clock::now();
+    if (interval > 0 && emittedSinceReset &&
+        now - lastEmit < std::chrono::milliseconds(interval))
+      return false;
+
+    encode(line);
+    emitted.swap(pending);
+    hasPending = false;
+    emittedSinceReset = true;
+    lastEmit = now;
+    return true;
+  }
+
+  // 最終結果が出たときに呼ぶ（保留中の部分結果は捨てる）
+  void reset() {
+    emitted.clear();
+    pending.clear();
+    hasPending = false;
+    emittedSinceReset = false;
+  }
+
+ private:
+  // 最新のテキスト（保留中があればそれ、なければ最後に出力したもの）
+  const std::string &current() const { return hasPending ? pending : emitted; }
+
+  /**
+   * @brief {"partial":"...",...} から "partial" の値を取り出す
+   *
+   * @param json 詰めた部分認識結果のJSON
+   * @param text 引用符の内側（エスケープされたまま）の先頭の格納先
+   * @param length その長さの格納先
+   * @param hasFields "partial" の後に他のフィールドがあるかの格納先
+   * @return bool 先頭が "partial" の文字列のオブジェクトであればtrue
+   */
+  static bool extractText(const std::string &json, const char **text,
+                          size_t *length, bool *hasFields) {
+    static const char kPrefix[] = "{\"partial\":\"";
+    const size_t prefixLength = sizeof(kPrefix) - 1;
+    if (json.size() < prefixLength + 2 || json.back() != '}' ||
+        json.compare(0, prefixLength, kPrefix) != 0)
+      return false;
+
+    // エスケープを飛ばしながら閉じる引用符を探す
+    size_t end = prefixLength;
+    while (end < json.size() && json[end] != '"')
+      end += json[end] == '\\' ? 2 : 1;
+    if (end + 1 >= json.size()) return false;
+    if (json[end + 1] != '}' && json[end + 1] != ',') return false;
+
+    *text = json.data() + prefixLength;
+    *length = end - prefixLength;
+    *hasFields = json[end + 1] == ',';
+    return true;
+  }
+
+  // 保留中のテキストを出力行にする
+  void encode(std::string *line) const {
+    if (pendingHasFields) {
+      line->assign(pendingLine);
+      return;
+    }
+    if (!delta) {
+      line->assign("{\"partial\":\"", 12);
+      line->append(pending);
+      line->append("\"}", 2);
+      return;
+    }
+
+    // 共通の先頭部分を、文字やエスケープの途中で切らない位置まで求める
+    const size_t limit = (std::min)(emitted.size(), pending.size());
+    size_t keep = 0;   // 残すバイト数
+    size_t units = 0;  // 残す部分のUTF-16単位の長さ
+    while (keep < limit) {
+      size_t step = tokenLength(pending, keep);
+      if (keep + step > limit ||
+          memcmp(emitted.data() + keep, pending.data() + keep, step) != 0)
+        break;
+      // 4バイトのUTF-8文字はサロゲートペアで2単位になる
+      units += (static_cast<unsigned char>(pending[keep]) >= 0xF0) ? 2 : 1;
+      keep += step;
+    }
+
+    if (emittedSinceReset && keep == emitted.size()) {
+      line->assign("{\"partial_append\":\"", 19);
+      line->append(pending, keep, std::string::npos);
+      line->append("\"}", 2);
+    } else {
+      if (!emittedSinceReset) units = keep = 0;
+      char number[24];
+      int length = snprintf(number, sizeof(number), "%zu", units);
+      line->assign("{\"partial_replace\":\"", 20);
+      line->append(pending, keep, std::string::npos);
+      line->append("\",\"offset\":", 11);
+      line->append(number, static_cast<size_t>(length));
+      line->append("}", 1);
+    }
+  }
+
+  // position から始まる1文字（UTF-8文字またはエスケープ）のバイト数
+  static size_t tokenLength(const std::string &text, size_t position) {
+    const unsigned char c = static_cast<unsigned char>(text[position]);
+    size_t length = 1;
+    if (c == '\\') {
+      bool unicode = position + 1 < text.size() && text[position + 1] == 'u';
+      length = unicode ? 6 : 2;
+    } else if (c >= 0xF0) {
+      length = 4;
+    } else if (c >= 0xE0) {
+      length = 3;
+    } else if (c >= 0xC0) {
+      length = 2;
+    }
+    return (std::min)(length, text.size() - position);
+  }
+
+  unsigned interval;        // 出力の最小間隔（ミリ秒）
+  bool delta;               // 差分で出力するか
+  std::string emitted;      // 最後に出力したテキスト（エスケープされたまま）
+  std::string pending;      // まだ出力していない最新のテキスト
+  std::string pendingLine;  // 他のフィールドを含む場合の pending の行全体
+  bool hasPending;
+  bool pendingHasFields;  // pending の行に "partial" 以外のフィールドがあるか
+  bool emittedSinceReset;  // reset() 後に出力したか
+  std::chrono::steady_clock::time_point lastEmit;
+};
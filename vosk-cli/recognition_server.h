@@ -0,0 +1,451 @@
+﻿//-----------------------------------------------------------------------------
+// 常駐サーバーモード
+// モデルを一度だけ読み込み、ローカルのTCPソケットで認識セッションを受け付けます
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+//--
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json_writer.h"
+#include "partial_result.h"
+#include "recognizer_pool.h"
+#include "result_text.h"
+#include "vosk_api.h"
+
+#ifdef _WIN32
+typedef SOCKET ServerSocket;
+const ServerSocket kInvalidSocket = INVALID_SOCKET;
+inline void CloseServerSocket(ServerSocket s) { closesocket(s); }
+#else
+typedef int ServerSocket;
+const ServerSocket kInvalidSocket = -1;
+inline void CloseServerSocket(ServerSocket s) { close(s); }
+#endif
+
+// 切断済みのソケットへの送信でSIGPIPEを発生させない
+#ifdef MSG_NOSIGNAL
+const int kServerSendFlags = MSG_NOSIGNAL;
+#else
+const int kServerSendFlags = 0;
+#endif
+
+/**
+ * @brief サーバーのフレームの種類
+ *
+ * フレームは [種類 1バイト][ペイロード長 4バイト(LE)][ペイロード] の形式です。
+ */
+enum class ServerFrame : uint8_t {
+  Open = 'O',   // セッション開始（ペイロード: 省略可、レートのuint32 LE）
+  Audio = 'A',  // 16ビット・モノラル・リトルエンディアンのPCM
+  Close = 'C',  // セッション終了（最終結果を返して閉じる）
+  Json = 'J',   // サーバーからの結果・通知（JSON 1行）
+};
+
+/**
+ * @brief サーバーモードの設定
+ */
+struct ServerSettings {
+  int port = 2700;                 // 待ち受けるポート（127.0.0.1のみ）
+  int maxSessions = 4;             // 同時に開けるセッション数
+  unsigned partialIntervalMs = 0;  // 部分認識結果の最小出力間隔
+  bool partialDelta = false;       // 部分認識結果を差分で出力する
+  bool textOnly = false;           // 部分認識結果を出力しない
+  std::string grammar;             // 文法のJSON（空の場合は文法なし）
+};
+
+/**
+ * @brief 読み込み済みのモデルで認識セッションを受け付けるサーバー
+ *
+ * 接続ごとにスレッドを1つ使い、1つの接続の中でセッションを何度でも
+ * 開き直せます。モデルはすべてのセッションで共有し、認識器はプールから
+ * 借りて終了時に返すため、セッションの開始でモデルの読み込みも
+ * 認識器の作成も待ちません。
+ *
+ * プロトコル（クライアント → サーバー）:
+ *   Open  → {"info":"open","session":n}
+ *   Audio → 部分認識結果・最終結果（標準出力と同じJSON）
+ *   Close → 最終結果、{"info":"closed","session":n}
+ * エラーは {"error":"..."} で返し、接続は維持します。
+ * 同時に受け付ける接続は maxSessions の kConnectionsPerSession 倍までで、
+ * それを超える接続には {"error":"Too many connections"} を返して閉じます。
+ */
+class RecognitionServer {
+ public:
+  // 1フレームの最大ペイロード長（これを超える接続は切断する）
+  static const uint32_t kMaxPayload = 16 * 1024 * 1024;
+  // セッション数の上限1つあたりに受け付ける接続数（セッションを開いて
+  // いない接続も含む。これを超える接続はエラーを返してすぐに閉じる）
+  static const int kConnectionsPerSession = 2;
+
+  /**
+   * @param model 共有する音声認識モデル
+   * @param pool 認識器のプール（サーバーより長く存在すること）
+   * @param settings サーバーの設定
+   */
+  RecognitionServer(VoskModel *model, RecognizerPool *pool,
+                    const ServerSettings &settings)
+      : model(model), pool(pool), settings(settings), listener(kInvalidSocket),
+        boundPort(0), running(false), activeSessions(0), nextSession(0),
+        socketsReady(false) {}
+
+  ~RecognitionServer() {
+    stop();
+#ifdef _WIN32
+    if (socketsReady) WSACleanup();
+#endif
+  }
+
+  /**
+   * @brief 127.0.0.1 の指定ポートで待ち受けを開始する
+   *
+   * @return bool 成功した場合はtrue（失敗時は lastError() に内容）
+   */
+  bool listen() {
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+      error = "WSAStartup failed";
+      return false;
+    }
+#endif
+    socketsReady = true;
+
+    const ServerSocket socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (socket == kInvalidSocket) {
+      error = "Failed to create socket";
+      return false;
+    }
+    int option = 1;
+#ifdef _WIN32
+    // WindowsのSO_REUSEADDRは使用中のポートへの割り込みを許すため、排他にする
+    setsockopt(socket, SOL_SOCKET, SO_EXCLUSIVEADDRUSE,
+               reinterpret_cast<const char *>(&option), sizeof(option));
+#else
+    // TIME_WAITの接続が残っていても、再起動してすぐ同じポートで待ち受ける
+    setsockopt(socket, SOL_SOCKET, SO_REUSEADDR,
+               reinterpret_cast<const char *>(&option), sizeof(option));
+#endif
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(settings.port));
+    if (bind(socket, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) != 0 ||
+        ::listen(socket, SOMAXCONN) != 0) {
+      error = "Failed to listen on port " + std::to_string(settings.port);
+      CloseServerSocket(socket);
+      return false;
+    }
+
+    // ポート0を指定した場合に割り当てられたポートを取得する
+    socklen_t length = sizeof(address);
+    getsockname(socket, reinterpret_cast<sockaddr *>(&address), &length);
+    boundPort = ntohs(address.sin_port);
+    running = true;
+    listener = socket;
+    return true;
+  }
+
+  const std::string &lastError() const { return error; }
+
+  // 待ち受けているポート
+  int port() const { return boundPort; }
+
+  // セッションが閉じるたびに呼ぶ関数を設定する（接続のスレッドから呼ばれる）
+  void setSessionClosedHandler(std::function<void()> handler) {
+    onSessionClosed = std::move(handler);
+  }
+
+  /**
+   * @brief 接続を受け付ける（stop() が呼ばれるまで戻らない）
+   */
+  void run() {
+    while (running) {
+      ServerSocket client = accept(listener.load(), nullptr, nullptr);
+      if (client == kInvalidSocket) {
+        if (!running) break;
+        continue;
+      }
+      // 結果を小さなフレームで返すため、Nagleアルゴリズムを無効にする
+      int noDelay = 1;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY,
+                 reinterpret_cast<const char *>(&noDelay), sizeof(noDelay));
+
+      std::lock_guard<std::mutex> lock(mutex);
+      // stop() が接続を回収し終えた後に受け付けた接続は登録しない
+      if (!running) {
+        CloseServerSocket(client);
+        break;
+      }
+      reapConnections();
+      // 接続ごとにスレッドを作るため、接続を繰り返すクライアントで
+      // スレッドが増え続けないよう接続数を制限する
+      if (static_cast<int>(connections.size()) >=
+          (std::max)(settings.maxSessions, 1) * kConnectionsPerSession) {
+        sendError(client, "Too many connections");
+        CloseServerSocket(client);
+        continue;
+      }
+      connections.emplace_back();
+      Connection &connection = connections.back();
+      connection.socket = client;
+      connection.thread = std::thread(&RecognitionServer::serve, this,
+                                      &connection);
+    }
+  }
+
+  // 待ち受けと全接続を終了する（run() と別のスレッドから呼んでもよい）
+  void stop() {
+    const ServerSocket socket = listener.exchange(kInvalidSocket);
+    if (socket != kInvalidSocket) {
+      running = false;
+      shutdown(socket, 2);  // accept() を戻す（SD_BOTH / SHUT_RDWR）
+      CloseServerSocket(socket);
+    }
+
+    // ソケットは接続のスレッドを回収するまで閉じないため、終了済みの接続に
+    // shutdown() しても別のソケットに再利用されたハンドルを触ることはない
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Connection &connection : connections) {
+      if (!connection.done) shutdown(connection.socket, 2);
+    }
+    for (Connection &connection : connections) {
+      connection.thread.join();
+      CloseServerSocket(connection.socket);
+    }
+    connections.clear();
+  }
+
+ private:
+  struct Connection {
+    std::thread thread;
+    ServerSocket socket = kInvalidSocket;  // スレッドの回収後に閉じる
+    std::atomic<bool> done{false};
+  };
+
+  // 終了した接続のスレッドを回収してソケットを閉じる（mutex を保持して呼ぶ）
+  void reapConnections() {
+    for (auto it = connections.begin(); it != connections.end();) {
+      if (it->done) {
+        it->thread.join();
+        CloseServerSocket(it->socket);
+        it = connections.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // 1つの接続でフレームを処理する（接続ごとのスレッドで実行）
+  void serve(Connection *connection) {
+    const ServerSocket client = connection->socket;
+    VoskRecognizer *recognizer = nullptr;
+    long long session = 0;
+    PartialResultEncoder partials(settings.partialIntervalMs,
+                                  settings.partialDelta);
+    std::vector<char> payload;
+    std::string resultStr;
+    std::string lineStr;
+    JsonWriter writer;
+    uint64_t samplesFed = 0;  // セッションで認識器に渡したサンプル数
+
+    // 認識器をプールへ返却する
+    auto releaseRecognizer = [&]() {
+      pool->addSamplesFed(recognizer, samplesFed);
+      pool->release(recognizer);
+    };
+
+    // 開いているセッションの最終結果を返して閉じる
+    auto closeSession = [&]() {
+      CompactResultJson(vosk_recognizer_final_result(recognizer), &resultStr);
+      sendJson(client, resultStr);
+      releaseRecognizer();
+      recognizer = nullptr;
+      activeSessions--;
+      writer.clear();
+      writer.beginObject()
+          .key("info")
+          .string("closed")
+          .key("session")
+          .integer(session)
+          .endObject();
+      sendJson(client, writer.str());
+      if (onSessionClosed) onSessionClosed();
+    };
+
+    uint8_t type;
+    while (readFrame(client, &type, &payload)) {
+      switch (static_cast<ServerFrame>(type)) {
+        case ServerFrame::Open: {
+          if (recognizer) {
+            sendError(client, "Session already open");
+            break;
+          }
+          if (activeSessions.fetch_add(1) >= settings.maxSessions) {
+            activeSessions--;
+            sendError(client, "Too many sessions");
+            break;
+          }
+          uint32_t rate = 16000;
+          if (payload.size() >= 4) {
+            const uint8_t *p = reinterpret_cast<const uint8_t *>(&payload[0]);
+            rate = p[0] | (p[1] << 8) | (p[2] << 16) |
+                   (static_cast<uint32_t>(p[3]) << 24);
+          }
+          recognizer =
+              rate > 0 ? pool->acquire(model, static_cast<float>(rate),
+                                       settings.grammar)
+                       : nullptr;
+          if (!recognizer) {
+            activeSessions--;
+            sendError(client, "Failed to create recognizer");
+            break;
+          }
+          partials.reset();
+          samplesFed = 0;
+          session = ++nextSession;
+          writer.clear();
+          writer.beginObject()
+              .key("info")
+              .string("open")
+              .key("session")
+              .integer(session)
+              .key("sampleRate")
+              .integer(rate)
+              .endObject();
+          sendJson(client, writer.str());
+          break;
+        }
+        case ServerFrame::Audio: {
+          if (!recognizer) {
+            sendError(client, "No open session");
+            break;
+          }
+          const int bytes = static_cast<int>(payload.size() & ~size_t(1));
+          if (bytes == 0) break;
+          samplesFed += static_cast<uint64_t>(bytes) / 2;
+          if (vosk_recognizer_accept_waveform(recognizer, payload.data(),
+                                              bytes)) {
+            CompactResultJson(vosk_recognizer_result(recognizer), &resultStr);
+            if (resultStr != "{\"text\":\"\"}") sendJson(client, resultStr);
+            partials.reset();
+          } else if (!settings.textOnly) {
+            CompactResultJson(vosk_recognizer_partial_result(recognizer),
+                              &resultStr);
+            if (!resultStr.empty() && partials.update(resultStr, &lineStr))
+              sendJson(client, lineStr);
+          }
+          break;
+        }
+        case ServerFrame::Close:
+          if (recognizer)
+            closeSession();
+          else
+            sendError(client, "No open session");
+          break;
+        default:
+          sendError(client, "Unknown frame type");
+          break;
+      }
+    }
+
+    if (recognizer) {
+      releaseRecognizer();
+      activeSessions--;
+    }
+    // 切断はすぐにクライアントへ伝え、ハンドルは回収する側が閉じる
+    shutdown(client, 2);
+    connection->done = true;
+  }
+
+  // 1フレームを読み出す（切断・不正な長さの場合はfalse）
+  static bool readFrame(ServerSocket client, uint8_t *type,
+                        std::vector<char> *payload) {
+    uint8_t header[5];
+    if (!receiveAll(client, reinterpret_cast<char *>(header), sizeof(header)))
+      return false;
+    const uint32_t length = header[1] | (header[2] << 8) | (header[3] << 16) |
+                            (static_cast<uint32_t>(header[4]) << 24);
+    if (length > kMaxPayload) return false;
+    *type = header[0];
+    payload->resize(length);  // 容量は保たれるため、定常状態では割り当てない
+    return length == 0 || receiveAll(client, payload->data(), length);
+  }
+
+  static bool receiveAll(ServerSocket client, char *data, size_t size) {
+    while (size > 0) {
+      int n = recv(client, data, static_cast<int>(size), 0);
+      if (n <= 0) return false;
+      data += n;
+      size -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  static bool sendAll(ServerSocket client, const char *data, size_t size) {
+    while (size > 0) {
+      int n = send(client, data, static_cast<int>(size), kServerSendFlags);
+      if (n <= 0) return false;
+      data += n;
+      size -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  // JSONを1フレームで送る（ヘッダーとペイロードを1回の送信にまとめる）
+  static bool sendJson(ServerSocket client, const std::string &json) {
+    if (json.empty()) return true;
+    const uint32_t length = static_cast<uint32_t>(json.size());
+    thread_local std::string frame;
+    frame.clear();
+    frame += static_cast<char>(ServerFrame::Json);
+    for (int i = 0; i < 4; i++)
+      frame += static_cast<char>((length >> (8 * i)) & 0xff);
+    frame += json;
+    return sendAll(client, frame.data(), frame.size());
+  }
+
+  static void sendError(ServerSocket client, const char *message) {
+    JsonWriter writer;
+    writer.beginObject().key("error").string(message).endObject();
+    sendJson(client, writer.str());
+  }
+
+  VoskModel *model;
+  RecognizerPool *pool;
+  ServerSettings settings;
+  std::function<void()> onSessionClosed;
+  std::atomic<ServerSocket> listener;
+  int boundPort;
+  std::atomic<bool> running;
+  std::atomic<int> activeSessions;  // 開いているセッション数
+  std::atomic<long long> nextSession;
+  bool socketsReady;  // WSAStartup 済みか
+  std::string error;
+  std::list<Connection> connections;  // 要素のアドレスが変わらないlistを使う
+  std::mutex mutex;
+};
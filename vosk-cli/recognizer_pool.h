@@ -0,0 +1,278 @@
+﻿//-----------------------------------------------------------------------------
+// 認識器のプール
+// 作成済みの認識器を使い回し、セッションごとの作成と解放をなくします
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+//--
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vosk_api.h"
+
+/**
+ * @brief 認識器プールの統計
+ */
+struct RecognizerPoolStats {
+  uint64_t acquired = 0;   // 貸し出した回数
+  uint64_t hits = 0;       // 待機中の認識器を使い回した回数
+  uint64_t misses = 0;     // 待機中がなく新しく作成した回数
+  uint64_t created = 0;    // 作成した認識器の数（事前作成を含む）
+  uint64_t destroyed = 0;  // 上限を超えて解放した認識器の数
+  size_t idle = 0;         // 待機中の認識器の数
+  size_t inUse = 0;        // 貸し出し中の認識器の数
+
+  double hitRate() const {
+    return acquired > 0 ? static_cast<double>(hits) / acquired : 0.0;
+  }
+};
+
+/**
+ * @brief (モデル, サンプリングレート, 文法) ごとに認識器を使い回すプール
+ *
+ * 返却された認識器は vosk_recognizer_reset で発話の状態を消し、
+ * 同じキーの次の貸し出しに使います。認識器の作成は内部で大きな
+ * 割り当てを伴うため、長時間動くプロセスでセッションを繰り返しても
+ * 作成の待ち時間とヒープの断片化が生じません。
+ *
+ * - minIdle: prewarm() で事前に作成しておく数
+ * - maxIdle: キーごとに待機させておく上限（超えた分は返却時に解放する）
+ *
+ * vosk_recognizer_set_words などの設定は reset で戻らないため、
+ * 設定を変える呼び出し側は貸し出しのたびに設定し直します。
+ * 単語の時刻も reset で戻らず作成時からの通算になるため、認識器に渡した
+ * サンプル数を addSamplesFed() で記録し、時刻の原点として使えるようにします。
+ * 話者モデルは音声を渡す前の認識器にしか設定できないため、
+ * setSpeakerModel() で指定して作成時に設定します。
+ * プールはモデルより先に破棄し、破棄の前にすべての認識器を返却します。
+ * 複数スレッドから呼び出せます。
+ */
+class RecognizerPool {
+ public:
+  RecognizerPool(size_t minIdle, size_t maxIdle)
+      : minIdle(minIdle), maxIdle((std::max)(maxIdle, minIdle)) {}
+
+  ~RecognizerPool() {
+    for (Bucket &bucket : buckets) {
+      for (VoskRecognizer *recognizer : bucket.idle)
+        vosk_recognizer_free(recognizer);
+    }
+  }
+
+  RecognizerPool(const RecognizerPool &) = delete;
+  RecognizerPool &operator=(const RecognizerPool &) = delete;
+
+  /**
+   * @brief 作成する認識器に話者モデルを設定する
+   *
+   * 最初の prewarm()/acquire() より前に呼び出します。
+   *
+   * @param model 話者モデル（nullptrの場合は設定しない）
+   */
+  void setSpeakerModel(VoskSpkModel *model) { spkModel = model; }
+
+  /**
+   * @brief 待機中の認識器が count（省略時は minIdle）になるまで作成する
+   *
+   * 最初のセッションで作成を待たないよう、起動時に呼び出します。
+   *
+   * @return bool すべて作成できた場合はtrue
+   */
+  bool prewarm(VoskModel *model, float sampleRate,
+               const std::string &grammar = std::string(), size_t count = 0) {
+    if (count == 0) count = minIdle;
+    count = (std::min)(count, maxIdle);
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (findBucket(model, sampleRate, grammar)->idle.size() >= count)
+          return true;
+      }
+      VoskRecognizer *recognizer = create(model, sampleRate, grammar);
+      if (recognizer == nullptr) return false;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      Bucket *bucket = findBucket(model, sampleRate, grammar);
+      bucket->idle.push_back(recognizer);
+      owners[recognizer] = bucket;
+      counters.created++;
+    }
+  }
+
+  /**
+   * @brief 認識器を借りる（待機中がなければ新しく作成する）
+   *
+   * @param model 音声認識モデル
+   * @param sampleRate サンプリングレート
+   * @param grammar 文法のJSON（空の場合は文法なし）
+   * @return VoskRecognizer* 認識器（作成に失敗した場合はnullptr）
+   */
+  VoskRecognizer *acquire(VoskModel *model, float sampleRate,
+                          const std::string &grammar = std::string()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      Bucket *bucket = findBucket(model, sampleRate, grammar);
+      counters.acquired++;
+      if (!bucket->idle.empty()) {
+        VoskRecognizer *recognizer = bucket->idle.back();
+        bucket->idle.pop_back();
+        counters.hits++;
+        inUse++;
+        return recognizer;
+      }
+      counters.misses++;
+    }
+
+    // 作成は時間がかかるため、ロックの外で行う
+    VoskRecognizer *recognizer = create(model, sampleRate, grammar);
+    if (recognizer == nullptr) return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    owners[recognizer] = findBucket(model, sampleRate, grammar);
+    counters.created++;
+    inUse++;
+    return recognizer;
+  }
+
+  /**
+   * @brief 借りた認識器を返却する
+   *
+   * 発話の状態を消して待機させます。待機数が上限に達している場合は解放します。
+   *
+   * @param recognizer acquire() で借りた認識器
+   */
+  void release(VoskRecognizer *recognizer) {
+    if (recognizer == nullptr) return;
+    vosk_recognizer_reset(recognizer);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      inUse--;
+      auto owner = owners.find(recognizer);
+      if (owner != owners.end() && owner->second->idle.size() < maxIdle) {
+        owner->second->idle.push_back(recognizer);
+        return;
+      }
+      if (owner != owners.end()) owners.erase(owner);
+      fed.erase(recognizer);
+      counters.destroyed++;
+    }
+    vosk_recognizer_free(recognizer);
+  }
+
+  /**
+   * @brief 借りている認識器の文法が変わったことをプールに伝える
+   *
+   * vosk_recognizer_set_grm で文法を差し替えた認識器は元のキーで
+   * 使い回せないため、返却の前に呼び出して新しい文法のキーに移します。
+   *
+   * @param recognizer acquire() で借りた認識器
+   * @param grammar 差し替えた後の文法のJSON（空の場合は文法なし）
+   */
+  void rebind(VoskRecognizer *recognizer, const std::string &grammar) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto owner = owners.find(recognizer);
+    if (owner == owners.end() || owner->second->grammar == grammar) return;
+    owner->second =
+        findBucket(owner->second->model, owner->second->sampleRate, grammar);
+  }
+
+  /**
+   * @brief 認識器を作成してから渡したサンプル数を返す
+   *
+   * VOSKの単語の時刻（秒）はこのサンプル数をサンプリングレートで割った値を
+   * 原点として進みます。
+   *
+   * @param recognizer acquire() で借りた認識器
+   */
+  uint64_t samplesFed(VoskRecognizer *recognizer) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = fed.find(recognizer);
+    return found != fed.end() ? found->second : 0;
+  }
+
+  // 借りている間に認識器に渡したサンプル数を、返却の前に加える
+  void addSamplesFed(VoskRecognizer *recognizer, uint64_t samples) {
+    if (samples == 0) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    fed[recognizer] += samples;
+  }
+
+  RecognizerPoolStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    RecognizerPoolStats result = counters;
+    for (const Bucket &bucket : buckets) result.idle += bucket.idle.size();
+    result.inUse = inUse;
+    return result;
+  }
+
+ private:
+  struct Bucket {
+    VoskModel *model;
+    float sampleRate;
+    std::string grammar;
+    std::vector<VoskRecognizer *> idle;  // 待機中の認識器
+  };
+
+  VoskRecognizer *create(VoskModel *model, float sampleRate,
+                         const std::string &grammar) const {
+    if (grammar.empty()) {
+      return spkModel ? vosk_recognizer_new_spk(model, sampleRate, spkModel)
+                      : vosk_recognizer_new(model, sampleRate);
+    }
+    VoskRecognizer *recognizer =
+        vosk_recognizer_new_grm(model, sampleRate, grammar.c_str());
+    if (recognizer && spkModel)
+      vosk_recognizer_set_spk_model(recognizer, spkModel);
+    return recognizer;
+  }
+
+  // キーに対応するバケットを返す（なければ作る。mutex を保持して呼ぶ）
+  // キーの種類は少ないため線形探索で十分
+  Bucket *findBucket(VoskModel *model, float sampleRate,
+                     const std::string &grammar) {
+    for (Bucket &bucket : buckets) {
+      if (bucket.model == model && bucket.sampleRate == sampleRate &&
+          bucket.grammar == grammar)
+        return &bucket;
+    }
+    buckets.push_back(Bucket{model, sampleRate, grammar, {}});
+    buckets.back().idle.reserve(maxIdle);
+    return &buckets.back();
+  }
+
+  size_t minIdle;
+  size_t maxIdle;
+  std::list<Bucket> buckets;  // 要素のアドレスが変わらないよう list で持つ
+  std::unordered_map<VoskRecognizer *, Bucket *> owners;  // 認識器のキー
+  std::unordered_map<VoskRecognizer *, uint64_t> fed;  // 渡したサンプル数
+  RecognizerPoolStats counters;
+  size_t inUse = 0;
+  VoskSpkModel *spkModel = nullptr;  // 作成する認識器に設定する話者モデル
+  mutable std::mutex mutex;
+};
+
+/**
+ * @brief プールから借りた認識器をスコープを抜けるときに返却するクラス
+ */
+class PooledRecognizer {
+ public:
+  PooledRecognizer(RecognizerPool *pool, VoskRecognizer *recognizer)
+      : pool(pool), recognizer(recognizer) {}
+  ~PooledRecognizer() { pool->release(recognizer); }
+
+  PooledRecognizer(const PooledRecognizer &) = delete;
+  PooledRecognizer &operator=(const PooledRecognizer &) = delete;
+
+  VoskRecognizer *get() const { return recognizer; }
+
+ private:
+  RecognizerPool *pool;
+  VoskRecognizer *recognizer;
+};
@@ -0,0 +1,257 @@
+﻿//-----------------------------------------------------------------------------
+// ポリフェーズFIRによるストリーミングリサンプラ
+// パケット間でフィルタ履歴と位相を保持し、任意の入力レートを16kHzに変換します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+//--
+#include <vector>
+
+// 最大公約数（コンパイル時にも使う）
+constexpr int ResamplerGcd(int a, int b) {
+  return b == 0 ? a : ResamplerGcd(b, a % b);
+}
+
+/**
+ * @brief 有理数比 L/M のポリフェーズリサンプラ
+ *
+ * 入力レートと出力レートの最大公約数から補間係数L・間引き係数Mを求め、
+ * 窓付きsincのプロトタイプフィルタをL個の位相に分解して事前計算します。
+ * 直近の入力サンプルと小数位相をオブジェクト内に保持するため、
+ * WASAPIのパケット境界で位相が飛ぶことはありません。
+ *
+ * InputRate を指定すると L/M と位相の増分がコンパイル時定数になり、
+ * 位相更新の分岐や剰余が消えます（0の場合は実行時にコンストラクタ引数で決定）。
+ *
+ * 使い方: inputBuffer() で得た領域にモノラルfloatを書き込み、process() を呼ぶ
+ */
+template <int InputRate = 0, int OutputRate = 16000>
+class BasicPolyphaseResampler {
+ public:
+  // 1位相あたりのタップ数（内積ループを展開できるよう定数にしている）
+  static const int kTapsPerPhase = 32;
+
+  /**
+   * @param inputRate 入力サンプリングレート
+   * @param outputRate 出力サンプリングレート（デフォルト: 16000Hz）
+   */
+  explicit BasicPolyphaseResampler(int inputRate = InputRate,
+                                   int outputRate = OutputRate)
+      : interpolation(1), decimation(1), step(1), stepRemainder(0), phase(0),
+        position(0), passthrough(inputRate == outputRate) {
+    int a = ResamplerGcd(inputRate, outputRate);
+    interpolation = outputRate / a;
+    decimation = inputRate / a;
+    step = decimation / interpolation;
+    stepRemainder = decimation % interpolation;
+    if (!passthrough) designFilter();
+    reset();
+  }
+
+  // 入力サンプル数に対する出力サンプル数の上限
+  size_t maxOutputSize(size_t inputCount) const {
+    if (passthrough) return inputCount;
+    return (inputCount * interpolation) / decimation + 2;
+  }
+
+  // フィルタ履歴と位相を初期状態に戻す
+  void reset() {
+    phase = 0;
+    history.assign(passthrough ? 0 : kTapsPerPhase - 1, 0.0f);
+    position = history.size();
+  }
+
+  /**
+   * @brief 次の入力サンプルを書き込む領域を確保する
+   *
+   * 履歴の直後に count サンプル分の領域を追加して返します。
+   * 呼び出し側はここへ直接モノラル化したサンプルを書き込みます。
+   *
+   * @param count 入力サンプル数
+   * @return float* 書き込み先
+   */
+  float *inputBuffer(size_t count) {
+    size_t offset = history.size();
+    history.resize(offset + count);
+    return history.data() + offset;
+  }
+
+  /**
+   * @brief 書き込み済みの入力を変換する
+   *
+   * @param output 出力先（maxOutputSize(入力数)以上の領域が必要）
+   * @return size_t 書き込んだ出力サンプル数
+   */
+  size_t process(float *output) { return run<false>(output); }
+
+  // 16ビットPCMへクリッピングしながら出力する版
+  size_t process(short *output) { return run<true>(output); }
+
+  /**
+   * @brief 16ビットPCMと同じ振幅（±32767）のfloatで出力する版
+   *
+   * vosk_recognizer_accept_waveform_f に直接渡せる形式です。
+   * 量子化とクリッピングを行わないため、フルスケールを超えた分も残ります。
+   */
+  size_t processPcmScale(float *output) { return run<true>(output); }
+
+  // 入力配列をコピーしてから変換する簡易版
+  size_t process(const float *input, size_t count, float *output) {
+    float *dst = inputBuffer(count);
+    for (size_t i = 0; i < count; i++) dst[i] = input[i];
+    return run<false>(output);
+  }
+
+ private:
+  template <bool PcmScale>
+  static void store(float *output, float value) {
+    *output = PcmScale ? value * 32767.0f : value;
+  }
+
+  template <bool PcmScale>
+  static void store(short *output, float value) {
+    float scaled = value * 32767.0f;
+    if (scaled > 32767.0f) scaled = 32767.0f;
+    if (scaled < -32768.0f) scaled = -32768.0f;
+    *output = static_cast<short>(scaled);
+  }
+
+  template <bool PcmScale, typename T>
+  size_t run(T *output) {
+    size_t written = 0;
+    const size_t available = history.size();
+
+    if (passthrough) {
+      for (; position < available; position++)
+        store<PcmScale>(&output[written++], history[position]);
+      history.clear();
+      position = 0;
+      return written;
+    }
+
+    // レートが固定の場合は定数、そうでなければメンバの値を使う
+    const int l = InputRate > 0 ? kFixedInterpolation : interpolation;
+    const size_t stepInt = InputRate > 0 ? kFixedStep : step;
+    const int stepRem = InputRate > 0 ? kFixedStepRemainder : stepRemainder;
+
+    while (position < available) {
+      const float *h =
+          &coefficients[static_cast<size_t>(phase) * kTapsPerPhase];
+      const float *x = &history[position - (kTapsPerPhase - 1)];
+      store<PcmScale>(&output[written++], dotProduct(h, x));
+
+      // 小数位相を進め、桁上がり分だけ入力位置を進める（除算を避ける）
+      position += stepInt;
+      if (stepRem != 0) {
+        phase += stepRem;
+        if (phase >= l) {
+          phase -= l;
+          position++;
+        }
+      }
+    }
+
+    // 次回の畳み込みに必要な末尾 kTapsPerPhase-1 サンプルだけを残す
+    size_t drop = position - (kTapsPerPhase - 1);
+    if (drop > available) drop = available;
+    history.erase(history.begin(), history.begin() + drop);
+    position -= drop;
+
+    return written;
+  }
+
+  // 係数と入力の内積（x64ではSSE2の4系統累積で加算の依存チェーンを短くする）
+  static float dotProduct(const float *h, const float *x) {
+#if defined(_M_X64) || defined(__SSE2__)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    __m128 acc2 = _mm_setzero_ps();
+    __m128 acc3 = _mm_setzero_ps();
+    for (int k = 0; k < kTapsPerPhase; k += 16) {
+      acc0 = _mm_add_ps(acc0,
+                        _mm_mul_ps(_mm_loadu_ps(h + k), _mm_loadu_ps(x + k)));
+      acc1 = _mm_add_ps(
+          acc1, _mm_mul_ps(_mm_loadu_ps(h + k + 4), _mm_loadu_ps(x + k + 4)));
+      acc2 = _mm_add_ps(
+          acc2, _mm_mul_ps(_mm_loadu_ps(h + k + 8), _mm_loadu_ps(x + k + 8)));
+      acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_loadu_ps(h + k + 12),
+                                         _mm_loadu_ps(x + k + 12)));
+    }
+    acc0 = _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3));
+    // 水平加算
+    acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+    acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+    return _mm_cvtss_f32(acc0);
+#else
+    float acc0 = 0.0f, acc1 = 0.0f, acc2 = 0.0f, acc3 = 0.0f;
+    for (int k = 0; k < kTapsPerPhase; k += 4) {
+      acc0 += h[k] * x[k];
+      acc1 += h[k + 1] * x[k + 1];
+      acc2 += h[k + 2] * x[k + 2];
+      acc3 += h[k + 3] * x[k + 3];
+    }
+    return (acc0 + acc1) + (acc2 + acc3);
+#endif
+  }
+
+  // 窓付きsinc（Blackman窓）のプロトタイプを設計し位相ごとに並べ替える
+  void designFilter() {
+    const double pi = 3.14159265358979323846;
+    const int taps = kTapsPerPhase;
+    const int length = taps * interpolation;
+    const double center = (length - 1) / 2.0;
+    // 出力ナイキストより少し手前をカットオフにする（補間後のレート基準）
+    const int maxFactor =
+        interpolation > decimation ? interpolation : decimation;
+    const double cutoff = 0.46 / maxFactor;
+
+    std::vector<double> prototype(length);
+    for (int n = 0; n < length; n++) {
+      double t = n - center;
+      double sinc =
+          (t == 0.0) ? 2.0 * cutoff : sin(2.0 * pi * cutoff * t) / (pi * t);
+      double w = 0.42 - 0.5 * cos(2.0 * pi * n / (length - 1)) +
+                 0.08 * cos(4.0 * pi * n / (length - 1));
+      // 補間によるゲイン低下を補正
+      prototype[n] = sinc * w * interpolation;
+    }
+
+    // coefficients[p * taps + j] が history[position - (taps-1) + j] に掛かる
+    coefficients.assign(static_cast<size_t>(length), 0.0f);
+    for (int p = 0; p < interpolation; p++) {
+      for (int j = 0; j < taps; j++) {
+        int k = taps - 1 - j;
+        coefficients[static_cast<size_t>(p) * taps + j] =
+            static_cast<float>(prototype[k * interpolation + p]);
+      }
+    }
+  }
+
+  // InputRate 指定時のコンパイル時定数
+  static const int kFixedGcd =
+      InputRate > 0 ? ResamplerGcd(InputRate, OutputRate) : 1;
+  static const int kFixedInterpolation = OutputRate / kFixedGcd;
+  static const int kFixedDecimation =
+      InputRate > 0 ? InputRate / kFixedGcd : 1;
+  static const int kFixedStep = kFixedDecimation / kFixedInterpolation;
+  static const int kFixedStepRemainder =
+      kFixedDecimation % kFixedInterpolation;
+
+  int interpolation;  // 補間係数L
+  int decimation;     // 間引き係数M
+  int step;           // 1出力あたりの入力位置の整数増分（M / L）
+  int stepRemainder;  // 1出力あたりの位相増分（M % L）
+  int phase;          // 現在の小数位相（0..L-1）
+  size_t position;    // history内の現在の入力位置
+  bool passthrough;   // 入出力レートが同じ場合は素通し
+  std::vector<float> coefficients;  // 位相ごとに並べたフィルタ係数
+  std::vector<float> history;       // 前回パケットの末尾 + 今回の入力
+};
+
+// 入力レートを実行時に指定する版
+typedef BasicPolyphaseResampler<0> PolyphaseResampler;
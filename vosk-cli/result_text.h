@@ -0,0 +1,163 @@
+﻿//-----------------------------------------------------------------------------
+// 認識結果JSONの後処理
+// JSONの空白を詰め、日本語のトークン間の空白を1パスで取り除きます
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+//--
+#include <string>
+
+/**
+ * @brief 認識結果のJSONを1行に詰め、文字列中のトークン間の空白を取り除く関数
+ *
+ * VOSKの結果は整形されたJSONで、日本語モデルのテキストは単語ごとに
+ * 空白で区切られています。この関数は次の規則で1文字ずつ処理します。
+ *
+ * - 文字列の外の空白（改行・インデント）はすべて取り除く
+ * - キー文字列はそのまま残す
+ * - 値の文字列では、前後どちらかが非ASCII文字（日本語など）の空白を取り除き、
+ *   ASCII同士（英単語の間など）の空白は1つにまとめて残す
+ * - エスケープシーケンスはそのまま残す
+ *
+ * 出力先の文字列は呼び出し側で使い回せるよう、容量を保ったまま上書きします。
+ *
+ * @param input VOSKの結果JSON（nullptrの場合は空文字列を出力）
+ * @param output 出力先
+ */
+inline void CompactResultJson(const char *input, std::string *output) {
+  output->clear();
+  if (input == nullptr) return;
+
+  // 入れ子がオブジェクトかどうかをビットで持つ（VOSKの結果は高々数段）
+  uint64_t objectBits = 0;
+  int depth = 0;
+  bool expectKey = false;
+
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(input);
+  while (*p) {
+    unsigned char c = *p;
+    switch (c) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        p++;
+        continue;
+      case '{':
+      case '[':
+        if (depth < 64) {
+          if (c == '{')
+            objectBits |= 1ull << depth;
+          else
+            objectBits &= ~(1ull << depth);
+        }
+        depth++;
+        expectKey = c == '{';
+        break;
+      case '}':
+      case ']':
+        if (depth > 0) depth--;
+        expectKey = false;
+        break;
+      case ',':
+        expectKey = depth > 0 && depth <= 64 &&
+                    (objectBits >> (depth - 1) & 1) != 0;
+        break;
+      case ':':
+        expectKey = false;
+        break;
+      case '"': {
+        const bool isKey = expectKey;
+        output->push_back('"');
+        p++;
+
+        // 直前に出力した文字がASCIIか（先頭ではまだ何も出力していない）
+        bool hasPrevious = false;
+        bool previousAscii = false;
+        bool pendingSpace = false;
+        while (*p && *p != '"') {
+          unsigned char ch = *p;
+          if (!isKey && (ch == ' ' || ch == '\t')) {
+            pendingSpace = true;
+            p++;
+            continue;
+          }
+
+          const bool ascii = ch < 0x80;
+          if (pendingSpace && hasPrevious && previousAscii && ascii)
+            output->push_back(' ');
+          pendingSpace = false;
+
+          if (ch == '\\' && p[1] != '\0') {
+            // エスケープは2文字まとめて写す（\uXXXX の残りは通常の文字として続く）
+            output->push_back('\\');
+            output->push_back(static_cast<char>(p[1]));
+            p += 2;
+          } else {
+            output->push_back(static_cast<char>(ch));
+            p++;
+          }
+          hasPrevious = true;
+          previousAscii = ascii;
+        }
+        if (*p == '"') {
+          output->push_back('"');
+          p++;
+        }
+        expectKey = false;
+        continue;
+      }
+      default:
+        break;
+    }
+    output->push_back(static_cast<char>(c));
+    p++;
+  }
+}
+
+/**
+ * @brief 認識結果JSON内の "start"/"end" の時刻をずらす関数
+ *
+ * 長いファイルを分割して認識した場合に、チャンク内の時刻を
+ * ファイル先頭からの時刻に直すために使います。
+ *
+ * @param json 空白を除いた認識結果JSON
+ * @param offsetSeconds 加算する秒数（負の値も可）
+ * @return std::string 時刻を補正したJSON
+ */
+inline std::string ShiftTimestamps(const std::string &json,
+                                   double offsetSeconds) {
+  static const char *const kKeys[] = {"\"start\":", "\"end\":"};
+  std::string out;
+  out.reserve(json.size() + 32);
+
+  size_t i = 0;
+  while (i < json.size()) {
+    size_t keyLength = 0;
+    for (const char *key : kKeys) {
+      size_t length = strlen(key);
+      if (json.compare(i, length, key) == 0) keyLength = length;
+    }
+    if (keyLength == 0) {
+      out += json[i++];
+      continue;
+    }
+
+    out.append(json, i, keyLength);
+    i += keyLength;
+    char *end = nullptr;
+    double value = strtod(json.c_str() + i, &end);
+    size_t consumed = static_cast<size_t>(end - (json.c_str() + i));
+    if (consumed == 0) continue;  // 数値でなければそのまま
+
+    char number[32];
+    snprintf(number, sizeof(number), "%.6f", value + offsetSeconds);
+    out += number;
+    i += consumed;
+  }
+  return out;
+}
@@ -0,0 +1,281 @@
+﻿//-----------------------------------------------------------------------------
+// セッション全体で単調に進む音声の時計
+// 認識器の単語の時刻を、捨てた音声も数えたセッションの時刻に直します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+//--
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "spsc_ring.h"
+
+/**
+ * @brief 認識器の単語の時刻をセッションの時刻に直す時計
+ *
+ * セッションの時刻は入力デバイスの位置から数えた16kHzのサンプル数で、
+ * 無音フラグのパケット、一時停止中に読み捨てた音声、デバイスの欠落、
+ * 音声区間ゲートで捨てた音声も含めて進みます。認識器の時刻は渡した
+ * サンプルだけで進むため、次の2つの対応表で変換します。
+ *
+ * - リング位置 → セッション位置: キャプチャスレッドが音声を飛ばした後の
+ *   最初の書き込みの前に mark() で記録する
+ * - 認識器の位置 → セッション位置: 認識スレッドが feed() で、渡した
+ *   サンプルのリング位置から記録する（連続している間は増えない）
+ *
+ * 対応表は容量を確保した配列で持ち、不要になった区間から捨てるため、
+ * 結果の書き換えを含めて定常状態ではヒープ割り当てが発生しません。
+ * mark()/setAnchor() はキャプチャスレッド、それ以外は認識スレッドから
+ * 呼びます（認識スレッドの終了後はキャプチャスレッドから呼んでもよい）。
+ */
+class SessionClock {
+ public:
+  static const int kSampleRate = 16000;
+
+  /**
+   * @param origin 認識器にこれまでに渡したサンプル数
+   *               （VOSKの時刻の原点。RecognizerPool::samplesFed の値）
+   */
+  explicit SessionClock(uint64_t origin)
+      : pending(kMaxMarks), origin(origin), fed(0), anchorEpochMs(-1.0) {
+    marks.reserve(kMaxMarks);
+    breakpoints.reserve(kMaxBreakpoints);
+  }
+
+  /**
+   * @brief リング位置 ringPosition からのサンプルがセッション位置
+   *        sessionPosition から続くことを記録する（キャプチャスレッド）
+   *
+   * @param ringPosition 次に書き込むサンプルのリング位置（書き込んだ累計）
+   * @param sessionPosition そのサンプルのセッション位置
+   */
+  void mark(uint64_t ringPosition, uint64_t sessionPosition) {
+    const Mark mark = {ringPosition, sessionPosition};
+    pending.write(&mark, 1);
+  }
+
+  // セッション位置0の時刻（UNIX時間のミリ秒）を設定する（キャプチャスレッド）
+  void setAnchor(double epochMs) {
+    anchorEpochMs.store(epochMs, std::memory_order_release);
+  }
+
+  /**
+   * @brief リング位置 ringStart から count 個を認識器に渡したことを記録する
+   *
+   * 渡したサンプルのリング位置は単調に増えることを前提とします
+   * （音声区間ゲートの出力も入力の順序を保つ）。
+   *
+   * @param ringStart 渡した先頭のサンプルのリング位置
+   * @param count 渡したサンプル数
+   */
+  void feed(uint64_t ringStart, size_t count) {
+    takeMarks();
+    uint64_t ring = ringStart;
+    const uint64_t end = ringStart + count;
+    while (ring < end) {
+      // 途中に印があれば、そこで区間を分ける
+      const size_t found = findMark(ring);
+      const size_t next = found == kNone ? 0 : found + 1;
+      uint64_t pieceEnd = end;
+      if (next < marks.size() && marks[next].ring < pieceEnd)
+        pieceEnd = marks[next].ring;
+      addBreakpoint(origin + fed, sessionAt(found, ring));
+      fed += pieceEnd - ring;
+      ring = pieceEnd;
+    }
+
+    // 次に渡すのは end 以降のため、end を含む区間より前の印は要らない
+    const size_t last = findMark(end);
+    if (last != kNone && last > 0)
+      marks.erase(marks.begin(), marks.begin() + last);
+  }
+
+  // セッションで認識器に渡したサンプル数
+  uint64_t fedSamples() const { return fed; }
+
+  /**
+   * @brief 認識器の時刻をセッション位置に直す
+   *
+   * @param seconds VOSKの結果の時刻（秒）
+   * @return uint64_t セッション位置（サンプル）
+   */
+  uint64_t toSession(double seconds) const {
+    const uint64_t position = toSamples(seconds);
+    if (breakpoints.empty())
+      return position > origin ? position - origin : 0;
+    size_t i = breakpoints.size();
+    while (i > 0 && breakpoints[i - 1].fed > position) i--;
+    if (i == 0) return breakpoints[0].session;  // 記録より前は先頭に寄せる
+    const Breakpoint &point = breakpoints[i - 1];
+    return point.session + (position - point.fed);
+  }
+
+  /**
+   * @brief 認識結果の "start"/"end" をセッションの秒に直して書き出す
+   *
+   * 単語の時刻があれば末尾に結果全体の "start"/"end"（最初の単語の開始と
+   * 最後の単語の終了）を加え、基準時刻が設定されていれば UNIX時間の
+   * "startEpochMs"/"endEpochMs" も加えます。
+   *
+   * @param json CompactResultJson で詰めた認識結果
+   * @param output 書き出し先（容量は使い回す）
+   * @param endSeconds 最後の単語の終了の認識器の時刻の格納先（nullptr可）
+   * @return bool 単語の時刻があればtrue
+   */
+  bool rebase(const std::string &json, std::string *output,
+              double *endSeconds = nullptr) const {
+    static const char kStart[] = "\"start\":";
+    static const char kEnd[] = "\"end\":";
+    output->clear();
+    uint64_t first = UINT64_MAX;
+    uint64_t last = 0;
+    double lastSeconds = 0.0;
+    size_t copied = 0;  // json のうち書き出し済みの長さ
+    for (size_t i = 1; i < json.size(); i++) {
+      // キーは '{' か ',' の直後だけを見る（文字列の中の一致を除く）
+      if (json[i - 1] != '{' && json[i - 1] != ',') continue;
+      size_t keyLength = 0;
+      if (json.compare(i, sizeof(kStart) - 1, kStart) == 0)
+        keyLength = sizeof(kStart) - 1;
+      else if (json.compare(i, sizeof(kEnd) - 1, kEnd) == 0)
+        keyLength = sizeof(kEnd) - 1;
+      if (keyLength == 0) continue;
+
+      const char *number = json.c_str() + i + keyLength;
+      char *numberEnd = nullptr;
+      const double seconds = strtod(number, &numberEnd);
+      if (numberEnd == number) continue;  // 数値でなければそのまま
+
+      const uint64_t session = toSession(seconds);
+      if (session < first) first = session;
+      if (session >= last) {
+        last = session;
+        lastSeconds = seconds;
+      }
+      output->append(json, copied, i + keyLength - copied);
+      appendSeconds(session, output);
+      copied = static_cast<size_t>(numberEnd - json.c_str());
+      i = copied;
+    }
+    output->append(json, copied, std::string::npos);
+    if (first == UINT64_MAX || output->empty() || output->back() != '}')
+      return false;
+
+    // 結果全体の時刻を閉じ括弧の前に加える
+    output->pop_back();
+    output->append(",\"start\":", 9);
+    appendSeconds(first, output);
+    output->append(",\"end\":", 7);
+    appendSeconds(last, output);
+    const double anchor = anchorEpochMs.load(std::memory_order_acquire);
+    if (anchor >= 0.0) {
+      output->append(",\"startEpochMs\":", 16);
+      appendEpochMs(anchor, first, output);
+      output->append(",\"endEpochMs\":", 14);
+      appendEpochMs(anchor, last, output);
+    }
+    *output += '}';
+    if (endSeconds) *endSeconds = lastSeconds;
+    return true;
+  }
+
+  /**
+   * @brief 認識器の時刻 seconds より前だけに使う対応表を捨てる
+   *
+   * 最終結果の後、その結果の最後の単語の終了時刻で呼びます。
+   *
+   * @param seconds VOSKの結果の時刻（秒）
+   */
+  void forget(double seconds) {
+    const uint64_t position = toSamples(seconds);
+    size_t keep = 0;  // 残す先頭（position を含む区間）
+    while (keep + 1 < breakpoints.size() &&
+           breakpoints[keep + 1].fed <= position)
+      keep++;
+    if (keep > 0)
+      breakpoints.erase(breakpoints.begin(), breakpoints.begin() + keep);
+  }
+
+ private:
+  static const size_t kMaxMarks = 256;
+  static const size_t kMaxBreakpoints = 1024;
+  static const size_t kNone = ~size_t(0);
+
+  struct Mark {
+    uint64_t ring;     // リング位置
+    uint64_t session;  // その位置のセッション位置
+  };
+  struct Breakpoint {
+    uint64_t fed;      // 認識器の位置（作成からの通算）
+    uint64_t session;  // その位置のセッション位置
+  };
+
+  static uint64_t toSamples(double seconds) {
+    return seconds > 0.0 ? static_cast<uint64_t>(llround(seconds * kSampleRate))
+                         : 0;
+  }
+
+  static void appendSeconds(uint64_t session, std::string *output) {
+    char number[32];
+    const int length = snprintf(number, sizeof(number), "%.6f",
+                                static_cast<double>(session) / kSampleRate);
+    output->append(number, static_cast<size_t>(length));
+  }
+
+  static void appendEpochMs(double anchor, uint64_t session,
+                            std::string *output) {
+    char number[32];
+    const int length =
+        snprintf(number, sizeof(number), "%.3f",
+                 anchor + static_cast<double>(session) * 1000.0 / kSampleRate);
+    output->append(number, static_cast<size_t>(length));
+  }
+
+  // キャプチャスレッドが記録した印を取り込む
+  void takeMarks() {
+    Mark mark;
+    while (pending.read(&mark, 1) == 1) {
+      if (marks.size() == kMaxMarks) marks.erase(marks.begin());
+      marks.push_back(mark);
+    }
+  }
+
+  // ring 以前で最後の印の添字（なければ kNone）
+  size_t findMark(uint64_t ring) const {
+    size_t i = marks.size();
+    while (i > 0 && marks[i - 1].ring > ring) i--;
+    return i > 0 ? i - 1 : kNone;
+  }
+
+  // リング位置 ring のセッション位置（印がなければリング位置と同じ）
+  uint64_t sessionAt(size_t found, uint64_t ring) const {
+    if (found == kNone) return ring;
+    return marks[found].session + (ring - marks[found].ring);
+  }
+
+  // 前の区間から連続していなければ対応点を加える
+  void addBreakpoint(uint64_t position, uint64_t session) {
+    if (!breakpoints.empty()) {
+      const Breakpoint &back = breakpoints.back();
+      if (back.session + (position - back.fed) == session) return;
+    }
+    if (breakpoints.size() == kMaxBreakpoints)
+      breakpoints.erase(breakpoints.begin());
+    const Breakpoint point = {position, session};
+    breakpoints.push_back(point);
+  }
+
+  SpscRingBuffer<Mark> pending;         // キャプチャスレッドからの印
+  std::vector<Mark> marks;              // リング位置の対応表
+  std::vector<Breakpoint> breakpoints;  // 認識器の位置の対応表
+  uint64_t origin;                      // セッション開始時の認識器の位置
+  uint64_t fed;                         // セッションで渡したサンプル数
+  std::atomic<double> anchorEpochMs;    // セッション位置0の時刻（負は未設定）
+};
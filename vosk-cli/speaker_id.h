@@ -0,0 +1,315 @@
+﻿//-----------------------------------------------------------------------------
+// 話者識別
+// 話者モデルの並行読み込みと、話者ベクトルのコサイン類似度による照合を行います
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+//--
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json_writer.h"
+#include "vosk_api.h"
+
+/**
+ * @brief 2つのベクトルの内積を求める関数
+ *
+ * x64ではSSE2の4系統累積で加算の依存チェーンを短くします。
+ *
+ * @param a ベクトル
+ * @param b ベクトル
+ * @param count 要素数
+ * @return float 内積
+ */
+inline float DotProduct(const float *a, const float *b, size_t count) {
+  size_t i = 0;
+#if defined(_M_X64) || defined(__SSE2__)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  __m128 acc2 = _mm_setzero_ps();
+  __m128 acc3 = _mm_setzero_ps();
+  for (; i + 16 <= count; i += 16) {
+    acc0 = _mm_add_ps(acc0,
+                      _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    acc1 = _mm_add_ps(
+        acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    acc2 = _mm_add_ps(
+        acc2, _mm_mul_ps(_mm_loadu_ps(a + i + 8), _mm_loadu_ps(b + i + 8)));
+    acc3 = _mm_add_ps(
+        acc3, _mm_mul_ps(_mm_loadu_ps(a + i + 12), _mm_loadu_ps(b + i + 12)));
+  }
+  acc0 = _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3));
+  // 水平加算
+  acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+  acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+  float sum = _mm_cvtss_f32(acc0);
+#else
+  float acc0 = 0.0f, acc1 = 0.0f, acc2 = 0.0f, acc3 = 0.0f;
+  for (; i + 4 <= count; i += 4) {
+    acc0 += a[i] * b[i];
+    acc1 += a[i + 1] * b[i + 1];
+    acc2 += a[i + 2] * b[i + 2];
+    acc3 += a[i + 3] * b[i + 3];
+  }
+  float sum = (acc0 + acc1) + (acc2 + acc3);
+#endif
+  for (; i < count; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+/**
+ * @brief 認識結果の "spk"（話者ベクトル）と "spk_frames" を取り出す関数
+ *
+ * @param json CompactResultJson で詰めた認識結果
+ * @param vector 話者ベクトルの格納先（容量は使い回す）
+ * @param frames ベクトルを求めたフレーム数の格納先
+ * @return bool 話者ベクトルがあればtrue
+ */
+inline bool ParseSpeakerVector(const std::string &json,
+                               std::vector<float> *vector, int *frames) {
+  static const char kSpk[] = "\"spk\":[";
+  static const char kFrames[] = "\"spk_frames\":";
+  vector->clear();
+  const size_t found = json.find(kSpk);
+  if (found == std::string::npos) return false;
+
+  const char *p = json.c_str() + found + sizeof(kSpk) - 1;
+  while (*p != ']') {
+    char *end = nullptr;
+    const double value = strtod(p, &end);
+    if (end == p) return false;
+    vector->push_back(static_cast<float>(value));
+    p = end;
+    if (*p == ',') p++;
+  }
+
+  *frames = 0;
+  const size_t framesAt = json.find(kFrames);
+  if (framesAt != std::string::npos)
+    *frames = atoi(json.c_str() + framesAt + sizeof(kFrames) - 1);
+  return !vector->empty();
+}
+
+/**
+ * @brief 話者モデルをバックグラウンドで読み込むクラス
+ *
+ * 話者モデルの読み込みは音声認識モデルの読み込みと独立しているため、
+ * start() で別のスレッドに読み込ませ、認識器を作る前に wait() で待ちます。
+ * 読み込んだモデルはこのオブジェクトが解放します（VOSKのモデルは参照
+ * カウントのため、認識器より先に解放してもよい）。
+ */
+class SpeakerModelLoader {
+ public:
+  explicit SpeakerModelLoader(const std::string &path)
+      : path(path), spkModel(nullptr), durationMs(0.0) {}
+
+  ~SpeakerModelLoader() {
+    wait();
+    if (spkModel) vosk_spk_model_free(spkModel);
+  }
+
+  SpeakerModelLoader(const SpeakerModelLoader &) = delete;
+  SpeakerModelLoader &operator=(const SpeakerModelLoader &) = delete;
+
+  // バックグラウンドで読み込みを開始する
+  void start() {
+    if (loader.joinable()) return;
+    loader = std::thread([this]() {
+      auto loadStart = std::chrono::steady_clock::now();
+      spkModel = vosk_spk_model_new(path.c_str());
+      durationMs = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - loadStart)
+                       .count();
+    });
+  }
+
+  /**
+   * @brief 読み込みの完了を待つ（1つのスレッドから呼ぶ）
+   *
+   * @return VoskSpkModel* 話者モデル（失敗した場合はnullptr）
+   */
+  VoskSpkModel *wait() {
+    if (loader.joinable()) loader.join();
+    return spkModel;
+  }
+
+  // wait() の後に、読み込んだ話者モデルを返す
+  VoskSpkModel *model() const { return spkModel; }
+
+  // 読み込みにかかった時間（ミリ秒）
+  double loadMs() const { return durationMs; }
+
+  const std::string &modelPath() const { return path; }
+
+ private:
+  std::string path;
+  std::thread loader;
+  VoskSpkModel *spkModel;
+  double durationMs;
+};
+
+/**
+ * @brief 登録した話者の表
+ *
+ * 話者ごとに正規化した平均ベクトルを持ち、最終結果の話者ベクトルとの
+ * コサイン類似度（正規化したベクトルの内積）が最も大きい話者を選びます。
+ *
+ * - 類似度が threshold 以上なら、その話者の平均ベクトルを
+ *   フレーム数で重み付けして更新する
+ * - どの話者とも似ていなければ "S1", "S2", ... として自動で登録する
+ *   （maxSpeakers に達したら登録せず、話者なしとする）
+ *
+ * ベクトルは1つの配列に詰めて持ち、照合のたびの割り当てはありません。
+ * 複数のセッションから呼び出せます。
+ */
+class SpeakerTable {
+ public:
+  /**
+   * @param threshold 同じ話者とみなすコサイン類似度
+   * @param maxSpeakers 登録する話者の上限
+   */
+  SpeakerTable(float threshold, size_t maxSpeakers)
+      : threshold(threshold), maxSpeakers(maxSpeakers), dims(0),
+        autoNumber(0) {}
+
+  /**
+   * @brief 話者を登録する
+   *
+   * @param id 話者のID
+   * @param vector 話者ベクトル
+   * @param count 次元数（最初の登録で決まり、以降は同じであること）
+   * @return bool 登録できた場合はtrue
+   */
+  bool enroll(const std::string &id, const float *vector, size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!setDimensions(count) || ids.size() >= maxSpeakers) return false;
+    add(id, vector, 1.0f);
+    return true;
+  }
+
+  // 登録した話者の数
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ids.size();
+  }
+
+  /**
+   * @brief 最終結果の話者を照合し、"speaker" と "similarity" を加える
+   *
+   * 話者ベクトルのない結果は変更しません。
+   *
+   * @param json CompactResultJson で詰めた認識結果（閉じ括弧の前に追記する）
+   * @return bool 話者を照合した場合はtrue
+   */
+  bool label(std::string *json) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int frames = 0;
+    if (!ParseSpeakerVector(*json, &query, &frames) ||
+        !setDimensions(query.size()) || json->empty() || json->back() != '}')
+      return false;
+    if (!normalize(query.data(), dims)) return false;
+
+    // 最も似ている話者を選ぶ
+    size_t best = ids.size();
+    float bestSimilarity = -1.0f;
+    for (size_t i = 0; i < ids.size(); i++) {
+      const float similarity =
+          DotProduct(query.data(), centroids.data() + i * dims, dims);
+      if (similarity > bestSimilarity) {
+        bestSimilarity = similarity;
+        best = i;
+      }
+    }
+
+    const float weight = static_cast<float>((frames > 0) ? frames : 1);
+    if (best < ids.size() && bestSimilarity >= threshold) {
+      update(best, weight);
+    } else if (ids.size() < maxSpeakers) {
+      char id[16];
+      snprintf(id, sizeof(id), "S%u", ++autoNumber);
+      best = ids.size();
+      add(id, query.data(), weight);
+      bestSimilarity = 1.0f;
+    } else {
+      best = ids.size();  // 表が満杯で照合できない
+    }
+
+    json->pop_back();
+    json->append(",\"speaker\":", 11);
+    if (best < ids.size()) {
+      *json += '"';
+      AppendJsonEscaped(ids[best].data(), ids[best].size(), json);
+      *json += '"';
+    } else {
+      json->append("null", 4);
+    }
+    char number[32];
+    const int length = snprintf(number, sizeof(number), ",\"similarity\":%.3f}",
+                                static_cast<double>(bestSimilarity));
+    json->append(number, static_cast<size_t>(length));
+    return true;
+  }
+
+ private:
+  // 次元数を決める（最初の呼び出しで容量を確保する。mutex を保持して呼ぶ）
+  bool setDimensions(size_t count) {
+    if (count == 0) return false;
+    if (dims == 0) {
+      dims = count;
+      centroids.reserve(maxSpeakers * dims);
+      sums.reserve(maxSpeakers * dims);
+      query.reserve(dims);
+      ids.reserve(maxSpeakers);
+    }
+    return count == dims;
+  }
+
+  static bool normalize(float *vector, size_t count) {
+    const float norm = sqrtf(DotProduct(vector, vector, count));
+    if (!(norm > 0.0f)) return false;
+    for (size_t i = 0; i < count; i++) vector[i] /= norm;
+    return true;
+  }
+
+  void add(const std::string &id, const float *vector, float weight) {
+    ids.push_back(id);
+    const size_t offset = centroids.size();
+    centroids.insert(centroids.end(), vector, vector + dims);
+    normalize(centroids.data() + offset, dims);
+    sums.resize(offset + dims);
+    for (size_t i = 0; i < dims; i++)
+      sums[offset + i] = centroids[offset + i] * weight;
+  }
+
+  // 照合した結果（正規化済みの query）を平均ベクトルに加える
+  void update(size_t index, float weight) {
+    float *sum = sums.data() + index * dims;
+    float *centroid = centroids.data() + index * dims;
+    for (size_t i = 0; i < dims; i++) {
+      sum[i] += query[i] * weight;
+      centroid[i] = sum[i];
+    }
+    normalize(centroid, dims);
+  }
+
+  float threshold;
+  size_t maxSpeakers;
+  size_t dims;                   // ベクトルの次元数（0は未定）
+  unsigned autoNumber;           // 自動で登録した話者の番号
+  std::vector<std::string> ids;  // 話者のID
+  std::vector<float> centroids;  // 正規化した平均ベクトル（話者ごとに dims）
+  std::vector<float> sums;       // フレーム数で重み付けした合計
+  std::vector<float> query;      // 照合中のベクトル
+  mutable std::mutex mutex;
+};
@@ -0,0 +1,118 @@
+﻿//-----------------------------------------------------------------------------
+// 単一プロデューサ/単一コンシューマのロックフリー・リングバッファ
+// キャプチャスレッドと認識スレッドの間で16kHz PCMを受け渡します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+//--
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+/**
+ * @brief SPSCリングバッファ
+ *
+ * 書き込みは1スレッド、読み出しは1スレッドに限ります。
+ * 書き込み位置と読み出し位置はそれぞれ片方のスレッドだけが更新し、
+ * acquire/release で相手側に公開するためロックは不要です。
+ * 容量を超えた書き込みは捨て、その数をオーバーラン数として記録します。
+ */
+template <typename T>
+class SpscRingBuffer {
+ public:
+  /**
+   * @param minCapacity 必要な容量（2のべき乗に切り上げる）
+   */
+  explicit SpscRingBuffer(size_t minCapacity)
+      : head(0), tail(0), overruns(0), overrunSamples(0), highWater(0) {
+    size_t capacity = 1;
+    while (capacity < minCapacity) capacity <<= 1;
+    buffer.resize(capacity);
+    mask = capacity - 1;
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+  // 現在たまっている要素数（どちらのスレッドから呼んでもよい）
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @brief 要素を書き込む（プロデューサ側）
+   *
+   * @param data 書き込む要素
+   * @param count 要素数
+   * @return size_t 実際に書き込めた要素数（空きが足りない分は捨てる）
+   */
+  size_t write(const T *data, size_t count) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    const size_t h = head.load(std::memory_order_acquire);
+    const size_t space = capacity() - (t - h);
+    const size_t n = (std::min)(count, space);
+
+    // 末尾で折り返す場合は2回に分けてコピー
+    const size_t offset = t & mask;
+    const size_t first = (std::min)(n, capacity() - offset);
+    std::copy(data, data + first, buffer.begin() + offset);
+    std::copy(data + first, data + n, buffer.begin());
+    tail.store(t + n, std::memory_order_release);
+
+    const size_t used = t + n - h;
+    if (used > highWater.load(std::memory_order_relaxed))
+      highWater.store(used, std::memory_order_relaxed);
+    if (n < count) {
+      overruns.fetch_add(1, std::memory_order_relaxed);
+      overrunSamples.fetch_add(count - n, std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  /**
+   * @brief 要素を読み出す（コンシューマ側）
+   *
+   * @param data 読み出し先
+   * @param maxCount 読み出す最大要素数
+   * @return size_t 実際に読み出した要素数
+   */
+  size_t read(T *data, size_t maxCount) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    const size_t t = tail.load(std::memory_order_acquire);
+    const size_t n = (std::min)(maxCount, t - h);
+
+    const size_t offset = h & mask;
+    const size_t first = (std::min)(n, capacity() - offset);
+    std::copy(buffer.begin() + offset, buffer.begin() + offset + first, data);
+    std::copy(buffer.begin(), buffer.begin() + (n - first), data + first);
+    head.store(h + n, std::memory_order_release);
+    return n;
+  }
+
+  // 空きが足りず書き込みを捨てた回数
+  size_t overrunCount() const {
+    return overruns.load(std::memory_order_relaxed);
+  }
+
+  // 捨てた要素の総数
+  size_t droppedCount() const {
+    return overrunSamples.load(std::memory_order_relaxed);
+  }
+
+  // これまでに同時にたまった要素数の最大値
+  size_t highWaterMark() const {
+    return highWater.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::vector<T> buffer;
+  size_t mask;
+
+  // 読み出し位置と書き込み位置は別スレッドが更新するためキャッシュラインを分ける
+  alignas(64) std::atomic<size_t> head;  // コンシューマが更新
+  alignas(64) std::atomic<size_t> tail;  // プロデューサが更新
+  alignas(64) std::atomic<size_t> overruns;
+  std::atomic<size_t> overrunSamples;
+  std::atomic<size_t> highWater;
+};
@@ -0,0 +1,165 @@
+﻿//-----------------------------------------------------------------------------
+// 長いファイルの分割位置の決定と、チャンクごとの単語の時刻の補正の単体テスト
+//-----------------------------------------------------------------------------
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+//--
+#include <random>
+#include <string>
+#include <vector>
+
+#include "chunk_planner.h"
+#include "result_text.h"
+#include "test_util.h"
+
+namespace {
+
+// 結果JSONの最初の key の数値を読む（見つからなければ-1）
+double ReadNumber(const std::string &json, const char *key) {
+  size_t found = json.find(key);
+  if (found == std::string::npos) return -1.0;
+  return strtod(json.c_str() + found + strlen(key), nullptr);
+}
+
+void CheckShiftTimestamps() {
+  const std::string json =
+      "{\"result\":[{\"conf\":1.0,\"end\":2.5,\"start\":2.0,\"word\":\"a\"}],"
+      "\"text\":\"a\"}";
+  std::string shifted = ShiftTimestamps(json, 10.0);
+  EXPECT_NEAR(ReadNumber(shifted, "\"start\":"), 12.0, 1e-6);
+  EXPECT_NEAR(ReadNumber(shifted, "\"end\":"), 12.5, 1e-6);
+  // 時刻以外のフィールドは変えない
+  EXPECT_NEAR(ReadNumber(shifted, "\"conf\":"), 1.0, 1e-6);
+  EXPECT_TRUE(shifted.find("\"text\":\"a\"") != std::string::npos);
+
+  shifted = ShiftTimestamps(json, -1.5);
+  EXPECT_NEAR(ReadNumber(shifted, "\"start\":"), 0.5, 1e-6);
+
+  // 数値でない値はそのまま残す
+  EXPECT_TRUE(ShiftTimestamps("{\"start\":\"x\"}", 1.0) == "{\"start\":\"x\"}");
+}
+
+void CheckSilenceSplits() {
+  // 10秒ごとに0.5秒の無音がある60秒分のエネルギー（10ms単位）
+  std::vector<float> energy(6000, 1.0f);
+  for (size_t s = 1000; s < 6000; s += 1000)
+    for (size_t i = s - 20; i < s + 30; i++) energy[i] = 0.0f;
+
+  std::vector<size_t> splits = PlanSilenceSplits(energy, 1000, 150, 30);
+  EXPECT_EQ(splits.size(), 5);
+  for (size_t i = 0; i < splits.size(); i++) {
+    // 分割点は無音区間の中に入る
+    size_t silence = (i + 1) * 1000;
+    EXPECT_TRUE(splits[i] >= silence - 20 && splits[i] < silence + 30);
+  }
+
+  // 短い入力は分割しない
+  EXPECT_EQ(PlanSilenceSplits(std::vector<float>(1100, 1.0f), 1000, 150, 30)
+                .size(),
+            0);
+}
+
+// 探す範囲だけを読む版が、全体を渡す版と同じ分割点を返すことを確かめる
+void CheckLazySplits() {
+  std::mt19937 random(7);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  for (size_t total : {500, 1199, 1200, 12000, 36000}) {
+    std::vector<float> energy(total);
+    for (float &e : energy) e = dist(random);
+
+    size_t readFrames = 0;
+    bool inRange = true;
+    std::vector<size_t> lazy = PlanSilenceSplits(
+        total, 1000, 166, 30, [&](size_t start, size_t count, float *out) {
+          if (start + count > total) inRange = false;
+          for (size_t i = 0; i < count && start + i < total; i++)
+            out[i] = energy[start + i];
+          readFrames += count;
+          return true;
+        });
+    EXPECT_TRUE(inRange);
+    EXPECT_TRUE(lazy == PlanSilenceSplits(energy, 1000, 166, 30));
+    // 読むのは分割点を探す範囲だけ（全体の3分の1ほど）
+    EXPECT_TRUE(readFrames <= (lazy.size() * (2 * 166 + 30) + 30));
+    EXPECT_TRUE(readFrames * 2 < total || lazy.empty());
+  }
+
+  // 読み出しに失敗したらそれ以降は分割しない
+  std::vector<size_t> stopped = PlanSilenceSplits(
+      6000, 1000, 150, 30,
+      [](size_t start, size_t, float *) { return start < 1500; });
+  EXPECT_EQ(stopped.size(), 1);
+}
+
+/**
+ * @brief VOSKの認識器の時刻の数え方をまねたもの
+ *
+ * 単語の時刻は作成からの通算で、reset() しても戻りません。
+ */
+struct FakeRecognizer {
+  uint64_t position = 0;  // 作成から受け取ったサンプル数
+
+  // チャンクを受け取り、その先頭から wordStart 秒の位置の単語を返す
+  std::string transcribe(size_t samples, double wordStart) {
+    const double start = (position + wordStart * 16000) / 16000.0;
+    position += samples;
+    char json[128];
+    snprintf(json, sizeof(json),
+             "{\"result\":[{\"conf\":1.0,\"end\":%.6f,\"start\":%.6f,"
+             "\"word\":\"w\"}],\"text\":\"w\"}",
+             start + 0.25, start);
+    return json;
+  }
+  void reset() {}
+};
+
+// 1つの認識器で複数のチャンクを続けて認識しても時刻がずれないことを確かめる
+void CheckMultiChunkWordTimes() {
+  // 60秒のファイルを無音で分割したチャンク（10ms単位の分割点）
+  std::vector<float> energy(6000, 1.0f);
+  for (size_t s = 1000; s < 6000; s += 1000)
+    for (size_t i = s - 20; i < s + 30; i++) energy[i] = 0.0f;
+  std::vector<size_t> splits = PlanSilenceSplits(energy, 1000, 150, 30);
+  std::vector<size_t> bounds = {0};
+  bounds.insert(bounds.end(), splits.begin(), splits.end());
+  bounds.push_back(energy.size());
+  const size_t chunks = bounds.size() - 1;
+  EXPECT_EQ(chunks, 6);
+
+  // 2つのワーカーが、奪い合いで順不同にチャンクを処理する
+  const size_t kOrder[2][3] = {{0, 3, 4}, {2, 1, 5}};
+  for (const auto &order : kOrder) {
+    FakeRecognizer recognizer;
+    uint64_t samplesFed = 0;
+    for (size_t chunk : order) {
+      const double offset = bounds[chunk] / 100.0;
+      const size_t samples = (bounds[chunk + 1] - bounds[chunk]) * 160;
+
+      std::string json = recognizer.transcribe(samples, 1.0);
+      recognizer.reset();
+      std::string shifted =
+          ShiftTimestamps(json, ChunkTimeShift(offset, samplesFed));
+      samplesFed += samples;
+
+      // 単語はチャンクの先頭から1秒の位置
+      EXPECT_NEAR(ReadNumber(shifted, "\"start\":"), offset + 1.0, 1e-4);
+      EXPECT_NEAR(ReadNumber(shifted, "\"end\":"), offset + 1.25, 1e-4);
+    }
+  }
+
+  // 最初のチャンクでは補正量はチャンクの開始時刻そのもの
+  EXPECT_NEAR(ChunkTimeShift(12.5, 0), 12.5, 1e-9);
+  EXPECT_NEAR(ChunkTimeShift(12.5, 16000 * 20), -7.5, 1e-9);
+}
+
+}  // namespace
+
+int main() {
+  CheckShiftTimestamps();
+  CheckSilenceSplits();
+  CheckLazySplits();
+  CheckMultiChunkWordTimes();
+  return TestResult("chunk_planner_test");
+}
@@ -0,0 +1,171 @@
+﻿//-----------------------------------------------------------------------------
+// ダウンミックスカーネルと16kHzモノラル変換器の単体テスト
+// SIMD版の各カーネルが全形式・全チャンネル数でスカラー版と一致するか確かめます
+//-----------------------------------------------------------------------------
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+//--
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "audio_converter.h"
+#include "downmix.h"
+#include "test_util.h"
+
+namespace {
+
+const SampleFormat kFormats[] = {SampleFormat::UInt8, SampleFormat::Int16,
+                                 SampleFormat::Int24, SampleFormat::Int32,
+                                 SampleFormat::Float32};
+
+int BytesPerSample(SampleFormat format) {
+  switch (format) {
+    case SampleFormat::UInt8:
+      return 1;
+    case SampleFormat::Int16:
+      return 2;
+    case SampleFormat::Int24:
+      return 3;
+    default:
+      return 4;
+  }
+}
+
+// 全チャンネル数で使えるスカラー版（基準実装）
+DownmixKernel ScalarKernel(SampleFormat format) {
+  switch (format) {
+    case SampleFormat::UInt8:
+      return DownmixScalar<SampleFormat::UInt8, 0>;
+    case SampleFormat::Int16:
+      return DownmixScalar<SampleFormat::Int16, 0>;
+    case SampleFormat::Int24:
+      return DownmixScalar<SampleFormat::Int24, 0>;
+    case SampleFormat::Int32:
+      return DownmixScalar<SampleFormat::Int32, 0>;
+    default:
+      return DownmixScalar<SampleFormat::Float32, 0>;
+  }
+}
+
+/**
+ * @brief ランダムなサンプルを詰めた入力を作る
+ *
+ * 末尾を越えた読み出しをサニタイザで検出できるよう、余白は付けません。
+ * Float32は -1.0〜1.0 の値、それ以外は全ビットがランダムな整数です。
+ */
+std::vector<uint8_t> MakeInput(SampleFormat format, int channels,
+                               size_t frames, std::mt19937 &random) {
+  const size_t samples = frames * static_cast<size_t>(channels);
+  std::vector<uint8_t> data(samples * BytesPerSample(format));
+  if (format == SampleFormat::Float32) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (size_t i = 0; i < samples; i++) {
+      float v = dist(random);
+      memcpy(&data[i * 4], &v, 4);
+    }
+  } else {
+    for (uint8_t &b : data) b = static_cast<uint8_t>(random());
+  }
+  return data;
+}
+
+// 選ばれたカーネルの出力をスカラー版と比べる
+void CheckKernel(SampleFormat format, int channels, SimdLevel level,
+                 std::mt19937 &random) {
+  // 4/8フレーム単位の本体と端数の処理を両方通る長さ
+  const size_t kFrameCounts[] = {0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 480,
+                                 1023};
+  DownmixKernel kernel = SelectDownmixKernel(format, channels, level);
+  EXPECT_TRUE(kernel != nullptr);
+  if (kernel == nullptr) return;
+  DownmixKernel reference = ScalarKernel(format);
+
+  for (size_t frames : kFrameCounts) {
+    std::vector<uint8_t> input = MakeInput(format, channels, frames, random);
+    std::vector<float> expected(frames), actual(frames);
+    reference(input.data(), frames, channels, expected.data());
+    kernel(input.data(), frames, channels, actual.data());
+
+    // 加算の順序が違うため、チャンネル数に応じたわずかな誤差は許す
+    size_t mismatches = 0;
+    for (size_t f = 0; f < frames; f++)
+      if (fabsf(actual[f] - expected[f]) > 1e-6f * channels) mismatches++;
+    if (mismatches != 0)
+      fprintf(stderr, "format=%d channels=%d level=%s frames=%zu\n",
+              static_cast<int>(format), channels, SimdLevelName(level),
+              frames);
+    EXPECT_EQ(mismatches, 0);
+  }
+}
+
+// 変換器の出力が、スカラー版のダウンミックスと実行時レートのリサンプラを
+// 組み合わせた結果と一致することを確かめる
+void CheckConverter(SampleFormat format, int channels, int rate,
+                    std::mt19937 &random) {
+  std::unique_ptr<AudioConverter> converter =
+      CreateMono16kConverter(format, channels, rate);
+  EXPECT_TRUE(converter != nullptr);
+  if (!converter) return;
+
+  BasicPolyphaseResampler<> resampler(rate);
+  DownmixKernel reference = ScalarKernel(format);
+  // パケットごとに変換し、連続した出力として比べる
+  const size_t kPackets[] = {441, 480, 7, 1000};
+  std::vector<short> expected, actual;
+  for (size_t frames : kPackets) {
+    std::vector<uint8_t> input = MakeInput(format, channels, frames, random);
+
+    std::vector<short> out(converter->maxOutputSize(frames));
+    size_t written = converter->convert(input.data(), frames, out.data());
+    EXPECT_TRUE(written <= out.size());
+    actual.insert(actual.end(), out.begin(), out.begin() + written);
+
+    reference(input.data(), frames, channels, resampler.inputBuffer(frames));
+    out.assign(resampler.maxOutputSize(frames), 0);
+    written = resampler.process(out.data());
+    expected.insert(expected.end(), out.begin(), out.begin() + written);
+  }
+
+  EXPECT_EQ(actual.size(), expected.size());
+  size_t mismatches = 0;
+  for (size_t i = 0; i < actual.size() && i < expected.size(); i++)
+    if (abs(actual[i] - expected[i]) > 1) mismatches++;
+  if (mismatches != 0)
+    fprintf(stderr, "converter format=%d channels=%d rate=%d\n",
+            static_cast<int>(format), channels, rate);
+  EXPECT_EQ(mismatches, 0);
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 random(12345);
+
+  // 実行中のCPUが対応する命令セットまでをすべて試す
+  std::vector<SimdLevel> levels = {SimdLevel::Scalar};
+  const SimdLevel available = CurrentSimdLevel();
+  if (available >= SimdLevel::SSE2) levels.push_back(SimdLevel::SSE2);
+  if (available >= SimdLevel::AVX2) levels.push_back(SimdLevel::AVX2);
+  printf("simd: %s\n", SimdLevelName(available));
+
+  for (SampleFormat format : kFormats) {
+    for (int channels = 1; channels <= 8; channels++) {
+      for (SimdLevel level : levels)
+        CheckKernel(format, channels, level, random);
+      for (int rate : {16000, 22050, 44100, 48000})
+        CheckConverter(format, channels, rate, random);
+    }
+  }
+
+  // 未対応の形式とチャンネル数ではカーネルも変換器も作らない
+  EXPECT_TRUE(SelectDownmixKernel(SampleFormat::Unknown, 2) == nullptr);
+  EXPECT_TRUE(SelectDownmixKernel(SampleFormat::Int16, 0) == nullptr);
+  EXPECT_TRUE(!CreateMono16kConverter(SampleFormat::Unknown, 2, 48000));
+  EXPECT_TRUE(!CreateMono16kConverter(SampleFormat::Int16, 0, 48000));
+  EXPECT_TRUE(!CreateMono16kConverter(SampleFormat::Int16, 2, 0));
+  return TestResult("downmix_test");
+}
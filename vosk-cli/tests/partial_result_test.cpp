@@ -0,0 +1,96 @@
+﻿//-----------------------------------------------------------------------------
+// PartialResultEncoder の単体テスト
+// 同じ部分認識結果の除外、間隔による間引き、差分出力を確かめます
+//-----------------------------------------------------------------------------
+#include <stdio.h>
+//--
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "partial_result.h"
+#include "test_util.h"
+
+namespace {
+
+// -partial-words で単語の時刻が付いた部分認識結果の行
+std::string WordsLine(const char *text, double start) {
+  char line[256];
+  snprintf(line, sizeof(line),
+           "{\"partial\":\"%s\",\"partial_result\":[{\"conf\":1.0,"
+           "\"end\":%.6f,\"start\":%.6f,\"word\":\"%s\"}],"
+           "\"start\":%.6f,\"end\":%.6f}",
+           text, start + 0.5, start, text, start, start + 0.5);
+  return line;
+}
+
+void CheckDeduplication() {
+  PartialResultEncoder encoder(0, false);
+  std::string line;
+  EXPECT_TRUE(encoder.update("{\"partial\":\"a\"}", &line));
+  EXPECT_TRUE(line == "{\"partial\":\"a\"}");
+  EXPECT_TRUE(!encoder.update("{\"partial\":\"a\"}", &line));
+  EXPECT_TRUE(!encoder.update("{\"partial\":\"\"}", &line));
+
+  // 単語の時刻が付いていても、同じテキストは1回だけ行全体で出力する
+  const std::string words = WordsLine("b", 1.0);
+  EXPECT_TRUE(encoder.update(words, &line));
+  EXPECT_TRUE(line == words);
+  EXPECT_TRUE(!encoder.update(words, &line));
+  EXPECT_TRUE(!encoder.update(WordsLine("b", 1.01), &line));
+
+  // エスケープされた引用符を含むテキストも取り出せる
+  const std::string quoted = "{\"partial\":\"say \\\"hi\\\"\",\"x\":";
+  EXPECT_TRUE(encoder.update(quoted + "1}", &line));
+  EXPECT_TRUE(!encoder.update(quoted + "2}", &line));
+
+  // "partial" で始まらない行はそのまま出力する
+  EXPECT_TRUE(encoder.update("{\"other\":1}", &line));
+  EXPECT_TRUE(line == "{\"other\":1}");
+}
+
+void CheckInterval() {
+  PartialResultEncoder encoder(200, false);
+  std::string line;
+  EXPECT_TRUE(encoder.update(WordsLine("a", 0.0), &line));
+  EXPECT_TRUE(!encoder.update(WordsLine("a", 0.0), &line));
+
+  // 間隔内の新しい結果は保留し、期限が来たら最新の1件だけを出力する
+  EXPECT_TRUE(!encoder.update(WordsLine("ab", 0.0), &line));
+  EXPECT_TRUE(!encoder.update(WordsLine("abc", 0.0), &line));
+  EXPECT_TRUE(!encoder.poll(&line));
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  EXPECT_TRUE(encoder.poll(&line));
+  EXPECT_TRUE(line == WordsLine("abc", 0.0));
+  EXPECT_TRUE(!encoder.poll(&line));
+}
+
+void CheckDelta() {
+  PartialResultEncoder encoder(0, true);
+  std::string line;
+  EXPECT_TRUE(encoder.update("{\"partial\":\"ab\"}", &line));
+  EXPECT_TRUE(line == "{\"partial_replace\":\"ab\",\"offset\":0}");
+  EXPECT_TRUE(encoder.update("{\"partial\":\"abc\"}", &line));
+  EXPECT_TRUE(line == "{\"partial_append\":\"c\"}");
+  EXPECT_TRUE(encoder.update("{\"partial\":\"ax\"}", &line));
+  EXPECT_TRUE(line == "{\"partial_replace\":\"x\",\"offset\":1}");
+
+  // 他のフィールドを含む行は差分にしない
+  const std::string words = WordsLine("axy", 0.0);
+  EXPECT_TRUE(encoder.update(words, &line));
+  EXPECT_TRUE(line == words);
+
+  // reset() の後の最初の出力は offset 0 の置換
+  encoder.reset();
+  EXPECT_TRUE(encoder.update("{\"partial\":\"axyz\"}", &line));
+  EXPECT_TRUE(line == "{\"partial_replace\":\"axyz\",\"offset\":0}");
+}
+
+}  // namespace
+
+int main() {
+  CheckDeduplication();
+  CheckInterval();
+  CheckDelta();
+  return TestResult("partial_result_test");
+}
@@ -0,0 +1,278 @@
+﻿//-----------------------------------------------------------------------------
+// RecognitionServer の単体テスト
+// 認識器を偽のlibvoskに差し替え、ローカルのクライアントで
+// Open/Audio/Close のフレームのやり取りと停止時の切断を確かめます
+//-----------------------------------------------------------------------------
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+//--
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "recognition_server.h"
+#include "test_util.h"
+
+//-----------------------------------------------------------------------------
+// 偽のlibvosk
+// 1秒分（16000サンプル）受け取るごとに1つの発話を認識したことにします
+//-----------------------------------------------------------------------------
+
+struct VoskModel {};
+
+struct VoskRecognizer {
+  size_t samples = 0;  // 発話の区切りまでに受け取ったサンプル数
+};
+
+namespace {
+std::atomic<int> g_liveRecognizers(0);
+}  // namespace
+
+VoskRecognizer *vosk_recognizer_new(VoskModel *, float sample_rate) {
+  if (sample_rate <= 0.0f) return nullptr;
+  g_liveRecognizers++;
+  return new VoskRecognizer();
+}
+
+VoskRecognizer *vosk_recognizer_new_spk(VoskModel *model, float sample_rate,
+                                        VoskSpkModel *) {
+  return vosk_recognizer_new(model, sample_rate);
+}
+
+VoskRecognizer *vosk_recognizer_new_grm(VoskModel *model, float sample_rate,
+                                        const char *) {
+  return vosk_recognizer_new(model, sample_rate);
+}
+
+void vosk_recognizer_set_spk_model(VoskRecognizer *, VoskSpkModel *) {}
+void vosk_recognizer_set_grm(VoskRecognizer *, char const *) {}
+void vosk_recognizer_set_words(VoskRecognizer *, int) {}
+
+int vosk_recognizer_accept_waveform(VoskRecognizer *recognizer,
+                                    const char *, int length) {
+  recognizer->samples += static_cast<size_t>(length) / 2;
+  if (recognizer->samples < 16000) return 0;
+  recognizer->samples -= 16000;
+  return 1;
+}
+
+const char *vosk_recognizer_result(VoskRecognizer *) {
+  return "{\n  \"text\" : \"hello\"\n}";
+}
+
+const char *vosk_recognizer_partial_result(VoskRecognizer *) {
+  return "{\n  \"partial\" : \"he\"\n}";
+}
+
+const char *vosk_recognizer_final_result(VoskRecognizer *) {
+  return "{\n  \"text\" : \"bye\"\n}";
+}
+
+void vosk_recognizer_reset(VoskRecognizer *recognizer) {
+  recognizer->samples = 0;
+}
+
+void vosk_recognizer_free(VoskRecognizer *recognizer) {
+  g_liveRecognizers--;
+  delete recognizer;
+}
+
+namespace {
+
+//-----------------------------------------------------------------------------
+// テスト用のクライアント
+//-----------------------------------------------------------------------------
+
+class TestClient {
+ public:
+  explicit TestClient(int port) : socket_(kInvalidSocket) {
+    socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    // 応答が来ない場合にテストが止まらないよう、受信に期限を付ける
+#ifdef _WIN32
+    DWORD timeout = 5000;
+#else
+    timeval timeout = {5, 0};
+#endif
+    setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO,
+               reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    connected = connect(socket_, reinterpret_cast<sockaddr *>(&address),
+                        sizeof(address)) == 0;
+  }
+
+  ~TestClient() { disconnect(); }
+
+  void disconnect() {
+    if (socket_ == kInvalidSocket) return;
+    CloseServerSocket(socket_);
+    socket_ = kInvalidSocket;
+  }
+
+  // [種類][長さ LE][ペイロード] のフレームを送る
+  bool send(ServerFrame type, const std::string &payload = std::string()) {
+    std::string frame(1, static_cast<char>(type));
+    const uint32_t length = static_cast<uint32_t>(payload.size());
+    for (int i = 0; i < 4; i++)
+      frame += static_cast<char>((length >> (8 * i)) & 0xff);
+    frame += payload;
+    return ::send(socket_, frame.data(), static_cast<int>(frame.size()),
+                  kServerSendFlags) == static_cast<int>(frame.size());
+  }
+
+  // レートを付けた Open フレームを送る
+  bool open(uint32_t rate) {
+    std::string payload;
+    for (int i = 0; i < 4; i++)
+      payload += static_cast<char>((rate >> (8 * i)) & 0xff);
+    return send(ServerFrame::Open, payload);
+  }
+
+  // samples 個の無音を Audio フレームで送る
+  bool audio(size_t samples) {
+    return send(ServerFrame::Audio, std::string(samples * 2, '\0'));
+  }
+
+  // Json フレームを1つ受け取る（切断・期限切れの場合は空文字列）
+  std::string receive() {
+    uint8_t header[5];
+    if (!receiveAll(reinterpret_cast<char *>(header), sizeof(header)))
+      return std::string();
+    if (header[0] != static_cast<uint8_t>(ServerFrame::Json))
+      return std::string();
+    const uint32_t length = header[1] | (header[2] << 8) | (header[3] << 16) |
+                            (static_cast<uint32_t>(header[4]) << 24);
+    std::string json(length, '\0');
+    if (length > 0 && !receiveAll(&json[0], length)) return std::string();
+    return json;
+  }
+
+  // サーバーが接続を閉じたか（期限内に終端が届いたか）
+  bool closedByServer() {
+    char byte;
+    return recv(socket_, &byte, 1, 0) == 0;
+  }
+
+  bool connected = false;
+
+ private:
+  bool receiveAll(char *data, size_t size) {
+    while (size > 0) {
+      int n = recv(socket_, data, static_cast<int>(size), 0);
+      if (n <= 0) return false;
+      data += n;
+      size -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  ServerSocket socket_;
+};
+
+bool Contains(const std::string &text, const char *part) {
+  return text.find(part) != std::string::npos;
+}
+
+}  // namespace
+
+int main() {
+  VoskModel model;
+  RecognizerPool pool(0, 2);
+  ServerSettings settings;
+  settings.port = 0;
+  settings.maxSessions = 1;
+  RecognitionServer server(&model, &pool, settings);
+  EXPECT_TRUE(server.listen());
+  EXPECT_TRUE(server.port() > 0);
+  std::atomic<int> closedSessions(0);
+  server.setSessionClosedHandler([&closedSessions]() { closedSessions++; });
+  std::thread runner([&server]() { server.run(); });
+
+  TestClient first(server.port());
+  EXPECT_TRUE(first.connected);
+
+  // セッションを開く前の音声はエラーになり、接続は維持される
+  EXPECT_TRUE(first.audio(160));
+  EXPECT_TRUE(Contains(first.receive(), "\"error\":\"No open session\""));
+
+  // Open → Audio → Close の順に結果が返る
+  EXPECT_TRUE(first.open(16000));
+  std::string opened = first.receive();
+  EXPECT_TRUE(Contains(opened, "\"info\":\"open\""));
+  EXPECT_TRUE(Contains(opened, "\"sampleRate\":16000"));
+  EXPECT_TRUE(first.open(16000));
+  EXPECT_TRUE(Contains(first.receive(), "Session already open"));
+
+  EXPECT_TRUE(first.audio(8000));
+  EXPECT_TRUE(Contains(first.receive(), "\"partial\":\"he\""));
+  EXPECT_TRUE(first.audio(8000));
+  EXPECT_TRUE(first.receive() == "{\"text\":\"hello\"}");
+
+  EXPECT_TRUE(first.send(ServerFrame::Close));
+  EXPECT_TRUE(first.receive() == "{\"text\":\"bye\"}");
+  EXPECT_TRUE(Contains(first.receive(), "\"info\":\"closed\""));
+  EXPECT_EQ(pool.stats().idle, 1);
+
+  // 未知のフレームはエラーを返す
+  EXPECT_TRUE(first.send(static_cast<ServerFrame>('X')));
+  EXPECT_TRUE(Contains(first.receive(), "Unknown frame type"));
+
+  // 別の接続がセッションを開いている間は上限を超えて開けない
+  {
+    TestClient second(server.port());
+    EXPECT_TRUE(second.open(16000));
+    EXPECT_TRUE(Contains(second.receive(), "\"info\":\"open\""));
+    EXPECT_TRUE(first.open(16000));
+    EXPECT_TRUE(Contains(first.receive(), "Too many sessions"));
+    // Close を送らずに切断する
+  }
+
+  // 切断した接続のセッションは閉じられ、認識器はプールに戻る
+  std::string reopened;
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(first.open(16000));
+    reopened = first.receive();
+    if (!Contains(reopened, "Too many sessions")) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  EXPECT_TRUE(Contains(reopened, "\"info\":\"open\""));
+
+  // 接続数の上限（maxSessions の2倍）を超える接続はエラーを返して閉じる
+  // （切断した接続は回収されるまで数えるため、受け付けられるまで繰り返す）
+  std::unique_ptr<TestClient> idle;
+  for (int i = 0; i < 100; i++) {
+    idle.reset(new TestClient(server.port()));
+    EXPECT_TRUE(idle->send(static_cast<ServerFrame>('X')));
+    if (Contains(idle->receive(), "Unknown frame type")) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  {
+    TestClient rejected(server.port());
+    EXPECT_TRUE(Contains(rejected.receive(), "Too many connections"));
+    EXPECT_TRUE(rejected.closedByServer());
+  }
+  idle.reset();
+
+  // 新しい接続を受け付けると、終了した接続が回収される
+  { TestClient third(server.port()); }
+
+  // stop() はセッションを開いたままの接続も切断して戻る
+  server.stop();
+  runner.join();
+  EXPECT_TRUE(first.closedByServer());
+  EXPECT_EQ(closedSessions.load(), 1);  // Close を受けたセッションだけ
+  EXPECT_EQ(pool.stats().inUse, 0);
+
+  return TestResult("recognition_server_test");
+}
@@ -0,0 +1,113 @@
+﻿//-----------------------------------------------------------------------------
+// BasicPolyphaseResampler の単体テスト
+// パケットの区切り方によらず、一括で変換した場合と同じ出力になるかを確かめます
+//-----------------------------------------------------------------------------
+#include <math.h>
+#include <stddef.h>
+//--
+#include <vector>
+
+#include "resampler.h"
+#include "test_util.h"
+
+namespace {
+
+const double kPi = 3.14159265358979323846;
+
+// 1kHzの正弦波に高めの成分を少し混ぜたテスト信号
+std::vector<float> MakeSignal(int rate, size_t count) {
+  std::vector<float> signal(count);
+  for (size_t i = 0; i < count; i++) {
+    double t = static_cast<double>(i) / rate;
+    signal[i] = static_cast<float>(0.5 * sin(2.0 * kPi * 1000.0 * t) +
+                                   0.1 * sin(2.0 * kPi * 3300.0 * t));
+  }
+  return signal;
+}
+
+// 入力を packetSizes の長さを順に繰り返して区切りながら変換する
+template <typename Resampler, typename T>
+std::vector<T> Convert(Resampler &resampler, const std::vector<float> &input,
+                       const std::vector<size_t> &packetSizes) {
+  std::vector<T> output;
+  size_t offset = 0;
+  for (size_t p = 0; offset < input.size(); p++) {
+    size_t count = packetSizes[p % packetSizes.size()];
+    if (count > input.size() - offset) count = input.size() - offset;
+    std::vector<T> block(resampler.maxOutputSize(count));
+    float *dst = resampler.inputBuffer(count);
+    for (size_t i = 0; i < count; i++) dst[i] = input[offset + i];
+    size_t written = resampler.process(block.data());
+    EXPECT_TRUE(written <= block.size());
+    output.insert(output.end(), block.begin(), block.begin() + written);
+    offset += count;
+  }
+  return output;
+}
+
+// 一括変換と細切れの変換で出力が一致することを確かめる
+template <int InputRate, typename T>
+void CheckContinuity(int rate) {
+  // WASAPIのパケット長に近いものと、位相の境界にかかりやすい半端な長さ
+  const std::vector<size_t> kPackets = {1, 7, 441, 480, 13, 1000, 160, 3};
+  const std::vector<float> input = MakeSignal(rate, rate * 2 + 123);
+
+  BasicPolyphaseResampler<InputRate> whole(rate);
+  std::vector<T> expected =
+      Convert<BasicPolyphaseResampler<InputRate>, T>(whole, input,
+                                                     {input.size()});
+  BasicPolyphaseResampler<InputRate> chunked(rate);
+  std::vector<T> actual =
+      Convert<BasicPolyphaseResampler<InputRate>, T>(chunked, input, kPackets);
+
+  EXPECT_EQ(actual.size(), expected.size());
+  size_t mismatches = 0;
+  for (size_t i = 0; i < actual.size() && i < expected.size(); i++)
+    if (actual[i] != expected[i]) mismatches++;
+  EXPECT_EQ(mismatches, 0);
+
+  // 出力数は入力の長さとレート比から1サンプル以内に決まる
+  double ideal = static_cast<double>(input.size()) * 16000 / rate;
+  EXPECT_NEAR(static_cast<double>(expected.size()), ideal, 1.0);
+
+  // reset() 後は新しく作った場合と同じ出力になる
+  chunked.reset();
+  std::vector<T> again =
+      Convert<BasicPolyphaseResampler<InputRate>, T>(chunked, input, kPackets);
+  EXPECT_TRUE(again == expected);
+}
+
+// 通過帯域の正弦波の振幅が保たれることを確かめる
+void CheckPassbandGain(int rate) {
+  std::vector<float> input(static_cast<size_t>(rate));
+  for (size_t i = 0; i < input.size(); i++)
+    input[i] = static_cast<float>(0.5 * sin(2.0 * kPi * 1000.0 * i / rate));
+
+  BasicPolyphaseResampler<> resampler(rate);
+  std::vector<float> output =
+      Convert<BasicPolyphaseResampler<>, float>(resampler, input, {480});
+  // フィルタの立ち上がりを除いた区間のピーク
+  float peak = 0.0f;
+  for (size_t i = 1000; i < output.size(); i++)
+    if (fabsf(output[i]) > peak) peak = fabsf(output[i]);
+  EXPECT_NEAR(peak, 0.5, 0.02);
+}
+
+}  // namespace
+
+int main() {
+  // 実行時にレートを決める版
+  const int kRates[] = {8000, 11025, 16000, 22050, 32000, 44100, 48000, 96000};
+  for (int rate : kRates) {
+    CheckContinuity<0, float>(rate);
+    CheckContinuity<0, short>(rate);
+    CheckPassbandGain(rate);
+  }
+  // コンパイル時にレートを固定した版
+  CheckContinuity<48000, float>(48000);
+  CheckContinuity<48000, short>(48000);
+  CheckContinuity<44100, float>(44100);
+  CheckContinuity<44100, short>(44100);
+  CheckContinuity<16000, short>(16000);
+  return TestResult("resampler_test");
+}
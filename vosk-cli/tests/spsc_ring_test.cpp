@@ -0,0 +1,130 @@
+﻿//-----------------------------------------------------------------------------
+// SpscRingBuffer の単体テスト
+// 2スレッドで書き込みと読み出しを並行させ、順序と欠落の記録を確かめます
+//-----------------------------------------------------------------------------
+#include <stddef.h>
+#include <stdint.h>
+//--
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "spsc_ring.h"
+#include "test_util.h"
+
+namespace {
+
+// 1スレッドでの基本動作と折り返し
+void CheckSingleThread() {
+  SpscRingBuffer<int> ring(5);
+  EXPECT_EQ(ring.capacity(), 8);
+  EXPECT_EQ(ring.size(), 0);
+
+  int data[10];
+  for (int i = 0; i < 10; i++) data[i] = i;
+  int out[10] = {};
+
+  // 6個書いて4個読み、さらに6個書くと末尾で折り返す
+  EXPECT_EQ(ring.write(data, 6), 6);
+  EXPECT_EQ(ring.read(out, 4), 4);
+  EXPECT_EQ(out[3], 3);
+  EXPECT_EQ(ring.write(data, 6), 6);
+  EXPECT_EQ(ring.size(), 8);
+  EXPECT_EQ(ring.highWaterMark(), 8);
+
+  // 満杯の状態では書き込みを捨てて記録する
+  EXPECT_EQ(ring.write(data, 3), 0);
+  EXPECT_EQ(ring.overrunCount(), 1);
+  EXPECT_EQ(ring.droppedCount(), 3);
+
+  EXPECT_EQ(ring.read(out, 10), 8);
+  const int expected[] = {4, 5, 0, 1, 2, 3, 4, 5};
+  for (int i = 0; i < 8; i++) EXPECT_EQ(out[i], expected[i]);
+  EXPECT_EQ(ring.read(out, 10), 0);
+  EXPECT_EQ(ring.size(), 0);
+}
+
+/**
+ * @brief プロデューサとコンシューマを別スレッドで動かす
+ *
+ * プロデューサは連番をさまざまな長さで書き込み、捨てられた分も含めて
+ * 次の番号へ進みます。コンシューマは読んだ値が単調に増え、
+ * 飛んだ数の合計が droppedCount() と一致することを確かめます。
+ *
+ * @param capacity リングバッファの容量
+ * @param total 書き込む値の総数
+ * @param lossless trueの場合、空きができるまで待って全件を書き込む
+ */
+void CheckTwoThreads(size_t capacity, uint32_t total, bool lossless) {
+  SpscRingBuffer<uint32_t> ring(capacity);
+  std::atomic<bool> producerDone(false);
+
+  std::thread producer([&ring, &producerDone, total, lossless]() {
+    std::vector<uint32_t> block(97);
+    uint32_t next = 0;
+    size_t length = 1;
+    while (next < total) {
+      size_t count = (std::min)(length, static_cast<size_t>(total - next));
+      for (size_t i = 0; i < count; i++)
+        block[i] = next + static_cast<uint32_t>(i);
+      size_t written = ring.write(block.data(), count);
+      if (lossless) {
+        next += static_cast<uint32_t>(written);
+        if (written < count) std::this_thread::yield();
+      } else {
+        next += static_cast<uint32_t>(count);
+      }
+      length = length % block.size() + 1;
+    }
+    producerDone.store(true, std::memory_order_release);
+  });
+
+  std::vector<uint32_t> out(61);
+  uint64_t received = 0;
+  uint64_t skipped = 0;
+  int64_t last = -1;
+  size_t disorders = 0;
+  for (;;) {
+    // 終了フラグを先に見てから読むことで、最後の書き込みを取りこぼさない
+    bool done = producerDone.load(std::memory_order_acquire);
+    size_t n = ring.read(out.data(), out.size());
+    for (size_t i = 0; i < n; i++) {
+      int64_t value = out[i];
+      if (value <= last) disorders++;
+      if (value > last + 1) skipped += static_cast<uint64_t>(value - last - 1);
+      last = value;
+    }
+    received += n;
+    if (n == 0) {
+      if (done) break;
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+
+  EXPECT_EQ(disorders, 0);
+  // 末尾の書き込みが捨てられた場合、その分は最後の値より後ろになる
+  skipped += static_cast<uint64_t>(total - 1 - last);
+  EXPECT_EQ(received + skipped, total);
+  EXPECT_TRUE(ring.highWaterMark() <= ring.capacity());
+  if (lossless) {
+    // 書き直した分も捨てた数に数えられるため、届いた数だけを見る
+    EXPECT_EQ(received, total);
+  } else {
+    EXPECT_EQ(skipped, ring.droppedCount());
+    EXPECT_EQ(ring.overrunCount() == 0, ring.droppedCount() == 0);
+  }
+}
+
+}  // namespace
+
+int main() {
+  CheckSingleThread();
+  // 容量が書き込み長より小さい場合と十分ある場合の両方を試す
+  CheckTwoThreads(16, 2000000, true);
+  CheckTwoThreads(4096, 2000000, true);
+  CheckTwoThreads(16, 2000000, false);
+  CheckTwoThreads(256, 2000000, false);
+  return TestResult("spsc_ring_test");
+}
@@ -0,0 +1,56 @@
+﻿//-----------------------------------------------------------------------------
+// 単体テスト用の最小限の検査マクロ
+// 外部のテストフレームワークに依存せず、失敗した検査の数を終了コードで返します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <math.h>
+#include <stdio.h>
+
+// 失敗した検査の数（テストごとの実行ファイル内で共有する）
+inline int &TestFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+// 条件が偽なら場所と式を出力して失敗として数える
+#define EXPECT_TRUE(cond)                                              \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: EXPECT_TRUE(%s)\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      TestFailures()++;                                                \
+    }                                                                  \
+  } while (0)
+
+// 2つの値が等しいことを検査する（値は long long で出力する）
+#define EXPECT_EQ(a, b)                                                  \
+  do {                                                                   \
+    if (!((a) == (b))) {                                                 \
+      fprintf(stderr, "%s:%d: EXPECT_EQ(%s, %s): %lld != %lld\n",        \
+              __FILE__, __LINE__, #a, #b, static_cast<long long>(a),     \
+              static_cast<long long>(b));                                \
+      TestFailures()++;                                                  \
+    }                                                                    \
+  } while (0)
+
+// 2つの浮動小数点数の差が tolerance 以下であることを検査する
+#define EXPECT_NEAR(a, b, tolerance)                                       \
+  do {                                                                     \
+    double expectNearA = (a), expectNearB = (b);                           \
+    if (!(fabs(expectNearA - expectNearB) <= (tolerance))) {               \
+      fprintf(stderr, "%s:%d: EXPECT_NEAR(%s, %s): %.9g != %.9g\n",        \
+              __FILE__, __LINE__, #a, #b, expectNearA, expectNearB);       \
+      TestFailures()++;                                                    \
+    }                                                                      \
+  } while (0)
+
+// main() の最後で呼び、結果を出力して終了コードを返す
+inline int TestResult(const char *name) {
+  if (TestFailures() == 0) {
+    printf("%s: OK\n", name);
+    return 0;
+  }
+  printf("%s: %d failure(s)\n", name, TestFailures());
+  return 1;
+}
@@ -0,0 +1,199 @@
+﻿//-----------------------------------------------------------------------------
+// エネルギーとゼロ交差率による音声区間ゲート
+// 無音・環境音の区間を認識器に渡さず、デコードの負荷を減らします
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+//--
+#include <algorithm>
+#include <vector>
+
+/**
+ * @brief 音声区間ゲートの設定
+ */
+struct VadSettings {
+  float marginDb = 9.0f;  // 雑音レベルからこれだけ大きいフレームを音声とみなす
+  float minDb = -55.0f;   // これより小さいフレームは常に非音声（dBFS）
+  int hangoverMs = 500;   // 音声が途切れてからゲートを閉じるまでの時間
+  int preRollMs = 300;    // ゲートを開いたときに遡って渡す時間
+};
+
+/**
+ * @brief 16kHzモノラルPCMのストリーミング音声区間ゲート
+ *
+ * サンプルの型 T は16ビットPCM（short）か、同じ振幅のfloatです。
+ *
+ * 10msごとのフレームでエネルギー（dBFS）とゼロ交差率を求め、
+ * ゆっくり追従する雑音レベルとの差で音声かどうかを判定します。
+ * 無声子音（「さ」「し」など）はエネルギーが小さくゼロ交差率が高いため、
+ * ゼロ交差率が高いフレームは閾値を半分にして判定します。
+ *
+ * - 音声フレームが2つ続いたらゲートを開く
+ * - 開いたときは直前 preRollMs 分（閉じている間もためておく）から渡し、
+ *   語頭が欠けないようにする
+ * - 最後の音声フレームから hangoverMs たったらゲートを閉じる
+ *
+ * 出力先と内部のバッファは使い回すため、定常状態では割り当てが発生しません。
+ */
+template <typename T>
+class BasicVoiceActivityGate {
+ public:
+  static const int kSampleRate = 16000;
+  static const size_t kFrameSamples = kSampleRate / 100;  // 10ms
+
+  explicit BasicVoiceActivityGate(const VadSettings &settings)
+      : settings(settings), frameFill(0),
+        hangoverFrames(msToFrames(settings.hangoverMs)), noiseDb(-70.0f),
+        open(false), speechRun(0), hangoverLeft(0), preRollStart(0),
+        preRollCount(0), inputSamples(0), passed(0), runStart(0) {
+    preRoll.resize((std::max)(msToFrames(settings.preRollMs), 1) *
+                   kFrameSamples);
+  }
+
+  /**
+   * @brief PCMを判定し、音声区間のサンプルを出力先へ追加する
+   *
+   * ゲートが閉じた時点で処理を止めて戻ります。呼び出し側は closed が true の
+   * 場合に発話を確定させ（vosk_recognizer_final_result など）、
+   * 残りの入力で再度呼び出します。
+   *
+   * @param samples 入力（16kHzモノラル）
+   * @param count 入力サンプル数
+   * @param output 音声区間のサンプルの追加先
+   * @param closed ゲートが閉じた場合にtrueを格納する
+   * @return size_t 処理した入力サンプル数
+   */
+  size_t process(const T *samples, size_t count, std::vector<T> *output,
+                 bool *closed) {
+    *closed = false;
+    size_t used = 0;
+    while (used < count) {
+      // 10msに満たない分はフレームバッファにためる
+      size_t n = (std::min)(kFrameSamples - frameFill, count - used);
+      std::copy(samples + used, samples + used + n, frame + frameFill);
+      frameFill += n;
+      used += n;
+      if (frameFill < kFrameSamples) break;
+
+      frameFill = 0;
+      inputSamples += kFrameSamples;
+      if (processFrame(output)) {
+        *closed = true;
+        break;
+      }
+    }
+    return used;
+  }
+
+  bool isOpen() const { return open; }
+
+  // ゲートに入力したサンプル数
+  uint64_t totalSamples() const { return inputSamples; }
+
+  // 認識器に渡したサンプル数
+  uint64_t passedSamples() const { return passed; }
+
+  // 捨てたサンプル数
+  uint64_t gatedSamples() const { return inputSamples - passed; }
+
+  // 空の出力先に最後に追加したサンプルの入力位置（先頭からのサンプル数）
+  // 1回の process() の出力は入力の連続した区間になる
+  uint64_t outputStart() const { return runStart; }
+
+ private:
+  static int msToFrames(int ms) { return ms > 0 ? (ms + 9) / 10 : 0; }
+
+  // 1フレームを判定して出力する（ゲートが閉じたらtrue）
+  bool processFrame(std::vector<T> *output) {
+    double energy = 0.0;
+    int crossings = 0;
+    for (size_t i = 0; i < kFrameSamples; i++) {
+      energy += static_cast<double>(frame[i]) * frame[i];
+      if (i > 0 && ((frame[i] < 0) != (frame[i - 1] < 0))) crossings++;
+    }
+    const float meanSquare =
+        static_cast<float>(energy) / kFrameSamples / (32768.0f * 32768.0f);
+    const float db = 10.0f * log10f(meanSquare + 1e-10f);
+    const float zcr = static_cast<float>(crossings) / kFrameSamples;
+
+    bool speech = db > settings.minDb && db > noiseDb + settings.marginDb;
+    if (!speech && zcr > 0.3f)
+      speech = db > settings.minDb && db > noiseDb + settings.marginDb * 0.5f;
+
+    // 雑音レベルは下がるときは速く、上がるときはゆっくり（約5秒で）追従する
+    // 発話中も音節の間で下がるため、定常的な雑音でゲートが開いたままにならない
+    noiseDb += (db - noiseDb) * (db < noiseDb ? 0.1f : 0.002f);
+
+    if (!open) {
+      speechRun = speech ? speechRun + 1 : 0;
+      if (speechRun < kOpenFrames) {
+        pushPreRoll();
+        return false;
+      }
+      // 開く：ためておいた直前の音声から渡す
+      open = true;
+      hangoverLeft = hangoverFrames;
+      if (output->empty())
+        runStart = inputSamples - kFrameSamples - preRollCount;
+      flushPreRoll(output);
+    } else if (speech) {
+      hangoverLeft = hangoverFrames;
+    } else if (hangoverLeft-- <= 0) {
+      open = false;
+      speechRun = 0;
+      pushPreRoll();
+      return true;
+    }
+
+    if (output->empty()) runStart = inputSamples - kFrameSamples;
+    output->insert(output->end(), frame, frame + kFrameSamples);
+    passed += kFrameSamples;
+    return false;
+  }
+
+  // 閉じている間のフレームを固定長の環状バッファにためる
+  void pushPreRoll() {
+    const size_t capacity = preRoll.size();
+    const size_t end = (preRollStart + preRollCount) % capacity;
+    std::copy(frame, frame + kFrameSamples, preRoll.begin() + end);
+    if (preRollCount + kFrameSamples <= capacity)
+      preRollCount += kFrameSamples;
+    else
+      preRollStart = (preRollStart + kFrameSamples) % capacity;
+  }
+
+  void flushPreRoll(std::vector<T> *output) {
+    const size_t capacity = preRoll.size();
+    for (size_t i = 0; i < preRollCount; i += kFrameSamples) {
+      const size_t start = (preRollStart + i) % capacity;
+      output->insert(output->end(), preRoll.begin() + start,
+                     preRoll.begin() + start + kFrameSamples);
+    }
+    passed += preRollCount;
+    preRollStart = 0;
+    preRollCount = 0;
+  }
+
+  static const int kOpenFrames = 2;  // ゲートを開くのに必要な連続音声フレーム数
+
+  VadSettings settings;
+  T frame[kFrameSamples];  // 判定中のフレーム
+  size_t frameFill;        // frame にたまったサンプル数
+  int hangoverFrames;      // hangoverMs のフレーム数
+  float noiseDb;           // 推定した雑音レベル（dBFS）
+  bool open;               // ゲートが開いているか
+  int speechRun;           // 閉じている間の連続音声フレーム数
+  int hangoverLeft;        // 閉じるまでの残りフレーム数
+  std::vector<T> preRoll;  // 直前の音声（フレーム単位の環状バッファ）
+  size_t preRollStart;     // preRoll の先頭位置
+  size_t preRollCount;     // preRoll にたまったサンプル数
+  uint64_t inputSamples;   // 入力したサンプル数（完了したフレーム分）
+  uint64_t passed;         // 出力したサンプル数
+  uint64_t runStart;       // outputStart() の値
+};
+
+// 16ビットPCM用のゲート
+typedef BasicVoiceActivityGate<short> VoiceActivityGate;
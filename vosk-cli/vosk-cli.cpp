@@ -7,6 +7,8 @@
 #define VOSK_CLI_VERSION "1.0.0"
 #define VOSK_CLI_BUILD_DATE __DATE__
 
+// winsock2.h は windows.h より前に読み込む（古い winsock.h との衝突を避ける）
+#include <winsock2.h>
 #include <windows.h>
 #include <mmdeviceapi.h>
 #include <audioclient.h>
@@ -18,26 +20,155 @@
 #include <stdlib.h>
 #include <wchar.h>
 #include <locale.h>
+#include <math.h>
 //--
 #include <codecvt>
 #include <locale>
 #include <vector>
 #include <string>
 #include <regex>
+#include <memory>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <functional>
 //--
 #include "vosk_api.h"
+#include "audio_converter.h"
+#include "spsc_ring.h"
+#include "wav_reader.h"
+#include "mapped_wav_reader.h"
+#include "work_queue.h"
+#include "chunk_planner.h"
+#include "audio_source.h"
+#include "result_text.h"
+#include "json_writer.h"
+#include "partial_result.h"
+#include "vad_gate.h"
+#include "recognizer_pool.h"
+#include "model_prefetch.h"
+#include "bench_stats.h"
+#include "control_channel.h"
+#include "session_clock.h"
+#include "speaker_id.h"
+#include "recognition_server.h"
 
 // VOSKライブラリ
 #pragma comment(lib, "libvosk.lib")
 
+// ヒープ割り当て回数の計測はデバッグビルドでは常に有効にする
+// （リリースビルドでは /D VOSK_CLI_COUNT_ALLOCATIONS を付けた場合だけ）
+#if defined(_DEBUG) && !defined(VOSK_CLI_COUNT_ALLOCATIONS)
+#define VOSK_CLI_COUNT_ALLOCATIONS
+#endif
+
+#ifdef VOSK_CLI_COUNT_ALLOCATIONS
+// ヒープ割り当て回数を数え、キャプチャ経路の割り当ての検出と
+// ベンチマークの割り当て回数/秒に使う（libvosk.dll 内の割り当ては含まない）
+static std::atomic<size_t> g_allocationCount(0);
+
+void *operator new(size_t size) {
+  g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+#endif
+
+/**
+ * @brief これまでのヒープ割り当て回数を返す関数
+ *
+ * @return size_t このプログラムのC++コードによる割り当て回数
+ *         （計測が無効なビルドでは常に0）
+ */
+size_t GetAllocationCount() {
+#ifdef VOSK_CLI_COUNT_ALLOCATIONS
+  return g_allocationCount.load(std::memory_order_relaxed);
+#else
+  return 0;
+#endif
+}
+
+// 標準出力へのJSON行の出力先（書き出しタイミングは -flush-ms/-flush-lines）
+static JsonLineOutput g_output(stdout);
+
 /**
  * @brief JSON形式でエラーメッセージを出力する関数
  *
- * @param message 出力するエラーメッセージ
+ * @param message 出力するエラーメッセージ（エスケープはこの関数で行う）
+ * @param device エラーが起きたデバイスのインデックス（負の場合は出力しない）
+ */
+void outputJsonError(const std::string &message, int device = -1) {
+  JsonWriter writer;
+  writer.beginObject().key("error").string(message);
+  if (device >= 0) writer.key("device").integer(device);
+  writer.endObject();
+  g_output.writeLine(writer);
+}
+
+// 起動時間の基準（プロセスの開始時）
+static const std::chrono::steady_clock::time_point g_processStart =
+    std::chrono::steady_clock::now();
+
+/**
+ * @brief 指定した時刻からの経過時間をミリ秒で返す関数
+ */
+double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+/**
+ * @brief QPCの時刻をUNIX時間のミリ秒に直す関数
+ *
+ * 現在のQPCとシステム時刻の組から換算します。
+ *
+ * @param qpcPosition 100ns単位のQPCの時刻（WASAPIのGetBufferの値。0は現在）
+ * @return double UNIX時間のミリ秒
+ */
+double QpcToEpochMs(uint64_t qpcPosition) {
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  FILETIME now;
+  GetSystemTimePreciseAsFileTime(&now);
+
+  // FILETIMEは1601年からの100ns単位
+  const uint64_t fileTime =
+      (static_cast<uint64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+  const double nowEpochMs = (fileTime - 116444736000000000ULL) / 10000.0;
+  if (qpcPosition == 0) return nowEpochMs;
+  const double nowQpc =
+      static_cast<double>(counter.QuadPart) * 1e7 / frequency.QuadPart;
+  return nowEpochMs - (nowQpc - static_cast<double>(qpcPosition)) / 10000.0;
+}
+
+/**
+ * @brief 起動の段階の完了をJSON行で出力する関数
+ *
+ * {"info":"startup","phase":"model_load","atMs":t,"durationMs":d} の形式で、
+ * atMs はプロセス開始からの経過時間です。
+ *
+ * @param phase 段階の名前
+ * @param device デバイスのインデックス（負の場合は出力しない）
+ * @param durationMs 段階にかかった時間（負の場合は出力しない）
  */
-void outputJsonError(const std::string &message) {
-  printf("{\"error\":\"%s\"}\n", message.c_str());
-  fflush(stdout);
+void OutputStartupPhase(const char *phase, int device = -1,
+                        double durationMs = -1.0) {
+  JsonWriter writer;
+  writer.beginObject().key("info").string("startup").key("phase").string(
+      phase);
+  if (device >= 0) writer.key("device").integer(device);
+  writer.key("atMs").number(MillisecondsSince(g_processStart), 1);
+  if (durationMs >= 0.0) writer.key("durationMs").number(durationMs, 1);
+  writer.endObject();
+  g_output.writeLine(writer);
 }
 
 /**
@@ -106,34 +237,49 @@ std::vector<AudioDeviceInfo> EnumerateInputDevices() {
  */
 void OutputDevicesAsJson() {
   std::vector<AudioDeviceInfo> devices = EnumerateInputDevices();
-  std::string json = "{\"devices\":[";
+  JsonWriter writer;
+  writer.beginObject().key("devices").beginArray();
 
+  std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
   for (size_t i = 0; i < devices.size(); ++i) {
-    // ワイド文字列をUTF-8に変換
-    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
-    std::string id = converter.to_bytes(devices[i].id);
-    std::string name = converter.to_bytes(devices[i].name);
-
-    json += "{";
-    json += "\"index\":" + std::to_string(i) + ",";
-    json += "\"id\":\"" + id + "\",";
-    json += "\"name\":\"" + name + "\"";
-    json += "}";
-
-    if (i < devices.size() - 1) json += ",";
+    // ワイド文字列をUTF-8に変換（デバイス名の引用符などはライタがエスケープ）
+    writer.beginObject()
+        .key("index")
+        .integer(static_cast<long long>(i))
+        .key("id")
+        .string(converter.to_bytes(devices[i].id))
+        .key("name")
+        .string(converter.to_bytes(devices[i].name))
+        .endObject();
   }
 
-  json += "],\"version\":\"" + std::string(VOSK_CLI_VERSION) + "\"}";
-  puts(json.c_str());
+  writer.endArray().key("version").string(VOSK_CLI_VERSION).endObject();
+  g_output.writeLine(writer);
 }
 
 /**
- * @brief 文字列からすべてのスペースを削除する関数
+ * @brief 認識結果からスペースを削除する関数
+ *
+ * JSONの空白と日本語のトークン間の空白を取り除きます（CompactResultJson参照）。
+ * 部分認識結果のように頻繁に呼ぶ箇所では、出力先を使い回せる
+ * CompactResultJson を直接使います。
  *
  * @param input 処理する文字列
  * @return std::string スペースが削除された文字列
  */
 std::string RemoveSpaces(const char *input) {
+  std::string output;
+  CompactResultJson(input, &output);
+  return output;
+}
+
+/**
+ * @brief 以前の正規表現による実装（ベンチマークの比較用）
+ *
+ * @param input 処理する文字列
+ * @return std::string すべての空白が削除された文字列
+ */
+std::string RemoveSpacesRegex(const char *input) {
   if (!input) return "";
   auto a = std::string(input);
   std::regex space_pattern("\\s+");
@@ -143,113 +289,137 @@ std::string RemoveSpaces(const char *input) {
 }
 
 /**
- * @brief オーディオバッファを16kHzモノラルに変換する関数
+ * @brief 結果の後処理を正規表現版と比較するマイクロベンチマーク
  *
- * @param buffer 変換するオーディオバッファ
- * @param numFrames フレーム数
- * @param sampleRate 元のサンプリングレート
- * @param channels チャンネル数
- * @param bitsPerSample ビット深度
- * @return std::vector<short> 変換後の16kHzモノラルPCMデータ
- */
-std::vector<short> ConvertBufferToMono16k(const BYTE *buffer, UINT32 numFrames,
-                                          int sampleRate, int channels,
-                                          int bitsPerSample) {
-  // 出力バッファ
-  std::vector<short> result;
-
-  // 入力バッファが空なら空のベクトルを返す
-  if (buffer == nullptr || numFrames == 0) {
-    return result;
-  }
-
-  // IEEE浮動小数点形式かどうかを判定
-  bool isFloat = (bitsPerSample == 32);  // 通常、32ビットはfloat
-
-  // リサンプリング比率の計算
-  double ratio = 16000.0 / sampleRate;
-  int bytesPerSample = bitsPerSample / 8;
-  int bytesPerFrame = channels * bytesPerSample;
-
-  // 出力サイズの見積もり
-  size_t outputSamples = static_cast<size_t>(numFrames * ratio);
-  result.reserve(outputSamples);
-
-  // 各出力サンプルにつき、最も近い入力サンプルを計算する
-  for (size_t outSample = 0; outSample < outputSamples; outSample++) {
-    // 入力サンプル位置を計算
-    double inSamplePos = outSample / ratio;
-    size_t inSample = static_cast<size_t>(inSamplePos);
-
-    // バウンダリチェック
-    if (inSample >= numFrames) {
-      inSample = numFrames - 1;
+ * VOSKが返す形式の部分認識結果と最終結果を両方の実装で繰り返し処理し、
+ * 1回あたりの時間をJSON形式で出力します。
+ */
+void RunTextBenchmark() {
+  const char *const kSamples[] = {
+      "{\n  \"partial\" : \"今日 は 良い 天気 です ね\"\n}",
+      "{\n  \"text\" : \"今日 は 良い 天気 です ね 明日 も 晴れる と "
+      "いい です ね\"\n}",
+      "{\n  \"result\" : [{\n      \"conf\" : 1.000000,\n      \"end\" : "
+      "1.110000,\n      \"start\" : 0.870000,\n      \"word\" : "
+      "\"今日\"\n    }, {\n      \"conf\" : 0.981234,\n      \"end\" : "
+      "1.500000,\n      \"start\" : 1.110000,\n      \"word\" : "
+      "\"は\"\n    }],\n  \"text\" : \"今日 は\"\n}",
+  };
+  const int kIterations = 20000;
+
+  for (const char *sample : kSamples) {
+    size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++)
+      sink += RemoveSpacesRegex(sample).size();
+    double regexNs = std::chrono::duration<double, std::nano>(
+                         std::chrono::steady_clock::now() - start)
+                         .count() /
+                     kIterations;
+
+    std::string output;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+      CompactResultJson(sample, &output);
+      sink += output.size();
     }
+    double singlePassNs = std::chrono::duration<double, std::nano>(
+                              std::chrono::steady_clock::now() - start)
+                              .count() /
+                          kIterations;
+
+    // 日本語のみの結果では両者の出力が一致する
+    bool same = RemoveSpacesRegex(sample) == output;
+    JsonWriter writer;
+    writer.beginObject()
+        .key("info")
+        .string("bench-text")
+        .key("bytes")
+        .integer(static_cast<long long>(strlen(sample)))
+        .key("regexNs")
+        .number(regexNs, 0)
+        .key("singlePassNs")
+        .number(singlePassNs, 0)
+        .key("speedup")
+        .number(singlePassNs > 0.0 ? regexNs / singlePassNs : 0.0, 1)
+        .key("sameOutput")
+        .boolean(same)
+        .key("sink")
+        .integer(static_cast<long long>(sink))
+        .endObject();
+    g_output.writeLine(writer);
+  }
+}
 
-    // すべてのチャネルの平均を取る
-    int sum = 0;
-    float sumFloat = 0.0f;
+/**
+ * @brief ミックスフォーマットからサンプル形式を判定する関数
+ *
+ * WAVE_FORMAT_EXTENSIBLE の場合はサブフォーマットでPCM/浮動小数点を区別します。
+ *
+ * @param deviceFormat デバイスのWAVEFORMATEX構造体へのポインタ
+ * @return SampleFormat 判定したサンプル形式（未対応ならUnknown）
+ */
+SampleFormat GetSampleFormat(const WAVEFORMATEX *deviceFormat) {
+  if (!deviceFormat) return SampleFormat::Unknown;
 
-    for (int ch = 0; ch < channels; ch++) {
-      // サンプル位置を計算
-      size_t pos = inSample * bytesPerFrame + ch * bytesPerSample;
+  bool isFloat = deviceFormat->wFormatTag == WAVE_FORMAT_IEEE_FLOAT;
+  bool isPcm = deviceFormat->wFormatTag == WAVE_FORMAT_PCM;
+  if (deviceFormat->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+      deviceFormat->cbSize >= 22) {
+    const WAVEFORMATEXTENSIBLE *wfext =
+        reinterpret_cast<const WAVEFORMATEXTENSIBLE *>(deviceFormat);
+    isFloat = wfext->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+    isPcm = wfext->SubFormat == KSDATAFORMAT_SUBTYPE_PCM;
+  }
 
-      if (isFloat) {
-        // IEEE浮動小数点形式の場合
-        float value = 0.0f;
-        // 正しいバイトオーダーでfloat値を構築
-        memcpy(&value, buffer + pos, sizeof(float));
-        sumFloat += value;
-      } else {
-        // PCM整数形式の場合
-        int value = 0;
-        switch (bitsPerSample) {
-          case 8:
-            // 8ビットPCMは通常0-255の範囲（符号なし）
-            value = buffer[pos] - 128;
-            break;
-          case 16:
-            // 16ビットPCMは-32768〜32767の範囲（符号あり）
-            value = static_cast<short>(buffer[pos] | (buffer[pos + 1] << 8));
-            break;
-          case 24:
-            // 24ビットPCM
-            value =
-                buffer[pos] | (buffer[pos + 1] << 8) | (buffer[pos + 2] << 16);
-            // 符号ビット拡張
-            if (value & 0x800000) {
-              value |= 0xFF000000;
-            }
-            break;
-          case 32:
-            // 32ビット整数PCM（非浮動小数点）
-            value = buffer[pos] | (buffer[pos + 1] << 8) |
-                    (buffer[pos + 2] << 16) | (buffer[pos + 3] << 24);
-            // 16ビットにスケールダウン
-            value >>= 16;
-            break;
-        }
-        sum += value;
-      }
-    }
+  if (isFloat && deviceFormat->wBitsPerSample == 32)
+    return SampleFormat::Float32;
+  if (!isPcm) return SampleFormat::Unknown;
+
+  switch (deviceFormat->wBitsPerSample) {
+    case 8:
+      return SampleFormat::UInt8;
+    case 16:
+      return SampleFormat::Int16;
+    case 24:
+      return SampleFormat::Int24;
+    case 32:
+      return SampleFormat::Int32;
+    default:
+      return SampleFormat::Unknown;
+  }
+}
 
-    // 平均値を計算（モノラル化）
-    short monoSample;
-    if (isFloat) {
-      float avg = sumFloat / channels;
-      float clipped = avg * 32767.0f;
-      if (clipped > 32767.0f) clipped = 32767.0f;
-      if (clipped < -32768.0f) clipped = -32768.0f;
-      monoSample = static_cast<short>(clipped);
-    } else {
-      monoSample = static_cast<short>(sum / channels);
-    }
+/**
+ * @brief オーディオバッファを16kHzモノラルに変換する関数
+ *
+ * 形式・チャンネル数・レートに応じた分岐は変換器の作成時に済んでいるため、
+ * ここではパケットごとに変換器を呼び出すだけです。
+ * 出力は呼び出し側が確保した領域へ書き込み、ヒープ割り当ては行いません。
+ * 出力先が float の場合は16ビットPCMと同じ振幅のまま量子化・クリッピングを
+ * せずに書き込みます（vosk_recognizer_accept_waveform_f に渡す経路）。
+ *
+ * @param converter ストリームごとの変換器（CreateMono16kConverterで作成）
+ * @param buffer 変換するオーディオバッファ
+ * @param numFrames フレーム数
+ * @param output 出力先（short または float）
+ * @param capacity 出力先の要素数（maxOutputSize(numFrames)以上が必要）
+ * @return size_t 書き込んだサンプル数（容量不足の場合は0）
+ */
+template <typename Sample>
+size_t ConvertBufferToMono16k(AudioConverter &converter, const BYTE *buffer,
+                              UINT32 numFrames, Sample *output,
+                              size_t capacity) {
+  // 入力バッファが空なら何もしない
+  if (buffer == nullptr || numFrames == 0 || output == nullptr) {
+    return 0;
+  }
 
-    // 変換したサンプルを結果に追加
-    result.push_back(monoSample);
+  if (capacity < converter.maxOutputSize(numFrames)) {
+    return 0;
   }
 
-  return result;
+  return converter.convert(buffer, numFrames, output);
 }
 
 /**
@@ -260,24 +430,28 @@ std::vector<short> ConvertBufferToMono16k(const BYTE *buffer, UINT32 numFrames,
 void PrintDeviceFormat(WAVEFORMATEX *deviceFormat) {
   if (!deviceFormat) return;
 
-  printf("{\n");
-  printf("  \"format\": {\n");
-  printf("    \"formatTag\": \"0x%04X\",\n", deviceFormat->wFormatTag);
-  printf("    \"sampleRate\": %u,\n", deviceFormat->nSamplesPerSec);
-  printf("    \"channels\": %u,\n", deviceFormat->nChannels);
-  printf("    \"bitDepth\": %u,\n", deviceFormat->wBitsPerSample);
-  printf("    \"bytesPerFrame\": %u,\n", deviceFormat->nBlockAlign);
-  printf("    \"bytesPerSecond\": %u,\n", deviceFormat->nAvgBytesPerSec);
-  printf("    \"extraSize\": %u", deviceFormat->cbSize);
+  char hex[16];
+  JsonWriter writer;
+  writer.beginObject().key("format").beginObject();
+  snprintf(hex, sizeof(hex), "0x%04X", deviceFormat->wFormatTag);
+  writer.key("formatTag").string(hex);
+  writer.key("sampleRate").integer(deviceFormat->nSamplesPerSec);
+  writer.key("channels").integer(deviceFormat->nChannels);
+  writer.key("bitDepth").integer(deviceFormat->wBitsPerSample);
+  writer.key("bytesPerFrame").integer(deviceFormat->nBlockAlign);
+  writer.key("bytesPerSecond").integer(deviceFormat->nAvgBytesPerSec);
+  writer.key("extraSize").integer(deviceFormat->cbSize);
 
   if (deviceFormat->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
       deviceFormat->cbSize >= 22) {
     WAVEFORMATEXTENSIBLE *wfext =
         reinterpret_cast<WAVEFORMATEXTENSIBLE *>(deviceFormat);
-    printf(",\n    \"extensible\": {\n");
-    printf("      \"validBitsPerSample\": %u,\n",
-           wfext->Samples.wValidBitsPerSample);
-    printf("      \"channelMask\": \"0x%08X\",\n", wfext->dwChannelMask);
+    writer.key("extensible").beginObject();
+    writer.key("validBitsPerSample")
+        .integer(wfext->Samples.wValidBitsPerSample);
+    snprintf(hex, sizeof(hex), "0x%08X",
+             static_cast<unsigned>(wfext->dwChannelMask));
+    writer.key("channelMask").string(hex);
 
     // GUID文字列形式に変換
     char guidString[100];
@@ -288,25 +462,20 @@ void PrintDeviceFormat(WAVEFORMATEX *deviceFormat) {
               wfext->SubFormat.Data4[3], wfext->SubFormat.Data4[4],
               wfext->SubFormat.Data4[5], wfext->SubFormat.Data4[6],
               wfext->SubFormat.Data4[7]);
-
-    printf("      \"subFormat\": \"%s\",\n", guidString);
+    writer.key("subFormat").string(guidString);
 
     // サブフォーマットの種類
     if (wfext->SubFormat == KSDATAFORMAT_SUBTYPE_PCM)
-      printf("      \"subFormatType\": \"PCM\"\n");
+      writer.key("subFormatType").string("PCM");
     else if (wfext->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT)
-      printf("      \"subFormatType\": \"IEEE FLOAT\"\n");
+      writer.key("subFormatType").string("IEEE FLOAT");
     else
-      printf("      \"subFormatType\": \"UNKNOWN\"\n");
-
-    printf("    }\n");
-  } else {
-    printf("\n");
+      writer.key("subFormatType").string("UNKNOWN");
+    writer.endObject();
   }
 
-  printf("  }\n");
-  printf("}\n");
-  fflush(stdout);
+  writer.endObject().endObject();
+  g_output.writeLine(writer);
 }
 
 /**
@@ -371,6 +540,17 @@ bool SaveAsWav(const std::vector<short> &samples, const char *filename,
   fclose(fp);
   return true;
 }
+
+// float経路のPCMを16ビットに量子化して保存する版
+bool SaveAsWav(const std::vector<float> &samples, const char *filename,
+               int sampleRate = 16000, int numChannels = 1) {
+  std::vector<short> pcm(samples.size());
+  for (size_t i = 0; i < samples.size(); i++) {
+    const float value = (std::min)((std::max)(samples[i], -32768.0f), 32767.0f);
+    pcm[i] = static_cast<short>(value);
+  }
+  return SaveAsWav(pcm, filename, sampleRate, numChannels);
+}
 /**
  * @brief リソースを管理するクラス
  *
@@ -418,297 +598,2589 @@ class ResourceGuard {
 };
 
 /**
- * @brief マイクからのオーディオストリームを開始し音声認識を実行する関数
- *
- * @param deviceIndex 使用するオーディオデバイスのインデックス
- * @param modelPath 音声認識モデルのパス
- * @param isTest
- * テストモードフラグ（trueの場合、10秒間録音してWAVファイルを保存）
+ * @brief WASAPI共有モードでオーディオデバイスから録音する入力元
  */
-void StartAudioStream(int deviceIndex, const char *modelPath, bool isTest,
-                      bool textOnly) {
-  ResourceGuard resources;  // スコープを抜ける際に自動的にリソースを解放
-
-  // VOSKモデルのロード
-  vosk_set_log_level(-1);
-  VoskModel *model = vosk_model_new(modelPath);
-  if (model == nullptr) {
-    outputJsonError("Failed to load model: " + std::string(modelPath));
-    return;
+class WasapiAudioSource : public AudioSource {
+ public:
+  /**
+   * @param deviceIndex 使用するオーディオデバイスのインデックス
+   */
+  explicit WasapiAudioSource(int deviceIndex)
+      : deviceIndex(deviceIndex), deviceFormat(nullptr), bufferFrameCount(0),
+        started(false) {}
+
+  ~WasapiAudioSource() override {
+    stop();
+    if (deviceFormat) CoTaskMemFree(deviceFormat);
   }
-  resources.setModel(model);
-
-  // 認識器の作成（16kHzサンプルレート用）
-  VoskRecognizer *recognizer = vosk_recognizer_new(model, 16000.0);
-  resources.setRecognizer(recognizer);
-
-  // リサンプル用バッファの事前確保
-  std::vector<short> convertedData;
-  convertedData.reserve(16000);  // 1秒分のバッファを事前確保
 
-  // 前回の部分認識結果を保持する変数
-  std::string lastPartialStr;
+  bool open() override {
+    CoInitialize(nullptr);  // COMを初期化
 
-  CoInitialize(nullptr);  // COMを初期化
+    CComPtr<IMMDeviceEnumerator> enumerator;
+    CComPtr<IMMDevice> device;
+    HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr,
+                                  CLSCTX_ALL, IID_PPV_ARGS(&enumerator));
+    if (FAILED(hr)) {
+      error = "MMDeviceEnumerator creation failed: " + std::to_string(hr);
+      return false;
+    }
 
-  CComPtr<IMMDeviceEnumerator> enumerator;
-  CComPtr<IMMDevice> device;
-  HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr,
-                                CLSCTX_ALL, IID_PPV_ARGS(&enumerator));
-  if (FAILED(hr)) {
-    outputJsonError("MMDeviceEnumerator creation failed: " +
-                    std::to_string(hr));
-    return;
-  }
+    CComPtr<IMMDeviceCollection> collection;
+    hr = enumerator->EnumAudioEndpoints(eCapture, DEVICE_STATE_ACTIVE,
+                                        &collection);
+    if (FAILED(hr)) {
+      error = "EnumAudioEndpoints failed: " + std::to_string(hr);
+      return false;
+    }
 
-  CComPtr<IMMDeviceCollection> collection;
-  // EnumAudioEndpoints エラー処理の修正
-  hr = enumerator->EnumAudioEndpoints(eCapture, DEVICE_STATE_ACTIVE,
-                                      &collection);
-  if (FAILED(hr)) {
-    outputJsonError("EnumAudioEndpoints failed: " + std::to_string(hr));
-    return;
-  }
+    hr = collection->Item(deviceIndex, &device);
+    if (FAILED(hr)) {
+      error = "Failed to get device: " + std::to_string(hr);
+      return false;
+    }
 
-  hr = collection->Item(deviceIndex, &device);
-  if (FAILED(hr)) {
-    outputJsonError("Failed to get device: " + std::to_string(hr));
-    return;
-  }
+    hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr,
+                          (void **)&audioClient);
+    if (FAILED(hr)) {
+      error = "Failed to create IAudioClient: " + std::to_string(hr);
+      return false;
+    }
 
-  CComPtr<IAudioClient> audioClient;
-  hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr,
-                        (void **)&audioClient);
-  if (FAILED(hr)) {
-    outputJsonError("Failed to create IAudioClient: " + std::to_string(hr));
-    return;
-  }
+    hr = audioClient->GetMixFormat(&deviceFormat);
+    if (FAILED(hr)) {
+      deviceFormat = nullptr;
+      error = "GetMixFormat failed: " + std::to_string(hr);
+      return false;
+    }
 
-  WAVEFORMATEX *deviceFormat;
-  hr = audioClient->GetMixFormat(&deviceFormat);
-  if (FAILED(hr)) {
-    outputJsonError("GetMixFormat failed: " + std::to_string(hr));
-    return;
-  }
-  resources.setDeviceFormat(deviceFormat);  // 自動解放の対象に追加
+    // フォーマット情報を表示
+    // PrintDeviceFormat(deviceFormat);
+
+    audioFormat.sampleFormat = GetSampleFormat(deviceFormat);
+    audioFormat.channels = deviceFormat->nChannels;
+    audioFormat.sampleRate = deviceFormat->nSamplesPerSec;
+    audioFormat.frameBytes = deviceFormat->nBlockAlign;
+    if (audioFormat.sampleFormat == SampleFormat::Unknown) {
+      error = "Unsupported mix format: " +
+              std::to_string(deviceFormat->wFormatTag);
+      return false;
+    }
 
-  // フォーマット情報を表示
-  // PrintDeviceFormat(deviceFormat); 
+    // 初期化パラメータを設定
+    REFERENCE_TIME hnsRequestedDuration = 10000000;  // 1秒
 
-  int sample_rate = deviceFormat->nSamplesPerSec;
-  int channels = deviceFormat->nChannels;
-  int bits_per_sample = deviceFormat->wBitsPerSample;  // 初期化パラメータを設定
-  REFERENCE_TIME hnsRequestedDuration = 10000000;      // 1秒
+    hr = audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, 0,
+                                 hnsRequestedDuration, 0, deviceFormat,
+                                 nullptr);
+    if (FAILED(hr)) {
+      error = "Initialize failed: " + std::to_string(hr);
+      return false;
+    }
 
-  hr = audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, 0,
-                               hnsRequestedDuration, 0, deviceFormat, nullptr);
-  if (FAILED(hr)) {
-    outputJsonError("Initialize failed: " + std::to_string(hr));
-    return;
-  }
+    hr = audioClient->GetBufferSize(&bufferFrameCount);
+    if (FAILED(hr)) {
+      error = "GetBufferSize failed: " + std::to_string(hr);
+      return false;
+    }
 
-  // キャプチャクライアントの取得
-  CComPtr<IAudioCaptureClient> captureClient;
-  hr = audioClient->GetService(__uuidof(IAudioCaptureClient),
-                               (void **)&captureClient);
-  if (FAILED(hr)) {
-    outputJsonError("GetService failed: " + std::to_string(hr));
-    return;
-  }
+    // キャプチャクライアントの取得
+    hr = audioClient->GetService(__uuidof(IAudioCaptureClient),
+                                 (void **)&captureClient);
+    if (FAILED(hr)) {
+      error = "GetService failed: " + std::to_string(hr);
+      return false;
+    }
 
-  // 録音処理
-  hr = audioClient->Start();
-  if (FAILED(hr)) {
-    outputJsonError("Start failed: " + std::to_string(hr));
-    return;
+    // 録音処理
+    hr = audioClient->Start();
+    if (FAILED(hr)) {
+      error = "Start failed: " + std::to_string(hr);
+      return false;
+    }
+    started = true;
+    return true;
   }
 
-  DWORD startTime = GetTickCount();
-  DWORD endTime = startTime + (10 * 1000);
-  std::vector<short> convertedBuffer;
+  AudioFormat format() const override { return audioFormat; }
 
-  puts("{\"info\":\"start\"}");
-  fflush(stdout);
+  size_t maxPacketFrames() const override { return bufferFrameCount; }
 
-  while (!isTest || GetTickCount() < endTime) {
+  AudioReadStatus acquire(AudioPacket *packet) override {
     UINT32 packetLength = 0;
-    hr = captureClient->GetNextPacketSize(&packetLength);
+    HRESULT hr = captureClient->GetNextPacketSize(&packetLength);
     if (FAILED(hr)) {
-      outputJsonError("GetNextPacketSize failed: " + std::to_string(hr));
-      break;
-    }
-
-    if (packetLength == 0) {
-      Sleep(10);  // パケットがない場合は少し待つ
-      continue;
+      error = "GetNextPacketSize failed: " + std::to_string(hr);
+      return AudioReadStatus::Error;
     }
+    if (packetLength == 0) return AudioReadStatus::Empty;
 
     BYTE *data;
     UINT32 numFrames;
     DWORD flags;
-    hr = captureClient->GetBuffer(&data, &numFrames, &flags, nullptr, nullptr);
+    UINT64 devicePosition, qpcPosition;
+    hr = captureClient->GetBuffer(&data, &numFrames, &flags, &devicePosition,
+                                  &qpcPosition);
     if (FAILED(hr)) {
-      outputJsonError("GetBuffer failed: " + std::to_string(hr));
-      break;
+      error = "GetBuffer failed: " + std::to_string(hr);
+      return AudioReadStatus::Error;
     }
+    packet->data = data;
+    packet->frames = numFrames;
+    packet->silent = (flags & AUDCLNT_BUFFERFLAGS_SILENT) != 0;
+    // デバイスの位置は取りこぼした（DATA_DISCONTINUITY の）フレームも含めて進む
+    packet->position = devicePosition;
+    packet->qpcPosition = qpcPosition;
+    return AudioReadStatus::Ok;
+  }
 
-    // サイレンスでない場合のみ処理
-    if (!(flags & AUDCLNT_BUFFERFLAGS_SILENT)) {
-      // このパケットのデータを16kHzモノラルに変換
-      convertedData = ConvertBufferToMono16k(data, numFrames, sample_rate,
-                                             channels, bits_per_sample);
-
-      if (isTest)
-        convertedBuffer.insert(convertedBuffer.end(), convertedData.begin(),
-                               convertedData.end());
-
-      // VOSKに渡す
-      if (!convertedData.empty()) {
-        bool isFinal = vosk_recognizer_accept_waveform(
-            recognizer, reinterpret_cast<const char *>(convertedData.data()),
-            static_cast<int>(convertedData.size() * sizeof(short)));
-
-        if (isFinal) {
-          // 文の区切りで結果を表示
-          const char *result = vosk_recognizer_result(recognizer);
-          std::string resultStr = RemoveSpaces(result);
-          if (!resultStr.empty() && resultStr != "{\"text\":\"\"}") {
-            puts(resultStr.c_str());
-            fflush(stdout);
-          }
-
-          // 最終結果が出力されたら部分認識結果をリセット
-          lastPartialStr.clear();
-        } else if (!textOnly) {
-          const char *partial = vosk_recognizer_partial_result(recognizer);
-          // 部分認識結果を取得
-          std::string partialStr = RemoveSpaces(partial);
-
-          // 空または前回と同じ結果は出力しない
-          if (!partialStr.empty() && partialStr != "{\"partial\":\"\"}" && partialStr != lastPartialStr) {
-            puts(partialStr.c_str());
-            fflush(stdout);
-
-            lastPartialStr = partialStr;  // 最後の部分結果を更新
-          }
-        }
-      }
-    }
-    hr = captureClient->ReleaseBuffer(numFrames);
+  bool release(const AudioPacket &packet) override {
+    HRESULT hr =
+        captureClient->ReleaseBuffer(static_cast<UINT32>(packet.frames));
     if (FAILED(hr)) {
-      outputJsonError("ReleaseBuffer failed: " + std::to_string(hr));
-      break;
+      error = "ReleaseBuffer failed: " + std::to_string(hr);
+      return false;
     }
+    return true;
   }
 
-  audioClient->Stop();
-  // 最終結果を取得
-  const char *finalResult = vosk_recognizer_final_result(recognizer);
-  std::string finalResultStr = RemoveSpaces(finalResult);
-  puts(finalResultStr.c_str());
+  void stop() override {
+    if (started) {
+      audioClient->Stop();
+      started = false;
+    }
+  }
 
-  if (isTest) SaveAsWav(convertedBuffer, "recorded_converted.wav", 16000, 1);
-  // リソースは自動的に解放される（ResourceGuardのデストラクタで）
-}
+ private:
+  int deviceIndex;
+  CComPtr<IAudioClient> audioClient;
+  CComPtr<IAudioCaptureClient> captureClient;
+  WAVEFORMATEX *deviceFormat;  // GetMixFormatで取得（デストラクタで解放）
+  AudioFormat audioFormat;
+  UINT32 bufferFrameCount;  // デバイスバッファのフレーム数
+  bool started;
+};
 
 /**
- * @brief プログラムの使用方法を表示する関数
+ * @brief 認識結果の行を出力する関数
  *
- * コマンドライン引数の詳細と使用例を標準出力に表示します。
+ * 複数のデバイスを同時に認識している場合は、先頭に "device" を加えます。
+ *
+ * @param line 詰めた認識結果のJSON
+ * @param device デバイスのインデックス（負の場合は加えない）
+ * @param buffer 行を組み立てる作業領域（容量を使い回す）
  */
-void printUsage() {
-  printf("vosk-cli - Speech To Text Command Line Interface\n");
-  printf("Version: %s (Built: %s)\n", VOSK_CLI_VERSION, VOSK_CLI_BUILD_DATE);
-  printf("\n");
-  printf("Usage: vosk-cli [options]\n");
-  printf("Options:\n");
-  printf("  -l          List input audio devices in JSON format\n");
-  printf("  -d index    Specify the audio device index (default: 0)\n");
-  printf("  -m path     Specify the path to the speech recognition model\n");
-  printf("              (default: model/vosk-model-small-ja-0.22)\n");
-  printf("  -test       Test record 10sec and output wav\n");
-  printf(
-      "  -textonly   Show only final recognition results (no partial "
-      "results)\n");
-  printf("  -h          Show this help message\n");
+void OutputResultLine(const std::string &line, int device,
+                      std::string *buffer) {
+  if (device < 0 || line.size() < 2 || line[0] != '{') {
+    g_output.writeLine(line, false);
+    return;
+  }
+  char prefix[32];
+  int length = snprintf(prefix, sizeof(prefix), "{\"device\":%d", device);
+  buffer->assign(prefix, static_cast<size_t>(length));
+  if (line[1] != '}') *buffer += ',';
+  buffer->append(line, 1, std::string::npos);
+  g_output.writeLine(*buffer, false);
 }
 
 /**
- * @brief コマンドライン引数を解析する関数
+ * @brief テキストファイル全体を読む関数（UTF-8のBOMは取り除く）
  *
- * @param argc 引数の数
- * @param argv 引数の配列
- * @param modelPath モデルパスを格納するポインタ
- * @param listDevices デバイス一覧表示フラグを格納するポインタ
- * @param deviceIndex オーディオデバイスのインデックスを格納するポインタ
- * @param isTest テストモードフラグを格納するポインタ
- * @param textOnly テキストのみモードフラグを格納するポインタ
- * @return int 成功時は0、エラー時は1を返す
+ * @param path ファイルのパス
+ * @param text 内容の格納先
+ * @return bool 読めた場合はtrue
  */
-int parseArguments(int argc, char *argv[], char **modelPath, bool *listDevices,
-                   int *deviceIndex, bool *isTest, bool *textOnly) {  // 初期化
+bool ReadTextFile(const std::string &path, std::string *text) {
+  FILE *fp = nullptr;
+  if (fopen_s(&fp, path.c_str(), "rb") != 0 || fp == nullptr) return false;
+  text->clear();
+  char buffer[4096];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    text->append(buffer, read);
+  fclose(fp);
+  if (text->compare(0, 3, "\xEF\xBB\xBF") == 0) text->erase(0, 3);
+  return true;
+}
 
-  if (argc <= 1) return 1;
+/**
+ * @brief フレーズの一覧のJSONを認識器に渡す文法にする関数
+ *
+ * ["フレーズ", ...] の形だけを受け付け、1行に詰め直します。
+ * 空の配列は文法なし（モデル全体のグラフ）を表す空文字列にします。
+ * 一覧にないことばを "[unk]" として受け取るには、一覧に "[unk]" を含めます。
+ *
+ * @param json フレーズの一覧のJSON
+ * @param grammar 文法の格納先
+ * @param phrases フレーズ数の格納先
+ * @return bool 文字列の配列であればtrue
+ */
+bool ParseGrammar(const std::string &json, std::string *grammar,
+                  size_t *phrases) {
+  std::vector<std::string> values;
+  if (!ParseJsonStringArray(json, &values)) return false;
+  *phrases = values.size();
+  grammar->clear();
+  if (values.empty()) return true;
+
+  JsonWriter writer;
+  writer.beginArray();
+  for (const std::string &value : values) writer.string(value);
+  writer.endArray();
+  *grammar = writer.str();
+  return true;
+}
 
-  for (int i = 1; i < argc; i++) {
-    // -l オプション: デバイス一覧表示
-    if (!strcmp(argv[i], "-l")) {
-      *listDevices = true;
-      continue;
+/**
+ * @brief 登録する話者の一覧を読み込む関数
+ *
+ * 1行に1人、{"id":"名前","spk":[...]} の形式です（最終結果の "spk" を
+ * そのまま使えます）。空行は無視します。
+ *
+ * @param path ファイルのパス
+ * @param table 登録先
+ * @param error 失敗した場合のメッセージの格納先
+ * @return bool すべて登録できた場合はtrue
+ */
+bool LoadSpeakerEnrollment(const std::string &path, SpeakerTable *table,
+                           std::string *error) {
+  std::string text;
+  if (!ReadTextFile(path, &text)) {
+    *error = "Failed to read speaker list: " + path;
+    return false;
+  }
+  std::string line;
+  std::string id;
+  std::vector<float> vector;
+  size_t lineNumber = 0;
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find('\n', start);
+    if (end == std::string::npos) end = text.size();
+    lineNumber++;
+    CompactResultJson(text.substr(start, end - start).c_str(), &line);
+    start = end + 1;
+    if (line.empty()) continue;
+
+    static const char kId[] = "\"id\":";
+    const size_t idAt = line.find(kId);
+    int frames;
+    if (idAt == std::string::npos ||
+        ParseJsonString(line, idAt + sizeof(kId) - 1, &id) ==
+            std::string::npos ||
+        !ParseSpeakerVector(line, &vector, &frames) ||
+        !table->enroll(id, vector.data(), vector.size())) {
+      *error = "Invalid speaker at line " + std::to_string(lineNumber) +
+               ": " + path;
+      return false;
     }
+  }
+  return true;
+}
 
-    // -h オプション: ヘルプ表示
-    if (!strcmp(argv[i], "-h")) {
-      return 1;
-    }
+/**
+ * @brief 制御チャネルから認識スレッドへ渡す状態
+ */
+struct SessionControl {
+  ControlMailbox mailbox;  // 届いたコマンド
+  std::string grammar;     // 現在の文法（空は文法なし。認識スレッドが更新する）
+  int maxAlternatives = 0;                   // 設定した候補数
+  PartialResultEncoder *partials = nullptr;  // 部分認識結果を有効にした場合
+  bool canSwitchDevice = false;  // 入力元がデバイスで切り替えられるか
+  std::atomic<bool> paused{false};         // キャプチャを一時停止しているか
+  std::atomic<bool> switchPending{false};  // デバイスの切り替え要求があるか
+  ControlCommand switchCommand;  // 切り替え要求（switchPending の前に書く）
+};
 
-    // -test オプション: テストモード有効化
-    if (!strcmp(argv[i], "-test")) {
-      *isTest = true;
-      continue;
-    }
+/**
+ * @brief 制御コマンドの応答 {"ack":"名前","ok":...} を出力する関数
+ *
+ * @param command 応答するコマンド
+ * @param device セッションのデバイスのインデックス（負の場合は付けない）
+ * @param error 失敗した場合のメッセージ（空の場合は成功）
+ */
+void OutputAck(const ControlCommand &command, int device,
+               const std::string &error = std::string()) {
+  JsonWriter writer;
+  command.beginAck(&writer, device);
+  writer.key("ok").boolean(error.empty());
+  if (!error.empty()) writer.key("error").string(error);
+  writer.endObject();
+  g_output.writeLine(writer);
+}
 
-    // -textonly オプション: テキストのみモード有効化
-    if (!strcmp(argv[i], "-textonly")) {
-      *textOnly = true;
-      continue;
-    }
+/**
+ * @brief 16kHzモノラルのサンプルを認識器に渡す関数
+ *
+ * @return bool 文の区切りを検出した場合はtrue
+ */
+bool AcceptSamples(VoskRecognizer *recognizer, const short *data,
+                   size_t count) {
+  return vosk_recognizer_accept_waveform(
+             recognizer, reinterpret_cast<const char *>(data),
+             static_cast<int>(count * sizeof(short))) != 0;
+}
 
-    // -d オプション: デバイスインデックスの設定
-    if (!strcmp(argv[i], "-d")) {
-      if (i + 1 >= argc) {
-        outputJsonError("No value specified for option " +
-                        std::string(argv[i]));
-        return 1;
-      }
+// 16ビットPCMと同じ振幅のfloatをそのまま渡す版（量子化を経由しない）
+bool AcceptSamples(VoskRecognizer *recognizer, const float *data,
+                   size_t count) {
+  return vosk_recognizer_accept_waveform_f(recognizer, data,
+                                           static_cast<int>(count)) != 0;
+}
 
-      // 数値変換
-      try {
-        *deviceIndex = std::stoi(argv[i + 1]);
-      } catch (const std::exception &) {
-        outputJsonError("Invalid device index: " + std::string(argv[i + 1]));
-        return 1;
+/**
+ * @brief リングバッファの16kHz PCMを認識器に渡し、結果を出力する関数
+ *
+ * 認識スレッドで実行します。キャプチャスレッドが running を false にした後は
+ * リングに残ったデータを読み切ってから終了します。
+ * 音声区間ゲートを指定した場合は音声区間だけを認識器に渡し、
+ * ゲートが閉じたところで発話を確定させます。
+ * Sample は16ビットPCM（short）か、同じ振幅のfloatです。
+ *
+ * @param recognizer 認識器
+ * @param ring キャプチャスレッドから受け取るPCMのリングバッファ
+ * @param running キャプチャ継続中フラグ
+ * @param partials 部分認識結果の間引き・差分化（nullptrの場合は出力しない）
+ * @param gate 音声区間ゲート（nullptrの場合はすべて認識器に渡す）
+ * @param device 結果に付けるデバイスのインデックス（負の場合は付けない）
+ * @param probe 結果までの遅延の記録先（nullptrの場合は記録しない）
+ * @param control 制御コマンドの受け取り口（nullptrの場合は受け取らない）
+ * @param clock 認識器に渡した位置の記録先（単語の時刻をセッションの時刻に直す）
+ * @param speakers 最終結果の話者を照合する表（nullptrの場合は照合しない）
+ */
+template <typename Sample>
+void RunRecognizer(VoskRecognizer *recognizer, SpscRingBuffer<Sample> *ring,
+                   const std::atomic<bool> *running,
+                   PartialResultEncoder *partials,
+                   BasicVoiceActivityGate<Sample> *gate, int device,
+                   LatencyProbe *probe, SessionControl *control,
+                   SessionClock *clock, SpeakerTable *speakers) {
+  // 1回に読み出す最大サンプル数（100ms分）
+  std::vector<Sample> chunk(1600);
+  // ゲートを通ったサンプル（先読み分を含めても伸長しない大きさを確保）
+  std::vector<Sample> speech;
+  speech.reserve(16000 * 2);
+
+  // 後処理の出力先（容量を保ったまま使い回す）
+  std::string resultStr;
+  std::string partialStr;
+  std::string lineStr;
+  std::string taggedStr;
+  std::string rebasedStr;
+  bool firstPartial = true;  // 最初の部分認識結果の時刻を出力する
+  uint64_t samplesRead = 0;  // リングから読み出したサンプルの累計
+
+  // 部分認識結果の行を出力する
+  auto outputPartial = [&]() {
+    if (probe) probe->recordPartial();
+    OutputResultLine(lineStr, device, &taggedStr);
+  };
+
+  // 確定した認識結果を出力する
+  auto outputResult = [&](const char *result) {
+    CompactResultJson(result, &resultStr);
+    // 単語の時刻をセッションの時刻に直し、この結果より前の対応表を捨てる
+    double endSeconds;
+    if (clock->rebase(resultStr, &rebasedStr, &endSeconds)) {
+      resultStr.swap(rebasedStr);
+      clock->forget(endSeconds);
+    }
+    if (!resultStr.empty() && resultStr != "{\"text\":\"\"}") {
+      if (speakers && resultStr.find("\"text\":\"\"") == std::string::npos)
+        speakers->label(&resultStr);
+      if (probe) probe->recordFinal(resultStr);
+      OutputResultLine(resultStr, device, &taggedStr);
+    }
+
+    // 最終結果が出力されたら部分認識結果をリセット
+    if (partials) partials->reset();
+  };
+
+  // VOSKに渡し、文の区切りなら結果を、そうでなければ部分認識結果を出力する
+  // ringStart は data の先頭のリング位置（セッションの時計に記録する）
+  auto accept = [&](const Sample *data, size_t count, uint64_t ringStart) {
+    clock->feed(ringStart, count);
+    if (AcceptSamples(recognizer, data, count)) {
+      outputResult(vosk_recognizer_result(recognizer));
+    } else if (partials) {
+      const char *partial = vosk_recognizer_partial_result(recognizer);
+      // 部分認識結果を取得
+      CompactResultJson(partial, &partialStr);
+      if (clock->rebase(partialStr, &rebasedStr)) partialStr.swap(rebasedStr);
+
+      // 空または前回と同じ結果は出力せず、間隔内の結果は保留する
+      if (!partialStr.empty() && partials->update(partialStr, &lineStr)) {
+        if (firstPartial) {
+          OutputStartupPhase("first_partial", device);
+          firstPartial = false;
+        }
+        outputPartial();
+      }
+    }
+  };
+
+  // 文法を差し替える（認識器を使うこのスレッドで行う）
+  // 途中の発話は前の文法で確定させ、状態を消してから差し替える
+  auto swapGrammar = [&](const ControlCommand &command) {
+    std::string json;
+    std::string file;
+    if (command.getString("file", &file)) {
+      if (!ReadTextFile(file, &json)) {
+        OutputAck(command, device, "Failed to read grammar: " + file);
+        return;
+      }
+    } else if (!command.getJson("phrases", &json)) {
+      OutputAck(command, device, "\"phrases\" or \"file\" is required");
+      return;
+    }
+    std::string grammar;
+    size_t phrases = 0;
+    if (!ParseGrammar(json, &grammar, &phrases)) {
+      OutputAck(command, device, "Grammar must be a JSON array of strings");
+      return;
+    }
+
+    outputResult(vosk_recognizer_final_result(recognizer));
+    vosk_recognizer_reset(recognizer);
+    auto swapStart = std::chrono::steady_clock::now();
+    vosk_recognizer_set_grm(recognizer,
+                            grammar.empty() ? "[]" : grammar.c_str());
+    const double swapMs = MillisecondsSince(swapStart);
+    control->grammar.swap(grammar);
+
+    JsonWriter writer;
+    command.beginAck(&writer, device);
+    writer.key("ok")
+        .boolean(true)
+        .key("phrases")
+        .integer(static_cast<long long>(phrases))
+        .key("swapMs")
+        .number(swapMs, 2)
+        .endObject();
+    g_output.writeLine(writer);
+  };
+
+  // 制御コマンドを実行して応答する
+  auto applyCommand = [&](const ControlCommand &command) {
+    const std::string name = command.name();
+    if (name == "grammar") {
+      swapGrammar(command);
+      return;
+    }
+
+    if (name == "pause" || name == "resume") {
+      // 一時停止の間は発話が途切れるため、それまでの発話を確定させる
+      const bool pause = name == "pause";
+      control->paused.store(pause, std::memory_order_relaxed);
+      if (pause) outputResult(vosk_recognizer_final_result(recognizer));
+    } else if (name == "finalize") {
+      outputResult(vosk_recognizer_final_result(recognizer));
+    } else if (name == "reset") {
+      // 途中の発話を出力せずに捨てる
+      vosk_recognizer_reset(recognizer);
+      if (partials) partials->reset();
+    } else if (name == "partials") {
+      bool enabled;
+      if (!command.getBool("enabled", &enabled)) {
+        OutputAck(command, device, "\"enabled\" must be true or false");
+        return;
+      }
+      if (partials) partials->reset();
+      partials = enabled ? control->partials : nullptr;
+    } else if (name == "max_alternatives") {
+      int value;
+      if (!command.getInt("value", &value) || value < 0) {
+        OutputAck(command, device, "\"value\" must be 0 or more");
+        return;
+      }
+      vosk_recognizer_set_max_alternatives(recognizer, value);
+      control->maxAlternatives = value;
+    } else if (name == "device") {
+      // 切り替えはキャプチャスレッドが行い、結果もそちらで応答する
+      int index;
+      if (!command.getInt("index", &index) || index < 0) {
+        OutputAck(command, device, "\"index\" must be a device index");
+        return;
+      }
+      if (!control->canSwitchDevice) {
+        OutputAck(command, device, "Input is not an audio device");
+        return;
+      }
+      if (control->switchPending.load(std::memory_order_acquire)) {
+        OutputAck(command, device, "Device switch already in progress");
+        return;
+      }
+      outputResult(vosk_recognizer_final_result(recognizer));
+      control->switchCommand = command;
+      control->switchPending.store(true, std::memory_order_release);
+      return;
+    }
+    OutputAck(command, device);
+  };
+
+  ControlCommand command;
+  for (;;) {
+    // 届いた制御コマンドを音声より先に処理する
+    while (control && control->mailbox.pop(&command)) applyCommand(command);
+
+    // 終了フラグはリングを読む前に確認し、フラグ確認後の書き込みも取りこぼさない
+    bool stopping = !running->load(std::memory_order_acquire);
+    size_t samples = ring->read(chunk.data(), chunk.size());
+    const uint64_t chunkStart = samplesRead;
+    samplesRead += samples;
+    if (probe && samples > 0) probe->consumed(samplesRead);
+    // 間隔指定の書き出しは結果が出ない間も期限どおりに行う
+    if (partials && partials->poll(&lineStr)) outputPartial();
+    g_output.poll();
+    if (samples == 0) {
+      if (stopping) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      continue;
+    }
+
+    if (!gate) {
+      accept(chunk.data(), samples, chunkStart);
+      continue;
+    }
+
+    // 音声区間だけを渡す。無音が続いても認識器は文末を検出できないため、
+    // ゲートが閉じたら最終結果を取り出して発話を確定させる
+    size_t offset = 0;
+    while (offset < samples) {
+      bool closed;
+      speech.clear();
+      offset += gate->process(chunk.data() + offset, samples - offset, &speech,
+                              &closed);
+      if (!speech.empty())
+        accept(speech.data(), speech.size(), gate->outputStart());
+      if (closed) outputResult(vosk_recognizer_final_result(recognizer));
+    }
+  }
+}
+
+/**
+ * @brief モデルを読み込み、読み込み時間を出力する関数
+ *
+ * 先読みを開始している場合は完了を待ってから読み込み、
+ * {"info":"prefetch",...} で先読みの統計を出力します。savedMs は先読みの
+ * うちデバイスの列挙などと重なり、読み込みの前に待たずに済んだ時間です。
+ *
+ * @param modelPath 音声認識モデルのパス
+ * @param prefetcher モデルの先読み（nullptrの場合は先読みしない）
+ * @param loadMs 読み込み時間の格納先（nullptrの場合は格納しない）
+ * @return VoskModel* 読み込んだモデル（失敗時はエラーを出力してnullptr）
+ */
+VoskModel *LoadModel(const char *modelPath, ModelPrefetcher *prefetcher,
+                     double *loadMs = nullptr) {
+  vosk_set_log_level(-1);
+
+  if (prefetcher) {
+    auto waitStart = std::chrono::steady_clock::now();
+    const PrefetchStats &stats = prefetcher->wait();
+    const double waitMs = MillisecondsSince(waitStart);
+    JsonWriter writer;
+    writer.beginObject()
+        .key("info")
+        .string("prefetch")
+        .key("files")
+        .integer(static_cast<long long>(stats.files))
+        .key("bytes")
+        .integer(static_cast<long long>(stats.bytes))
+        .key("durationMs")
+        .number(stats.durationMs, 1)
+        .key("waitMs")
+        .number(waitMs, 1)
+        .key("savedMs")
+        .number((std::max)(stats.durationMs - waitMs, 0.0), 1)
+        .endObject();
+    g_output.writeLine(writer);
+  }
+
+  auto loadStart = std::chrono::steady_clock::now();
+  VoskModel *model = vosk_model_new(modelPath);
+  if (model == nullptr) {
+    outputJsonError("Failed to load model: " + std::string(modelPath));
+    return nullptr;
+  }
+  const double elapsedMs = MillisecondsSince(loadStart);
+  OutputStartupPhase("model_load", -1, elapsedMs);
+  if (loadMs) *loadMs = elapsedMs;
+  return model;
+}
+
+/**
+ * @brief 音声ストリームの認識設定
+ */
+struct StreamSettings {
+  bool isTest = false;               // 10秒間録音してWAVファイルを保存する
+  bool textOnly = false;             // 部分認識結果を出力しない
+  unsigned partialIntervalMs = 0;    // 部分認識結果の最小出力間隔
+  bool partialDelta = false;         // 部分認識結果を差分で出力する
+  const VadSettings *vad = nullptr;  // 音声区間ゲート（nullptrは不使用）
+  int poolMin = 1;                   // 事前に作成しておく認識器の数
+  int poolMax = 4;                   // 待機させておく認識器の上限
+  bool warmup = false;               // 認識の前に合成音声で慣らし運転する
+  ModelPrefetcher *prefetcher = nullptr;  // モデルの先読み（nullptrは不使用）
+  bool floatSamples = false;  // 16ビットに量子化せずfloatで認識器に渡す
+  std::string grammar;        // 文法のJSON（空の場合は文法なし）
+  ControlChannel *control = nullptr;  // 制御チャネル（nullptrは不使用）
+  bool words = false;         // 最終結果に単語ごとの時刻を付ける
+  bool partialWords = false;  // 部分認識結果に単語ごとの時刻を付ける
+  SpeakerModelLoader *speakerModel = nullptr;  // 話者モデル（nullptrは不使用）
+  SpeakerTable *speakers = nullptr;            // 話者の表
+  // 制御コマンドで切り替えるデバイスを開く（入力元がデバイスの場合のみ）
+  std::function<std::unique_ptr<AudioSource>(int index)> openDevice;
+};
+
+/**
+ * @brief 合成音声を認識器に通して慣らし運転する関数
+ *
+ * 最初の発話でモデルのページ読み込みや内部バッファの確保を待たないよう、
+ * 母音に似た倍音と弱い雑音を混ぜた1秒間の音声を認識させてから
+ * vosk_recognizer_reset で状態を消します。
+ *
+ * @param recognizer 16kHzの認識器
+ */
+void WarmUpRecognizer(VoskRecognizer *recognizer) {
+  const int kSamples = 16000;
+  std::vector<short> pcm(kSamples);
+  uint32_t noise = 12345;
+  for (int i = 0; i < kSamples; i++) {
+    const double t = i / 16000.0;
+    double value = 0.0;
+    for (int harmonic = 1; harmonic <= 5; harmonic++)
+      value += sin(2.0 * 3.14159265358979 * 140.0 * harmonic * t) / harmonic;
+    noise = noise * 1664525u + 1013904223u;
+    value = value * 3000.0 + static_cast<int>(noise >> 20) - 2048;
+    pcm[i] = static_cast<short>(value);
+  }
+
+  // 実際のキャプチャと同じ100ms単位で渡す
+  for (int offset = 0; offset < kSamples; offset += 1600) {
+    vosk_recognizer_accept_waveform(
+        recognizer, reinterpret_cast<const char *>(pcm.data() + offset),
+        static_cast<int>(1600 * sizeof(short)));
+    vosk_recognizer_partial_result(recognizer);
+  }
+  vosk_recognizer_final_result(recognizer);
+  vosk_recognizer_reset(recognizer);
+}
+
+/**
+ * @brief プール内の認識器を count 個借りて慣らし運転し、返却する関数
+ *
+ * @param pool 認識器のプール
+ * @param model 音声認識モデル
+ * @param count 慣らし運転する認識器の数
+ * @param grammar 文法のJSON（空の場合は文法なし）
+ * @return double かかった時間（ミリ秒）
+ */
+double WarmUpPool(RecognizerPool *pool, VoskModel *model, size_t count,
+                  const std::string &grammar) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<VoskRecognizer *> recognizers;
+  for (size_t i = 0; i < count; i++) {
+    VoskRecognizer *recognizer = pool->acquire(model, 16000.0f, grammar);
+    if (recognizer == nullptr) break;
+    WarmUpRecognizer(recognizer);
+    pool->addSamplesFed(recognizer, 16000);
+    recognizers.push_back(recognizer);
+  }
+  for (VoskRecognizer *recognizer : recognizers) pool->release(recognizer);
+  return MillisecondsSince(start);
+}
+
+/**
+ * @brief RunAudioSession の本体（Sample は変換後のサンプルの型）
+ *
+ * short では変換時に16ビットへ量子化・クリッピングし、float では
+ * 16ビットPCMと同じ振幅のまま vosk_recognizer_accept_waveform_f に渡します。
+ */
+template <typename Sample>
+void CaptureAndRecognize(AudioSource &source, VoskModel *model,
+                         RecognizerPool *pool, const StreamSettings &settings,
+                         int device, LatencyProbe *probe) {
+  // 認識器を借りる（16kHzサンプルレート用。スコープを抜けるときに返却）
+  VoskRecognizer *recognizer =
+      pool->acquire(model, 16000.0f, settings.grammar);
+  if (recognizer == nullptr) {
+    outputJsonError("Failed to create recognizer", device);
+    return;
+  }
+  PooledRecognizer lease(pool, recognizer);
+
+  // VOSKの時刻は作成からの通算のため、これまでに渡したサンプル数を原点にする
+  SessionClock clock(pool->samplesFed(recognizer));
+
+  auto openStart = std::chrono::steady_clock::now();
+  if (!source.open()) {
+    outputJsonError(source.lastError(), device);
+    return;
+  }
+  OutputStartupPhase("device_open", device, MillisecondsSince(openStart));
+  AudioFormat format = source.format();
+
+  // 入力形式に合った変換器をここで一度だけ選ぶ
+  std::unique_ptr<AudioConverter> converter = CreateMono16kConverter(
+      format.sampleFormat, format.channels, format.sampleRate);
+  if (!converter) {
+    outputJsonError("Unsupported input format", device);
+    return;
+  }
+
+  // 単語の時刻はプールの設定に残らないよう、返却の前に戻す
+  // （ここから最終結果の出力までは途中で戻らないため、開いた後に設定する）
+  const bool wordTimes = settings.words || settings.partialWords;
+  if (wordTimes) {
+    vosk_recognizer_set_words(recognizer, settings.words ? 1 : 0);
+    vosk_recognizer_set_partial_words(recognizer,
+                                      settings.partialWords ? 1 : 0);
+  }
+
+  // 変換用バッファの事前確保（1パケットの最大フレーム数を変換できる大きさ）
+  std::vector<Sample> convertedData(
+      converter->maxOutputSize(source.maxPacketFrames()));
+
+  DWORD startTime = GetTickCount();
+  DWORD endTime = startTime + (10 * 1000);
+  std::vector<Sample> convertedBuffer;
+  if (settings.isTest) convertedBuffer.reserve(16000 * 11);  // 10秒分 + 余裕
+
+  // 最初の数パケットはバッファの伸長があり得るため、割り当て計測から除外する
+  const int kWarmupPackets = 10;
+  int packetCount = 0;
+  size_t steadyAllocations = 0;
+  bool firstPacketSeen = false;
+
+  // キャプチャと認識を分離するリングバッファ（約4秒分）と認識スレッド
+  SpscRingBuffer<Sample> ring(16000 * 4);
+  std::atomic<bool> running(true);
+  PartialResultEncoder partials(settings.partialIntervalMs,
+                                settings.partialDelta);
+  std::unique_ptr<BasicVoiceActivityGate<Sample>> gate;
+  if (settings.vad)
+    gate.reset(new BasicVoiceActivityGate<Sample>(*settings.vad));
+  SessionControl control;
+  control.grammar = settings.grammar;
+  control.partials = &partials;
+  control.canSwitchDevice = static_cast<bool>(settings.openDevice);
+  if (settings.control) settings.control->subscribe(device, &control.mailbox);
+  std::thread recognizerThread(RunRecognizer<Sample>, recognizer, &ring,
+                               &running,
+                               settings.textOnly ? nullptr : &partials,
+                               gate.get(), device, probe,
+                               settings.control ? &control : nullptr, &clock,
+                               settings.speakers);
+  uint64_t samplesWritten = 0;  // リングに書き込んだサンプルの累計
+
+  // セッションの時計（16kHzのサンプル数）はデバイスの位置で進め、
+  // 捨てたパケットや欠落の後の最初の書き込みで clock.mark() に記録する
+  uint64_t clockBase = 0;     // 現在の入力元の最初のパケットのセッション位置
+  uint64_t deviceStart = 0;   // 現在の入力元の最初のパケットの位置
+  uint64_t nextPosition = 0;  // 次のパケットの位置の予想
+  bool clockStarted = false;  // 現在の入力元のパケットを受け取ったか
+  bool skipped = false;       // 最後の書き込みの後に音声を飛ばしたか
+
+  // 制御コマンドでデバイスを切り替えた後は切り替え先から読む
+  AudioSource *current = &source;
+  std::unique_ptr<AudioSource> switched;
+
+  // 新しいデバイスを開いてから古いデバイスを止め、途切れる時間を短くする
+  auto switchDevice = [&](const ControlCommand &command) {
+    int index = -1;
+    command.getInt("index", &index);
+    std::unique_ptr<AudioSource> next = settings.openDevice(index);
+    auto switchStart = std::chrono::steady_clock::now();
+    if (!next->open()) {
+      OutputAck(command, device, next->lastError());
+      return;
+    }
+    AudioFormat nextFormat = next->format();
+    std::unique_ptr<AudioConverter> nextConverter = CreateMono16kConverter(
+        nextFormat.sampleFormat, nextFormat.channels, nextFormat.sampleRate);
+    if (!nextConverter) {
+      next->stop();
+      OutputAck(command, device, "Unsupported input format");
+      return;
+    }
+    current->stop();
+    switched = std::move(next);
+    current = switched.get();
+    converter = std::move(nextConverter);
+    convertedData.resize(converter->maxOutputSize(current->maxPacketFrames()));
+
+    // 時計は切り替えにかかった時間も進め、新しい入力元の位置から数え直す
+    if (clockStarted)
+      clockBase += (nextPosition - deviceStart) * 16000 / format.sampleRate;
+    clockBase += static_cast<uint64_t>(MillisecondsSince(switchStart) * 16.0);
+    clockStarted = false;
+    skipped = true;
+    format = nextFormat;
+
+    JsonWriter ack;
+    command.beginAck(&ack, device);
+    ack.key("ok")
+        .boolean(true)
+        .key("index")
+        .integer(index)
+        .key("openMs")
+        .number(MillisecondsSince(switchStart), 1)
+        .endObject();
+    g_output.writeLine(ack);
+  };
+
+  JsonWriter writer;
+  writer.beginObject().key("info").string("start");
+  if (device >= 0) writer.key("device").integer(device);
+  writer.endObject();
+  g_output.writeLine(writer);
+
+  while (!settings.isTest || GetTickCount() < endTime) {
+    if (control.switchPending.load(std::memory_order_acquire)) {
+      switchDevice(control.switchCommand);
+      control.switchPending.store(false, std::memory_order_release);
+    }
+    // 一時停止中は実時間の入力を読み捨て、それ以外の入力は読むのを待つ
+    const bool paused = control.paused.load(std::memory_order_relaxed);
+    if (paused && !current->isRealtime()) {
+      Sleep(10);
+      continue;
+    }
+
+    AudioPacket packet;
+    AudioReadStatus status = current->acquire(&packet);
+    if (status == AudioReadStatus::Empty) {
+      Sleep(10);  // パケットがない場合は少し待つ
+      continue;
+    }
+    if (status == AudioReadStatus::End) break;
+    if (status == AudioReadStatus::Error) {
+      outputJsonError(current->lastError(), device);
+      break;
+    }
+    if (!firstPacketSeen) {
+      OutputStartupPhase("first_packet", device);
+      firstPacketSeen = true;
+
+      // セッション位置0の時刻（WASAPIでは録音したQPC時刻、それ以外は現在）
+      const double epochMs = QpcToEpochMs(packet.qpcPosition);
+      clock.setAnchor(epochMs);
+      if (wordTimes) {
+        writer.clear();
+        writer.beginObject().key("info").string("clock");
+        if (device >= 0) writer.key("device").integer(device);
+        writer.key("qpcPosition")
+            .integer(static_cast<long long>(packet.qpcPosition))
+            .key("epochMs")
+            .number(epochMs, 3)
+            .endObject();
+        g_output.writeLine(writer);
+      }
+    }
+
+    // パケットのセッション位置（捨てるパケットも数える）
+    if (!clockStarted) {
+      deviceStart = nextPosition = packet.position;
+      clockStarted = true;
+    }
+    if (packet.position != nextPosition) skipped = true;  // デバイスの欠落
+    nextPosition = packet.position + packet.frames;
+    const uint64_t sessionPosition =
+        clockBase + (packet.position - deviceStart) * 16000 / format.sampleRate;
+
+    size_t allocationsBefore = GetAllocationCount();
+
+    // サイレンスでない場合のみ処理
+    if (!packet.silent && !paused) {
+      // 想定外に大きなパケットの場合のみバッファを広げる
+      if (convertedData.size() < converter->maxOutputSize(packet.frames))
+        convertedData.resize(converter->maxOutputSize(packet.frames));
+
+      // このパケットのデータを16kHzモノラルに変換
+      auto convertStart = std::chrono::steady_clock::now();
+      size_t convertedSamples = ConvertBufferToMono16k(
+          *converter, packet.data, static_cast<UINT32>(packet.frames),
+          convertedData.data(), convertedData.size());
+      if (probe)
+        probe->recordConversion(std::chrono::steady_clock::now() -
+                                convertStart);
+
+      if (settings.isTest)
+        convertedBuffer.insert(convertedBuffer.end(), convertedData.begin(),
+                               convertedData.begin() + convertedSamples);
+
+      // 実時間でない入力は、認識スレッドが追いつくまで書き込みを待つ
+      if (!current->isRealtime()) {
+        while (ring.capacity() - ring.size() < convertedSamples)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+
+      // 認識スレッドへ渡す（満杯の場合は捨ててオーバーランとして数える）
+      if (convertedSamples > 0) {
+        if (skipped) clock.mark(samplesWritten, sessionPosition);
+        const size_t written =
+            ring.write(convertedData.data(), convertedSamples);
+        samplesWritten += written;
+        skipped = written < convertedSamples;
+        if (probe) probe->markArrival(samplesWritten);
+      }
+
+      // 変換からリングへの書き込みまでを割り当て計測の対象とする
+      if (++packetCount > kWarmupPackets)
+        steadyAllocations += GetAllocationCount() - allocationsBefore;
+    } else {
+      skipped = true;
+    }
+    if (!current->release(packet)) {
+      outputJsonError(current->lastError(), device);
+      break;
+    }
+  }
+
+  current->stop();
+
+  // 認識スレッドに残りを処理させてから終了を待つ
+  running.store(false, std::memory_order_release);
+  recognizerThread.join();
+  pool->addSamplesFed(recognizer, clock.fedSamples());
+  if (settings.control) {
+    settings.control->unsubscribe(&control.mailbox);
+    // 文法を差し替えた認識器は新しい文法のキーで、候補数は戻して返却する
+    pool->rebind(recognizer, control.grammar);
+    if (control.maxAlternatives != 0)
+      vosk_recognizer_set_max_alternatives(recognizer, 0);
+  }
+
+  // 最終結果を取得
+  const char *finalResult = vosk_recognizer_final_result(recognizer);
+  std::string finalResultStr = RemoveSpaces(finalResult);
+  std::string rebasedStr;
+  if (clock.rebase(finalResultStr, &rebasedStr))
+    finalResultStr.swap(rebasedStr);
+  if (settings.speakers &&
+      finalResultStr.find("\"text\":\"\"") == std::string::npos)
+    settings.speakers->label(&finalResultStr);
+  std::string taggedStr;
+  if (probe && finalResultStr != "{\"text\":\"\"}")
+    probe->recordFinal(finalResultStr);
+  OutputResultLine(finalResultStr, device, &taggedStr);
+  if (wordTimes) {
+    vosk_recognizer_set_words(recognizer, 0);
+    vosk_recognizer_set_partial_words(recognizer, 0);
+  }
+
+  if (settings.isTest) {
+    // 複数デバイスの場合はデバイスごとのファイルに保存する
+    std::string wavName = "recorded_converted.wav";
+    if (device >= 0)
+      wavName = "recorded_converted_" + std::to_string(device) + ".wav";
+    SaveAsWav(convertedBuffer, wavName.c_str(), 16000, 1);
+  }
+
+  // リングバッファの統計（取りこぼしの有無と最大滞留量）
+  writer.clear();
+  writer.beginObject().key("info").string("ring");
+  if (device >= 0) writer.key("device").integer(device);
+  writer.key("overruns")
+      .integer(static_cast<long long>(ring.overrunCount()))
+      .key("droppedSamples")
+      .integer(static_cast<long long>(ring.droppedCount()))
+      .key("highWaterMark")
+      .integer(static_cast<long long>(ring.highWaterMark()))
+      .key("capacity")
+      .integer(static_cast<long long>(ring.capacity()))
+      .endObject();
+  g_output.writeLine(writer);
+
+  // 音声区間ゲートで捨てた音声の割合
+  if (gate) {
+    const double total = static_cast<double>(gate->totalSamples());
+    writer.clear();
+    writer.beginObject().key("info").string("vad");
+    if (device >= 0) writer.key("device").integer(device);
+    writer.key("passedSeconds")
+        .number(gate->passedSamples() / 16000.0)
+        .key("gatedSeconds")
+        .number(gate->gatedSamples() / 16000.0)
+        .key("gatedRatio")
+        .number(total > 0.0 ? gate->gatedSamples() / total : 0.0, 3)
+        .endObject();
+    g_output.writeLine(writer);
+  }
+
+#ifdef _DEBUG
+  // 定常状態のキャプチャ経路でヒープ割り当てが発生していないことを確認
+  // （プロセス全体の回数のため、複数デバイスでは他のスレッドの分も含む）
+  writer.clear();
+  writer.beginObject().key("info").string("capture allocations");
+  if (device >= 0) writer.key("device").integer(device);
+  writer.key("packets")
+      .integer(packetCount)
+      .key("allocations")
+      .integer(static_cast<long long>(steadyAllocations))
+      .endObject();
+  g_output.writeLine(writer);
+#endif
+  // 認識器は自動的にプールへ返却される（PooledRecognizerのデストラクタで）
+}
+
+/**
+ * @brief 1つの入力元から録音し、共有モデルの認識器で認識する関数
+ *
+ * 呼び出したスレッドでキャプチャを行い、認識は専用のスレッドで行います。
+ * 認識器は入力元ごとにプールから借り、モデルは呼び出し側で共有します。
+ *
+ * @param source 音声の入力元（WASAPIデバイス、標準入力など）
+ * @param model 共有する音声認識モデル
+ * @param pool 認識器のプール
+ * @param settings 認識設定（floatSamples で変換後のサンプルの型を選ぶ）
+ * @param device 出力に付けるデバイスのインデックス（負の場合は付けない）
+ * @param probe 音声の到着から結果までの遅延の記録先（ベンチマーク用）
+ */
+void RunAudioSession(AudioSource &source, VoskModel *model,
+                     RecognizerPool *pool, const StreamSettings &settings,
+                     int device, LatencyProbe *probe = nullptr) {
+  if (settings.floatSamples)
+    CaptureAndRecognize<float>(source, model, pool, settings, device, probe);
+  else
+    CaptureAndRecognize<short>(source, model, pool, settings, device, probe);
+}
+
+/**
+ * @brief 認識器プールの統計をJSON行で出力する関数
+ *
+ * @param pool 認識器のプール
+ */
+void OutputPoolStats(const RecognizerPool &pool) {
+  RecognizerPoolStats stats = pool.stats();
+  JsonWriter writer;
+  writer.beginObject()
+      .key("info")
+      .string("pool")
+      .key("acquired")
+      .integer(static_cast<long long>(stats.acquired))
+      .key("hits")
+      .integer(static_cast<long long>(stats.hits))
+      .key("misses")
+      .integer(static_cast<long long>(stats.misses))
+      .key("hitRate")
+      .number(stats.hitRate(), 3)
+      .key("created")
+      .integer(static_cast<long long>(stats.created))
+      .key("destroyed")
+      .integer(static_cast<long long>(stats.destroyed))
+      .key("idle")
+      .integer(static_cast<long long>(stats.idle))
+      .key("inUse")
+      .integer(static_cast<long long>(stats.inUse))
+      .endObject();
+  g_output.writeLine(writer);
+}
+
+/**
+ * @brief 入力元からのオーディオストリームを開始し音声認識を実行する関数
+ *
+ * モデルは一度だけ読み込み、すべての入力元で共有します。
+ * 入力元が複数の場合は入力元ごとにキャプチャスレッドと認識器を用意し、
+ * 出力に "device" を付けます。メモリ使用量はモデルの数ではなく
+ * 認識器の数に比例します。
+ *
+ * @param sources 音声の入力元
+ * @param devices 入力元ごとのデバイスのインデックス（出力に付ける値）
+ * @param modelPath 音声認識モデルのパス
+ * @param settings 認識設定
+ */
+void StartAudioStreams(const std::vector<AudioSource *> &sources,
+                       const std::vector<int> &devices, const char *modelPath,
+                       const StreamSettings &settings) {
+  ResourceGuard resources;  // スコープを抜ける際に自動的にリソースを解放
+
+  // VOSKモデルのロード（先読みしている場合は完了を待ってから）
+  VoskModel *model = LoadModel(modelPath, settings.prefetcher);
+  if (model == nullptr) return;
+  resources.setModel(model);
+
+  // 話者モデルはモデルと並行して読み込んでいるため、ここで完了を待つ
+  if (settings.speakerModel) {
+    if (settings.speakerModel->wait() == nullptr) {
+      outputJsonError("Failed to load speaker model: " +
+                      settings.speakerModel->modelPath());
+      return;
+    }
+    OutputStartupPhase("speaker_model_load", -1,
+                       settings.speakerModel->loadMs());
+  }
+
+  // 入力元の数だけ認識器を先に作っておき、キャプチャ開始を待たせない
+  // （プールはモデルより先に破棄される）
+  RecognizerPool pool(static_cast<size_t>(settings.poolMin),
+                      static_cast<size_t>(settings.poolMax));
+  if (settings.speakerModel)
+    pool.setSpeakerModel(settings.speakerModel->model());
+  const size_t prewarmCount =
+      (std::max)(static_cast<size_t>(settings.poolMin), sources.size());
+  auto phaseStart = std::chrono::steady_clock::now();
+  pool.prewarm(model, 16000.0f, settings.grammar, prewarmCount);
+  OutputStartupPhase("recognizer_create", -1, MillisecondsSince(phaseStart));
+  if (settings.warmup)
+    OutputStartupPhase(
+        "warmup", -1,
+        WarmUpPool(&pool, model, sources.size(), settings.grammar));
+
+  if (sources.size() == 1) {
+    RunAudioSession(*sources[0], model, &pool, settings, -1);
+  } else {
+    std::vector<std::thread> sessions;
+    for (size_t i = 0; i < sources.size(); i++) {
+      sessions.emplace_back(RunAudioSession, std::ref(*sources[i]), model,
+                            &pool, std::cref(settings), devices[i], nullptr);
+    }
+    for (auto &session : sessions) session.join();
+  }
+  OutputPoolStats(pool);
+  // リソースは自動的に解放される（ResourceGuardのデストラクタで）
+}
+
+/**
+ * @brief 常駐サーバーモードを実行する関数
+ *
+ * モデルを一度だけ読み込み、127.0.0.1 で認識セッションを受け付けます。
+ * 待ち受けを開始したら {"info":"server","port":n,"maxSessions":m} を出力し、
+ * セッションが閉じるたびに認識器プールの統計を出力します。
+ *
+ * @param modelPath 音声認識モデルのパス
+ * @param settings サーバーの設定
+ * @param poolMin 事前に作成しておく認識器の数
+ * @param poolMax 待機させておく認識器の上限
+ * @param warmup 事前に作成した認識器を合成音声で慣らし運転する
+ * @param prefetcher モデルの先読み（nullptrの場合は先読みしない）
+ */
+void RunServer(const char *modelPath, const ServerSettings &settings,
+               int poolMin, int poolMax, bool warmup,
+               ModelPrefetcher *prefetcher) {
+  ResourceGuard resources;  // スコープを抜ける際に自動的にリソースを解放
+
+  VoskModel *model = LoadModel(modelPath, prefetcher);
+  if (model == nullptr) return;
+  resources.setModel(model);
+
+  // 既定のレート（16kHz）の認識器を先に作っておく
+  RecognizerPool pool(static_cast<size_t>(poolMin),
+                      static_cast<size_t>(poolMax));
+  auto phaseStart = std::chrono::steady_clock::now();
+  pool.prewarm(model, 16000.0f, settings.grammar);
+  OutputStartupPhase("recognizer_create", -1, MillisecondsSince(phaseStart));
+  if (warmup)
+    OutputStartupPhase("warmup", -1,
+                       WarmUpPool(&pool, model, static_cast<size_t>(poolMin),
+                                  settings.grammar));
+
+  RecognitionServer server(model, &pool, settings);
+  server.setSessionClosedHandler([&pool]() { OutputPoolStats(pool); });
+  if (!server.listen()) {
+    outputJsonError(server.lastError());
+    return;
+  }
+
+  JsonWriter writer;
+  writer.beginObject()
+      .key("info")
+      .string("server")
+      .key("port")
+      .integer(server.port())
+      .key("maxSessions")
+      .integer(settings.maxSessions)
+      .endObject();
+  g_output.writeLine(writer);
+
+  server.run();
+}
+
+/**
+ * @brief 音声を開かずにモデルを読み込み、起動にかかる時間を計測する関数
+ *
+ * モデルの読み込み、認識器の作成、慣らし運転をそれぞれ計測し、
+ * {"info":"preload","ok":true,...} を出力します。
+ * モデルが壊れていないかをデバイスに触れずに確認できます。
+ *
+ * @param modelPath 音声認識モデルのパス
+ * @param prefetcher モデルの先読み（nullptrの場合は先読みしない）
+ * @return int 成功時は0、失敗時は1
+ */
+int RunPreloadCheck(const char *modelPath, ModelPrefetcher *prefetcher) {
+  ResourceGuard resources;  // スコープを抜ける際に自動的にリソースを解放
+
+  double loadMs = 0.0;
+  VoskModel *model = LoadModel(modelPath, prefetcher, &loadMs);
+  if (model == nullptr) return 1;
+  resources.setModel(model);
+
+  auto phaseStart = std::chrono::steady_clock::now();
+  VoskRecognizer *recognizer = vosk_recognizer_new(model, 16000.0f);
+  if (recognizer == nullptr) {
+    outputJsonError("Failed to create recognizer");
+    return 1;
+  }
+  resources.setRecognizer(recognizer);
+  const double recognizerMs = MillisecondsSince(phaseStart);
+  OutputStartupPhase("recognizer_create", -1, recognizerMs);
+
+  phaseStart = std::chrono::steady_clock::now();
+  WarmUpRecognizer(recognizer);
+  const double warmupMs = MillisecondsSince(phaseStart);
+  OutputStartupPhase("warmup", -1, warmupMs);
+
+  JsonWriter writer;
+  writer.beginObject()
+      .key("info")
+      .string("preload")
+      .key("ok")
+      .boolean(true)
+      .key("model")
+      .string(modelPath)
+      .key("loadMs")
+      .number(loadMs, 1)
+      .key("recognizerMs")
+      .number(recognizerMs, 1)
+      .key("warmupMs")
+      .number(warmupMs, 1)
+      .key("totalMs")
+      .number(MillisecondsSince(g_processStart), 1)
+      .endObject();
+  g_output.writeLine(writer);
+  // リソースは自動的に解放される（ResourceGuardのデストラクタで）
+  return 0;
+}
+
+/**
+ * @brief ディレクトリ内のWAVファイルを列挙する関数
+ *
+ * @param directory 検索するディレクトリ
+ * @return std::vector<std::string> WAVファイルのパス（名前順）
+ */
+std::vector<std::string> EnumerateWavFiles(const std::string &directory) {
+  std::vector<std::string> files;
+  std::string base = directory;
+  if (!base.empty() && base.back() != '\\' && base.back() != '/') base += '\\';
+
+  WIN32_FIND_DATAA findData;
+  HANDLE find = FindFirstFileA((base + "*.wav").c_str(), &findData);
+  if (find == INVALID_HANDLE_VALUE) return files;
+  do {
+    if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+      files.push_back(base + findData.cFileName);
+  } while (FindNextFileA(find, &findData));
+  FindClose(find);
+
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+/**
+ * @brief ファイル名を付けた認識結果の1行を作る関数
+ *
+ * VOSKの結果JSONの先頭に "file" フィールドを追加します。
+ *
+ * @param path 入力ファイルのパス
+ * @param result VOSKの認識結果JSON
+ * @param offsetSeconds 単語の時刻に加算する秒数（ChunkTimeShift() の値）
+ * @return std::string 出力する行（空の認識結果の場合は空文字列）
+ */
+std::string FormatFileResult(const std::string &path, const char *result,
+                             double offsetSeconds = 0.0) {
+  std::string resultStr = RemoveSpaces(result);
+  if (resultStr.size() < 2 || resultStr[0] != '{') return "";
+  // 空の認識結果は出力しない
+  if (resultStr.find("\"text\":\"\"") != std::string::npos) return "";
+  if (offsetSeconds != 0.0)
+    resultStr = ShiftTimestamps(resultStr, offsetSeconds);
+
+  std::string line = "{\"file\":\"";
+  AppendJsonEscaped(path.data(), path.size(), &line);
+  line += '"';
+  if (resultStr[1] != '}') line += ",";
+  line += resultStr.substr(1);
+  return line;
+}
+
+/**
+ * @brief ファイル名を付けて認識結果を出力する関数
+ *
+ * @param path 入力ファイルのパス
+ * @param result VOSKの認識結果JSON
+ */
+void OutputFileResult(const std::string &path, const char *result) {
+  std::string line = FormatFileResult(path, result);
+  if (line.empty()) return;
+  g_output.writeLine(line, false);
+}
+
+/**
+ * @brief ファイルの認識が終わったことを出力する関数
+ *
+ * @param path 入力ファイルのパス
+ */
+void OutputFileDone(const std::string &path) {
+  JsonWriter writer;
+  writer.beginObject()
+      .key("info")
+      .string("done")
+      .key("file")
+      .string(path)
+      .endObject();
+  g_output.writeLine(writer, false);
+}
+
+/**
+ * @brief 入力ファイル1本分の読み出し状態
+ */
+struct FileStream {
+  std::string path;                          // 入力ファイルのパス
+  MappedWavReader reader;                    // WAVファイルの読み出し
+  std::unique_ptr<AudioConverter> converter;  // 16kHzモノラルへの変換器
+  VoskBatchRecognizer *recognizer = nullptr;  // バッチ認識器
+  bool finished = false;                      // 全データを渡し終えたか
+  uint64_t framesLeft = UINT64_MAX;           // 読み出す残りフレーム数
+
+  ~FileStream() {
+    if (recognizer) vosk_batch_recognizer_free(recognizer);
+  }
+
+  /**
+   * @brief ファイルを開き、形式に合った変換器を作成する
+   *
+   * @param filePath 入力ファイルのパス
+   * @return bool 成功時はtrue（失敗時はエラーを出力済み）
+   */
+  bool open(const std::string &filePath) {
+    path = filePath;
+    if (!reader.open(path.c_str())) {
+      outputJsonError("Failed to open WAV file: " + path);
+      return false;
+    }
+    converter = CreateMono16kConverter(reader.sampleFormat(),
+                                       reader.numChannels(), reader.rate());
+    if (!converter) {
+      outputJsonError("Unsupported WAV format: " + path);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief 次のブロックを16kHzモノラルの16ビットPCMとして取得する
+   *
+   * ファイルが16kHzモノラル16ビットの場合はマップした領域をそのまま返し、
+   * それ以外の形式は変換器で pcm に変換して返します。
+   *
+   * @param pcm 変換が必要な場合の格納先
+   * @param samples 取得したサンプル列の先頭の格納先
+   * @return size_t サンプル数（ファイル終端では0）
+   */
+  size_t readBlock(std::vector<short> &pcm, const short **samples) {
+    // 1回に読むのは0.2秒分
+    size_t frames = static_cast<size_t>(reader.rate() / 5);
+    if (framesLeft < frames) frames = static_cast<size_t>(framesLeft);
+    size_t read;
+    const uint8_t *data = reader.next(frames, &read);
+    if (data == nullptr || read == 0) return 0;
+    framesLeft -= read;
+
+    // 変換不要ならコピーせずに渡す（dataチャンクが奇数位置の場合を除く）
+    if (reader.isMono16k() &&
+        reinterpret_cast<uintptr_t>(data) % alignof(short) == 0) {
+      *samples = reinterpret_cast<const short *>(data);
+      return read;
+    }
+
+    if (pcm.size() < converter->maxOutputSize(read))
+      pcm.resize(converter->maxOutputSize(read));
+    *samples = pcm.data();
+    return converter->convert(data, read, pcm.data());
+  }
+};
+
+/**
+ * @brief VoskBatchModelで複数ファイルをまとめて認識する関数
+ *
+ * 最大 maxStreams 本のファイルを同時に認識器へ流し込み、
+ * vosk_batch_model_wait() ごとに各認識器の結果を取り出して出力します。
+ * 終わったファイルの枠には次のファイルを補充します。
+ *
+ * @param model バッチモデル
+ * @param files 入力ファイルの一覧
+ * @param maxStreams 同時に処理するファイル数
+ * @return double 処理した音声の長さ（秒）
+ */
+double TranscribeFilesBatch(VoskBatchModel *model,
+                            const std::vector<std::string> &files,
+                            size_t maxStreams) {
+  std::vector<std::unique_ptr<FileStream>> active;
+  std::vector<short> pcm;
+  size_t nextFile = 0;
+  double totalSamples = 0.0;
+
+  while (nextFile < files.size() || !active.empty()) {
+    // 空いた枠に次のファイルを補充
+    while (active.size() < maxStreams && nextFile < files.size()) {
+      std::unique_ptr<FileStream> stream(new FileStream());
+      if (!stream->open(files[nextFile++])) continue;
+      stream->recognizer = vosk_batch_recognizer_new(model, 16000.0f);
+      if (stream->recognizer == nullptr) {
+        outputJsonError("Failed to create batch recognizer: " + stream->path);
+        continue;
+      }
+      active.push_back(std::move(stream));
+    }
+
+    // 各ファイルから1ブロックずつ流し込む
+    for (auto &stream : active) {
+      if (stream->finished) continue;
+      const short *data;
+      size_t samples = stream->readBlock(pcm, &data);
+      if (samples == 0) {
+        vosk_batch_recognizer_finish_stream(stream->recognizer);
+        stream->finished = true;
+        continue;
+      }
+      vosk_batch_recognizer_accept_waveform(
+          stream->recognizer, reinterpret_cast<const char *>(data),
+          static_cast<int>(samples * sizeof(short)));
+      totalSamples += static_cast<double>(samples);
+    }
+
+    vosk_batch_model_wait(model);
+
+    // 結果を取り出し、処理し終えたファイルを外す
+    for (size_t i = 0; i < active.size();) {
+      FileStream &stream = *active[i];
+      // 残りチャンク数は結果を取り出す前に見る（取り出し中に増えた結果も拾う）
+      bool done = stream.finished &&
+                  vosk_batch_recognizer_get_pending_chunks(
+                      stream.recognizer) == 0;
+
+      const char *result;
+      while ((result = vosk_batch_recognizer_front_result(
+                  stream.recognizer)) != nullptr &&
+             result[0] != '\0') {
+        OutputFileResult(stream.path, result);
+        vosk_batch_recognizer_pop(stream.recognizer);
+      }
+
+      if (done) {
+        OutputFileDone(stream.path);
+        active.erase(active.begin() + i);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  return totalSamples / 16000.0;
+}
+
+/**
+ * @brief 認識の単位（ファイル全体、または長いファイルの一部分）
+ */
+struct TranscribeJob {
+  size_t file = 0;                  // files内の番号
+  size_t chunk = 0;                 // ファイル内のチャンク番号
+  uint64_t startFrame = 0;          // 開始フレーム（入力レート基準）
+  uint64_t endFrame = UINT64_MAX;   // 終了フレーム（含まない）
+  double offsetSeconds = 0.0;       // ファイル先頭からの開始時刻
+};
+
+/**
+ * @brief チャンクごとの認識結果をファイル内の順序どおりに出力するクラス
+ *
+ * 並列に認識したチャンクの結果を、前のチャンクがすべて出力されるまで保留します。
+ * 先頭のチャンク（それより前がすべて出力済み）の結果はその場で出力するため、
+ * 分割しないファイルでは結果がすぐに流れます。
+ */
+class ResultMerger {
+ public:
+  ResultMerger(const std::vector<std::string> &files,
+               const std::vector<size_t> &chunkCounts)
+      : files(files), states(files.size()) {
+    for (size_t i = 0; i < files.size(); i++) {
+      states[i].pending.resize(chunkCounts[i]);
+      states[i].done.resize(chunkCounts[i], false);
+    }
+  }
+
+  // チャンクの認識結果を1行追加する
+  void add(const TranscribeJob &job, const std::string &line) {
+    std::lock_guard<std::mutex> lock(mutex);
+    FileState &state = states[job.file];
+    if (job.chunk == state.nextChunk) {
+      g_output.writeLine(line, false);
+    } else {
+      state.pending[job.chunk].push_back(line);
+    }
+  }
+
+  // チャンクの認識が終わったことを通知する
+  void finish(const TranscribeJob &job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    FileState &state = states[job.file];
+    state.done[job.chunk] = true;
+
+    // 終わっているチャンクを順に出力し、先頭を進める
+    const size_t count = state.done.size();
+    while (state.nextChunk < count && state.done[state.nextChunk])
+      flush(state, state.nextChunk++);
+    if (state.nextChunk < count) {
+      // 認識中の新しい先頭チャンクがためていた分も出しておく
+      flush(state, state.nextChunk);
+    } else {
+      OutputFileDone(files[job.file]);
+    }
+  }
+
+ private:
+  struct FileState {
+    size_t nextChunk = 0;                          // 次に出力するチャンク
+    std::vector<std::vector<std::string>> pending;  // 保留中の結果
+    std::vector<bool> done;                         // 認識済みのチャンク
+  };
+
+  static void flush(FileState &state, size_t chunk) {
+    for (const std::string &line : state.pending[chunk])
+      g_output.writeLine(line, false);
+    state.pending[chunk].clear();
+  }
+
+  const std::vector<std::string> &files;
+  std::vector<FileState> states;
+  std::mutex mutex;
+};
+
+/**
+ * @brief 長いファイルを無音付近で分割したチャンクの一覧を作る関数
+ *
+ * PlanSilenceSplits() で目標の長さ付近の最も静かな位置を分割点にします。
+ * エネルギーは分割点を探す範囲だけをマップしたファイルから読み、
+ * 入力レートのままモノラル化して10msごとに求めるため、
+ * 変換やリサンプリングはせず、読むのもファイルの3分の1ほどです。
+ * 目標の長さはワーカー1つあたり数チャンクになるよう決め、
+ * 短いファイルや長さが不明なファイルは分割しません。
+ *
+ * @param path 入力ファイルのパス
+ * @param file files内の番号
+ * @param numWorkers ワーカースレッド数
+ * @return std::vector<TranscribeJob> チャンクの一覧（開けない場合は空）
+ */
+std::vector<TranscribeJob> PlanFileChunks(const std::string &path, size_t file,
+                                          size_t numWorkers) {
+  // 静かさを比べる区間（300ms、10ms単位）
+  const size_t kQuietWindowFrames = 30;
+  // チャンクの目標の長さの範囲とワーカー1つあたりのチャンク数
+  const double kMinChunkSeconds = 30.0;
+  const double kMaxChunkSeconds = 120.0;
+  const size_t kChunksPerWorker = 4;
+
+  std::vector<TranscribeJob> jobs;
+  MappedWavReader reader;
+  if (!reader.open(path.c_str())) {
+    outputJsonError("Failed to open WAV file: " + path);
+    return jobs;
+  }
+  const int channels = reader.numChannels();
+  DownmixKernel downmix = SelectDownmixKernel(reader.sampleFormat(), channels);
+  if (downmix == nullptr) {
+    outputJsonError("Unsupported WAV format: " + path);
+    return jobs;
+  }
+
+  TranscribeJob whole;
+  whole.file = file;
+  const int rate = reader.rate();
+  const double seconds = static_cast<double>(reader.totalFrames()) / rate;
+  double targetSeconds = seconds / (numWorkers * kChunksPerWorker);
+  if (targetSeconds < kMinChunkSeconds) targetSeconds = kMinChunkSeconds;
+  if (targetSeconds > kMaxChunkSeconds) targetSeconds = kMaxChunkSeconds;
+  if (seconds < targetSeconds * 2) {
+    jobs.push_back(whole);
+    return jobs;
+  }
+
+  // 10ms単位のフレーム番号を入力レートのフレーム番号に直す
+  auto toInputFrame = [rate](size_t frame) {
+    return static_cast<uint64_t>(frame) * rate / 100;
+  };
+
+  // 10ms単位の start から count 個のエネルギーを読む
+  std::vector<float> mono;
+  auto readEnergy = [&](size_t start, size_t count, float *energy) {
+    const uint64_t first = toInputFrame(start);
+    if (!reader.seek(first)) return false;
+    mono.resize(static_cast<size_t>(toInputFrame(start + count) - first));
+    size_t filled = 0;
+    while (filled < mono.size()) {
+      size_t read;
+      const uint8_t *data = reader.next(mono.size() - filled, &read);
+      if (data == nullptr || read == 0) return false;
+      downmix(data, read, channels, mono.data() + filled);
+      filled += read;
+    }
+    for (size_t i = 0; i < count; i++) {
+      const uint64_t from = toInputFrame(start + i) - first;
+      const uint64_t to = toInputFrame(start + i + 1) - first;
+      energy[i] =
+          FrameEnergy(mono.data() + from, static_cast<size_t>(to - from));
+    }
+    return true;
+  };
+
+  const size_t totalFrames =
+      static_cast<size_t>(reader.totalFrames() * 100 / rate);
+  const size_t targetFrames = static_cast<size_t>(targetSeconds * 100);
+  std::vector<size_t> splits =
+      PlanSilenceSplits(totalFrames, targetFrames, targetFrames / 6,
+                        kQuietWindowFrames, readEnergy);
+
+  uint64_t start = 0;
+  for (size_t i = 0; i <= splits.size(); i++) {
+    TranscribeJob job = whole;
+    job.chunk = i;
+    job.startFrame = start;
+    job.offsetSeconds = static_cast<double>(start) / rate;
+    if (i < splits.size()) {
+      job.endFrame = toInputFrame(splits[i]);
+      start = job.endFrame;
+    }
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+/**
+ * @brief 1チャンク分の音声を認識器に渡して結果を出力する関数
+ *
+ * 実時間に合わせて待つことはせず、読み出せる速さで認識器に渡します。
+ * 終了後は認識器をリセットし、次のチャンクにそのまま使えるようにします。
+ * リセットしても単語の時刻は作成からの通算のままのため、
+ * それまでに渡したサンプル数を差し引いてファイル先頭からの時刻に直します。
+ *
+ * @param recognizer 認識器（呼び出し元のスレッドが専有する）
+ * @param job 認識するチャンク
+ * @param path 入力ファイルのパス
+ * @param merger 結果を順序どおりに出力するクラス
+ * @param pcm 変換結果の作業領域
+ * @param samplesFed この認識器にこれまでに渡したサンプル数
+ * @return size_t 認識器に渡したサンプル数（開けなかった場合は0）
+ */
+size_t TranscribeChunk(VoskRecognizer *recognizer, const TranscribeJob &job,
+                       const std::string &path, ResultMerger &merger,
+                       std::vector<short> &pcm, uint64_t samplesFed) {
+  const double timeShift = ChunkTimeShift(job.offsetSeconds, samplesFed);
+  size_t totalSamples = 0;
+  FileStream stream;
+  if (stream.open(path) && stream.reader.seek(job.startFrame)) {
+    stream.framesLeft = job.endFrame - job.startFrame;
+
+    const short *data;
+    size_t samples;
+    while ((samples = stream.readBlock(pcm, &data)) > 0) {
+      totalSamples += samples;
+      if (vosk_recognizer_accept_waveform(
+              recognizer, reinterpret_cast<const char *>(data),
+              static_cast<int>(samples * sizeof(short)))) {
+        std::string line = FormatFileResult(
+            path, vosk_recognizer_result(recognizer), timeShift);
+        if (!line.empty()) merger.add(job, line);
+      }
+    }
+    std::string line = FormatFileResult(
+        path, vosk_recognizer_final_result(recognizer), timeShift);
+    if (!line.empty()) merger.add(job, line);
+    vosk_recognizer_reset(recognizer);
+  }
+
+  // 失敗した場合も後続のチャンクを止めないよう終了を通知する
+  merger.finish(job);
+  return totalSamples;
+}
+
+/**
+ * @brief ワーカースレッドごとの集計
+ */
+struct WorkerStats {
+  size_t chunks = 0;          // 処理したチャンク数
+  size_t steals = 0;          // 他のワーカーから奪ったチャンク数
+  double audioSeconds = 0.0;  // 処理した音声の長さ
+  double busySeconds = 0.0;   // 認識に費やした時間
+};
+
+/**
+ * @brief 1つのVoskModelを共有し、複数スレッドでファイルを並列に認識する関数
+ *
+ * バッチモデルを使えないlibvosk（CUDAなしのビルド）向けです。
+ * モデルは読み取り専用で全ワーカーが共有し、認識器はワーカーごとに1つ持ちます。
+ * 長いファイルは無音付近で分割してチャンクごとに並列に認識し、
+ * 結果は ResultMerger でファイル内の順序に並べ直して出力します。
+ * チャンクはワークスティーリング・キューで配り、
+ * 早く終わったワーカーが他のワーカーの残りを引き取ります。
+ *
+ * @param model モデル
+ * @param files 入力ファイルの一覧
+ * @param numWorkers ワーカースレッド数
+ * @param words 最終結果に単語ごとの時刻を付けるか
+ * @return double 処理した音声の長さ（秒）
+ */
+double TranscribeFilesParallel(VoskModel *model,
+                               const std::vector<std::string> &files,
+                               size_t numWorkers, bool words) {
+  if (numWorkers == 0) numWorkers = 1;
+
+  std::vector<TranscribeJob> jobs;
+  std::vector<size_t> chunkCounts(files.size(), 0);
+  for (size_t i = 0; i < files.size(); i++) {
+    std::vector<TranscribeJob> fileJobs =
+        PlanFileChunks(files[i], i, numWorkers);
+    chunkCounts[i] = fileJobs.size();
+    jobs.insert(jobs.end(), fileJobs.begin(), fileJobs.end());
+  }
+  if (jobs.empty()) return 0.0;
+  if (numWorkers > jobs.size()) numWorkers = jobs.size();
+
+  // 先頭から順に配っておき、偏りは実行時の奪い合いでならす
+  WorkStealingQueue<TranscribeJob> queue(numWorkers);
+  for (size_t i = 0; i < jobs.size(); i++) queue.push(i, jobs[i]);
+  ResultMerger merger(files, chunkCounts);
+
+  std::vector<WorkerStats> stats(numWorkers);
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < numWorkers; w++) {
+    workers.emplace_back([model, &files, &queue, &merger, &stats, w,
+                          words]() {
+      VoskRecognizer *recognizer = vosk_recognizer_new(model, 16000.0);
+      if (recognizer == nullptr) {
+        outputJsonError("Failed to create recognizer");
+        return;
+      }
+      if (words) vosk_recognizer_set_words(recognizer, 1);
+
+      std::vector<short> pcm;
+      WorkerStats &s = stats[w];
+      uint64_t samplesFed = 0;  // 単語の時刻の原点を求めるための通算
+      TranscribeJob job;
+      bool stolen;
+      while (queue.pop(w, &job, &stolen)) {
+        auto start = std::chrono::steady_clock::now();
+        size_t samples = TranscribeChunk(recognizer, job, files[job.file],
+                                         merger, pcm, samplesFed);
+        samplesFed += samples;
+        s.busySeconds += std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        s.audioSeconds += samples / 16000.0;
+        s.chunks++;
+        if (stolen) s.steals++;
+      }
+      vosk_recognizer_free(recognizer);
+    });
+  }
+  for (auto &worker : workers) worker.join();
+
+  double audioSeconds = 0.0;
+  JsonWriter writer;
+  for (size_t w = 0; w < numWorkers; w++) {
+    const WorkerStats &s = stats[w];
+    writer.clear();
+    writer.beginObject()
+        .key("info")
+        .string("worker")
+        .key("worker")
+        .integer(static_cast<long long>(w))
+        .key("chunks")
+        .integer(static_cast<long long>(s.chunks))
+        .key("steals")
+        .integer(static_cast<long long>(s.steals))
+        .key("audioSeconds")
+        .number(s.audioSeconds)
+        .key("busySeconds")
+        .number(s.busySeconds)
+        .key("realtimeFactor")
+        .number(s.busySeconds > 0.0 ? s.audioSeconds / s.busySeconds : 0.0)
+        .endObject();
+    g_output.writeLine(writer);
+    audioSeconds += s.audioSeconds;
+  }
+  return audioSeconds;
+}
+
+/**
+ * @brief WAVファイルを認識して結果をJSON行で出力する関数
+ *
+ * VoskBatchModelが使える場合は複数ファイルを同時に処理し、
+ * 使えない場合は通常のモデルを共有した複数スレッドで処理します。
+ * 最後に処理時間と実時間比を出力します。
+ *
+ * @param files 入力ファイルの一覧
+ * @param modelPath 音声認識モデルのパス
+ * @param numWorkers 通常モデルで処理する場合のワーカースレッド数
+ * @param prefetcher モデルの先読み（nullptrの場合は先読みしない）
+ * @param words 通常モデルで処理する場合に単語ごとの時刻を付けるか
+ */
+void TranscribeFiles(const std::vector<std::string> &files,
+                     const char *modelPath, size_t numWorkers,
+                     ModelPrefetcher *prefetcher, bool words) {
+  // 同時に処理するファイル数
+  const size_t kBatchStreams = 32;
+
+  vosk_set_log_level(-1);
+  vosk_gpu_init();
+
+  auto startTime = std::chrono::steady_clock::now();
+  double audioSeconds = 0.0;
+  const char *mode;
+
+  VoskBatchModel *batchModel = vosk_batch_model_new(modelPath);
+  if (batchModel != nullptr) {
+    mode = "batch";
+    g_output.writeLine("{\"info\":\"start\",\"mode\":\"batch\"}");
+    audioSeconds = TranscribeFilesBatch(batchModel, files, kBatchStreams);
+    vosk_batch_model_free(batchModel);
+  } else {
+    VoskModel *model = LoadModel(modelPath, prefetcher);
+    if (model == nullptr) return;
+    mode = "parallel";
+    JsonWriter writer;
+    writer.beginObject()
+        .key("info")
+        .string("start")
+        .key("mode")
+        .string(mode)
+        .key("workers")
+        .integer(static_cast<long long>(numWorkers))
+        .endObject();
+    g_output.writeLine(writer);
+    audioSeconds = TranscribeFilesParallel(model, files, numWorkers, words);
+    vosk_model_free(model);
+  }
+
+  double elapsedSeconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                    startTime)
+          .count();
+  JsonWriter writer;
+  writer.beginObject()
+      .key("info")
+      .string("finished")
+      .key("mode")
+      .string(mode)
+      .key("files")
+      .integer(static_cast<long long>(files.size()))
+      .key("audioSeconds")
+      .number(audioSeconds)
+      .key("elapsedSeconds")
+      .number(elapsedSeconds)
+      .key("realtimeFactor")
+      .number(elapsedSeconds > 0.0 ? audioSeconds / elapsedSeconds : 0.0)
+      .endObject();
+  g_output.writeLine(writer);
+}
+
+/**
+ * @brief ベンチマークでの音声の渡し方
+ */
+enum class BenchMode {
+  Fast,      // 認識が追いつく限り速く渡す
+  Realtime,  // マイク入力と同じく実時間で渡す
+  Both,      // Fast と Realtime の両方を順に実行する
+};
+
+/**
+ * @brief レイテンシのパーセンタイルをJSONオブジェクトとして書く関数
+ */
+void WriteLatencyPercentiles(JsonWriter *writer, const char *name,
+                             std::vector<double> *values) {
+  writer->key(name)
+      .beginObject()
+      .key("count")
+      .integer(static_cast<long long>(values->size()))
+      .key("p50")
+      .number(Percentile(values, 50.0), 1)
+      .key("p95")
+      .number(Percentile(values, 95.0), 1)
+      .key("p99")
+      .number(Percentile(values, 99.0), 1)
+      .endObject();
+}
+
+/**
+ * @brief WAVファイルに対応する正解テキスト（拡張子を .txt にしたもの）を読む
+ *
+ * @param wavPath WAVファイルのパス
+ * @param text 正解テキストの格納先
+ * @return bool 正解テキストがあればtrue
+ */
+bool ReadReferenceText(const std::string &wavPath, std::string *text) {
+  std::string path = wavPath;
+  const size_t dot = path.find_last_of('.');
+  const size_t slash = path.find_last_of("/\\");
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    path.erase(dot);
+  path += ".txt";
+  return ReadTextFile(path, text);
+}
+
+/**
+ * @brief WAVコーパスで認識の性能を計測する関数
+ *
+ * マイク入力と同じ変換・リングバッファ・認識スレッドの経路（RunAudioSession）に
+ * ファイルを流し、渡し方と変換後のサンプルの型ごとに次の内容を
+ * {"info":"bench",...} で出力します。
+ * - realtimeFactor: 音声の長さ / 処理時間（1より大きければ実時間より速い）
+ * - convertMsPerAudioSecond: 音声1秒あたりの変換（ダウンミックスと
+ *   リサンプリング、int16では量子化を含む）にかかった時間
+ * - partialLatencyMs / finalLatencyMs: 認識器に渡した最後の音声が届いてから
+ *   部分認識結果・確定結果を出力するまでの時間の p50/p95/p99
+ * - cer: 正解テキスト（WAVと同じ名前の .txt）がある場合の文字誤り率
+ * - cerVsInt16: int16 と float を比べる場合の、int16 の結果に対する
+ *   float の結果の文字の相違率（同じ音声での経路による違い）
+ * - peakRssMB: プロセスの最大常駐メモリ
+ * - allocationsPerSecond: このプログラムのC++コードによる割り当て回数/秒
+ *   （割り当てを数えるビルド（VOSK_CLI_COUNT_ALLOCATIONS）の場合のみ）
+ * モデルごとに実行して結果を比べることで、リリース間の劣化を検出できます。
+ *
+ * @param files WAVファイルの一覧
+ * @param modelPath 音声認識モデルのパス
+ * @param mode 音声の渡し方
+ * @param settings 認識設定（floatSamples で計測するサンプルの型を選ぶ）
+ * @param comparePcm trueの場合は int16 と float の両方を計測して比べる
+ * @return int 成功時は0、失敗時は1
+ */
+int RunBenchmark(const std::vector<std::string> &files, const char *modelPath,
+                 BenchMode mode, const StreamSettings &settings,
+                 bool comparePcm) {
+  ResourceGuard resources;  // スコープを抜ける際に自動的にリソースを解放
+
+  double loadMs = 0.0;
+  VoskModel *model = LoadModel(modelPath, settings.prefetcher, &loadMs);
+  if (model == nullptr) return 1;
+  resources.setModel(model);
+  const uint64_t loadedRss = PeakResidentBytes();
+
+  // セッションごとの認識器の作成を計測に含めないよう1つだけ使い回す
+  RecognizerPool pool(1, 1);
+  pool.prewarm(model, 16000.0f, settings.grammar);
+  if (settings.warmup) WarmUpPool(&pool, model, 1, settings.grammar);
+
+  // 正解テキストは計測の前に読んでおく（ないファイルは空のまま）
+  std::vector<std::string> references(files.size());
+  std::vector<bool> hasReference(files.size(), false);
+  size_t referenceFiles = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    hasReference[i] = ReadReferenceText(files[i], &references[i]);
+    if (hasReference[i]) referenceFiles++;
+  }
+
+  std::vector<bool> samplePaths;  // floatSamples の値
+  if (comparePcm) {
+    samplePaths.push_back(false);
+    samplePaths.push_back(true);
+  } else {
+    samplePaths.push_back(settings.floatSamples);
+  }
+
+  const BenchMode passes[] = {BenchMode::Fast, BenchMode::Realtime};
+  for (BenchMode pass : passes) {
+    if (mode != BenchMode::Both && mode != pass) continue;
+    const bool realtime = pass == BenchMode::Realtime;
+    std::vector<std::string> int16Transcripts;  // 経路の比較用
+
+    for (bool floatSamples : samplePaths) {
+      StreamSettings pathSettings = settings;
+      pathSettings.floatSamples = floatSamples;
+
+      std::vector<double> partialMs;
+      std::vector<double> finalMs;
+      std::vector<std::string> transcripts;
+      uint64_t samples = 0;
+      double convertSeconds = 0.0;
+      const size_t allocationsBefore = GetAllocationCount();
+      auto start = std::chrono::steady_clock::now();
+      for (const std::string &file : files) {
+        StreamAudioSource fileSource(file, StreamFormat::Wav, 16000, 1);
+        PacedAudioSource pacedSource(&fileSource);
+        AudioSource &source =
+            realtime ? static_cast<AudioSource &>(pacedSource) : fileSource;
+        LatencyProbe probe;
+        RunAudioSession(source, model, &pool, pathSettings, -1, &probe);
+
+        samples += probe.samples();
+        convertSeconds += probe.conversionSeconds();
+        transcripts.push_back(probe.transcript());
+        partialMs.insert(partialMs.end(), probe.partialLatencies().begin(),
+                         probe.partialLatencies().end());
+        finalMs.insert(finalMs.end(), probe.finalLatencies().begin(),
+                       probe.finalLatencies().end());
+      }
+      const double elapsedSeconds = MillisecondsSince(start) / 1000.0;
+      const double audioSeconds = samples / 16000.0;
+      const size_t allocations = GetAllocationCount() - allocationsBefore;
+
+      // 正解テキストに対する文字誤り率（ファイル全体の文字数で平均する）
+      size_t errors = 0;
+      size_t referenceLength = 0;
+      for (size_t i = 0; i < files.size(); i++) {
+        if (!hasReference[i]) continue;
+        size_t length = 0;
+        errors += CharacterErrors(references[i], transcripts[i], &length);
+        referenceLength += length;
+      }
+
+      JsonWriter writer;
+      writer.beginObject()
+          .key("info")
+          .string("bench")
+          .key("mode")
+          .string(realtime ? "realtime" : "fast")
+          .key("pcm")
+          .string(floatSamples ? "float" : "int16")
+          .key("model")
+          .string(modelPath)
+          .key("files")
+          .integer(static_cast<long long>(files.size()))
+          .key("audioSeconds")
+          .number(audioSeconds)
+          .key("elapsedSeconds")
+          .number(elapsedSeconds)
+          .key("realtimeFactor")
+          .number(elapsedSeconds > 0.0 ? audioSeconds / elapsedSeconds : 0.0)
+          .key("convertMsPerAudioSecond")
+          .number(audioSeconds > 0.0 ? convertSeconds * 1000.0 / audioSeconds
+                                     : 0.0,
+                  4);
+      WriteLatencyPercentiles(&writer, "partialLatencyMs", &partialMs);
+      WriteLatencyPercentiles(&writer, "finalLatencyMs", &finalMs);
+      if (referenceFiles > 0) {
+        writer.key("referenceFiles")
+            .integer(static_cast<long long>(referenceFiles))
+            .key("cer")
+            .number(referenceLength > 0
+                        ? static_cast<double>(errors) / referenceLength
+                        : 0.0,
+                    4);
+      }
+      if (floatSamples && int16Transcripts.size() == files.size()) {
+        size_t differences = 0;
+        size_t int16Length = 0;
+        for (size_t i = 0; i < files.size(); i++) {
+          size_t length = 0;
+          differences +=
+              CharacterErrors(int16Transcripts[i], transcripts[i], &length);
+          int16Length += length;
+        }
+        writer.key("cerVsInt16").number(
+            int16Length > 0 ? static_cast<double>(differences) / int16Length
+                            : 0.0,
+            4);
       }
-      i++;
+      writer.key("modelLoadMs")
+          .number(loadMs, 1)
+          .key("modelRssMB")
+          .number(loadedRss / (1024.0 * 1024.0), 1)
+          .key("peakRssMB")
+          .number(PeakResidentBytes() / (1024.0 * 1024.0), 1);
+#ifdef VOSK_CLI_COUNT_ALLOCATIONS
+      writer.key("allocationsPerSecond")
+          .number(elapsedSeconds > 0.0 ? allocations / elapsedSeconds : 0.0,
+                  1);
+#else
+      (void)allocations;
+#endif
+      writer.endObject();
+      g_output.writeLine(writer);
+
+      if (!floatSamples) int16Transcripts.swap(transcripts);
+    }
+  }
+  // リソースは自動的に解放される（ResourceGuardのデストラクタで）
+  return 0;
+}
+
+/**
+ * @brief プログラムの使用方法を表示する関数
+ *
+ * コマンドライン引数の詳細と使用例を標準出力に表示します。
+ */
+void printUsage() {
+  printf("vosk-cli - Speech To Text Command Line Interface\n");
+  printf("Version: %s (Built: %s)\n", VOSK_CLI_VERSION, VOSK_CLI_BUILD_DATE);
+  printf("\n");
+  printf("Usage: vosk-cli [options]\n");
+  printf("Options:\n");
+  printf("  -l          List input audio devices in JSON format\n");
+  printf("  -d index    Specify the audio device index (default: 0)\n");
+  printf("              A comma-separated list captures several devices\n");
+  printf("              with one shared model (e.g. -d 0,2)\n");
+  printf("  -m path     Specify the path to the speech recognition model\n");
+  printf("              (default: model/vosk-model-small-ja-0.22)\n");
+  printf("  -test       Test record 10sec and output wav\n");
+  printf(
+      "  -textonly   Show only final recognition results (no partial "
+      "results)\n");
+  printf("  -i path     Read audio from a file or named pipe instead of a\n");
+  printf("              device ('-' for stdin)\n");
+  printf("  -format fmt Input format for -i: wav, s16le or f32le\n");
+  printf("              (default: wav)\n");
+  printf("  -rate hz    Sample rate of raw -i input (default: 16000)\n");
+  printf("  -channels n Channels of raw -i input (default: 1)\n");
+  printf("  -f file     Transcribe a WAV file (can be repeated)\n");
+  printf("  -batch dir  Transcribe all WAV files in a directory\n");
+  printf("  -j threads  Worker threads for file transcription\n");
+  printf("              (default: number of CPU cores)\n");
+  printf("  -partial-ms n\n");
+  printf("              Output partial results at most every n ms\n");
+  printf("  -partial-delta\n");
+  printf("              Output partial results as changes from the previous\n");
+  printf("              one (partial_append / partial_replace)\n");
+  printf("  -words      Add word start/end times to final results, on a\n");
+  printf("              session clock that also counts skipped audio\n");
+  printf("  -partial-words\n");
+  printf("              Add word times to partial results as well\n");
+  printf("  -spk path   Load a speaker model (in parallel with the model)\n");
+  printf("              and label final results with a speaker id\n");
+  printf("  -spk-threshold x\n");
+  printf("              Cosine similarity for the same speaker\n");
+  printf("              (default: 0.5)\n");
+  printf("  -spk-enroll file\n");
+  printf("              Known speakers, one {\"id\":...,\"spk\":[...]}\n");
+  printf("              per line (others are numbered S1, S2, ...)\n");
+  printf("  -vad        Skip non-speech audio before recognition\n");
+  printf("  -vad-threshold db\n");
+  printf("              Speech level above the noise floor (default: 9)\n");
+  printf("  -vad-hangover ms\n");
+  printf("              Keep passing audio after speech ends (default: 500)\n");
+  printf("  -vad-preroll ms\n");
+  printf("              Audio passed before speech onset (default: 300)\n");
+  printf("  -flush-ms n Write results at most every n milliseconds\n");
+  printf("              (default: write each line immediately)\n");
+  printf("  -flush-lines n\n");
+  printf("              Write results every n lines\n");
+  printf("  -server port\n");
+  printf("              Keep the model loaded and serve recognition\n");
+  printf("              sessions on 127.0.0.1:port (0 picks a free port)\n");
+  printf("  -sessions n Maximum concurrent sessions in server mode\n");
+  printf("              (default: 4)\n");
+  printf("  -pool-min n Recognizers created ahead of the first session\n");
+  printf("              (default: 1)\n");
+  printf("  -pool-max n Idle recognizers kept for reuse (default: 4)\n");
+  printf("  -warmup     Run synthetic audio through the recognizers before\n");
+  printf("              capture so the first utterance is not cold\n");
+  printf("  -prefetch   Read the model files into the page cache in\n");
+  printf("              parallel while audio devices are enumerated\n");
+  printf("  -preload-check\n");
+  printf("              Load the model, create and warm up a recognizer,\n");
+  printf("              report the timings and exit (no audio is opened)\n");
+  printf("  -grammar file\n");
+  printf("              Recognize only the phrases in a JSON array of\n");
+  printf("              strings (include \"[unk]\" to accept other words)\n");
+  printf("  -control    Read JSON control commands from stdin, one per\n");
+  printf("              line (e.g. {\"command\":\"grammar\",\n");
+  printf("              \"phrases\":[...]} swaps the phrase list)\n");
+  printf("  -pcm type   Sample type passed to the recognizer: int16 or\n");
+  printf("              float (no quantization or clipping; default: int16)\n");
+  printf("              With -bench, both measures and compares the two\n");
+  printf("  -bench path Measure real-time factor, latency percentiles, peak\n");
+  printf("              RSS and allocations/s on a WAV file or directory\n");
+  printf("              (file.txt next to file.wav is used to report CER)\n");
+  printf("  -bench-mode mode\n");
+  printf("              fast, realtime or both (default: both)\n");
+  printf("  -bench-text Compare result post-processing with the regex\n");
+  printf("              version and exit\n");
+  printf("  -h          Show this help message\n");
+}
+
+/**
+ * @brief コマンドライン引数で指定する設定
+ */
+struct CommandLineOptions {
+  const char *modelPath =
+      "model/vosk-model-small-ja-0.22";  // 音声認識モデルのパス
+  bool listDevices = false;              // デバイス一覧表示フラグ
+  std::vector<int> deviceIndices = {0};  // オーディオデバイスのインデックス
+  bool isTest = false;                   // テストモードフラグ
+  bool textOnly = false;  // テキストのみフラグ（部分結果を表示しない）
+  std::vector<std::string> inputFiles;  // 認識するWAVファイル
+  int numWorkers = static_cast<int>(
+      std::thread::hardware_concurrency());  // ファイル認識のスレッド数
+  const char *inputPath = nullptr;  // デバイスの代わりに読む入力（-i）
+  StreamFormat inputFormat = StreamFormat::Wav;  // -i の入力形式
+  int inputRate = 16000;                          // 生PCM入力のレート
+  int inputChannels = 1;                          // 生PCM入力のチャンネル数
+  bool benchText = false;  // 結果の後処理のベンチマークを実行して終了
+  int partialIntervalMs = 0;   // 部分認識結果の最小出力間隔
+  bool partialDelta = false;  // 部分認識結果を差分で出力する
+  bool vad = false;         // 音声区間ゲートを使う
+  VadSettings vadSettings;  // 音声区間ゲートの設定
+  FlushPolicy flushPolicy = FlushPolicy::Immediate;  // 結果行の書き出し方
+  int flushValue = 0;  // -flush-ms のミリ秒、または -flush-lines の行数
+  int serverPort = -1;    // サーバーモードのポート（-1はサーバーモードでない）
+  int maxSessions = 4;    // サーバーモードの同時セッション数
+  int poolMin = 1;        // 事前に作成しておく認識器の数
+  int poolMax = 4;        // 待機させておく認識器の上限
+  bool warmup = false;    // 認識の前に合成音声で慣らし運転する
+  bool preloadCheck = false;  // モデルの読み込みを確認・計測して終了
+  bool prefetch = false;      // モデルのファイルを先読みしてから読み込む
+  const char *benchPath = nullptr;    // ベンチマークのWAVファイル・ディレクトリ
+  BenchMode benchMode = BenchMode::Both;  // ベンチマークでの音声の渡し方
+  bool floatSamples = false;  // floatのまま認識器に渡す（-pcm float）
+  bool comparePcm = false;    // int16 と float を比べる（-pcm both）
+  const char *grammarPath = nullptr;  // 文法のJSONファイル
+  bool control = false;  // 標準入力から制御コマンドを読む
+  bool words = false;         // 最終結果に単語ごとの時刻を付ける
+  bool partialWords = false;  // 部分認識結果に単語ごとの時刻を付ける
+  const char *spkPath = nullptr;        // 話者モデルのパス
+  float spkThreshold = 0.5f;            // 同じ話者とみなすコサイン類似度
+  const char *spkEnrollPath = nullptr;  // 登録する話者の一覧のファイル
+};
+
+/**
+ * @brief 正の整数のオプション値を変換する関数
+ *
+ * @param value オプション値
+ * @param result 変換結果を格納するポインタ
+ * @return bool 正の整数であればtrue
+ */
+bool parsePositiveInt(const char *value, int *result) {
+  try {
+    *result = std::stoi(value);
+  } catch (const std::exception &) {
+    return false;
+  }
+  return *result > 0;
+}
+
+/**
+ * @brief 値を取るオプションかどうかを判定する関数
+ *
+ * @param option オプション名
+ * @return bool 値を取るオプションであればtrue
+ */
+bool takesValue(const char *option) {
+  static const char *const kValueOptions[] = {
+      "-d", "-m", "-f", "-batch", "-j", "-i", "-format", "-rate",
+      "-channels", "-flush-ms", "-flush-lines", "-partial-ms",
+      "-vad-threshold", "-vad-hangover", "-vad-preroll", "-server",
+      "-sessions", "-pool-min", "-pool-max", "-bench", "-bench-mode",
+      "-pcm", "-grammar", "-spk", "-spk-threshold", "-spk-enroll"};
+  for (const char *name : kValueOptions) {
+    if (!strcmp(option, name)) return true;
+  }
+  return false;
+}
+
+/**
+ * @brief コマンドライン引数を解析する関数
+ *
+ * @param argc 引数の数
+ * @param argv 引数の配列
+ * @param options 解析結果を格納するポインタ
+ * @return int 成功時は0、エラー時は1を返す
+ */
+int parseArguments(int argc, char *argv[], CommandLineOptions *options) {
+  if (argc <= 1) return 1;
+
+  for (int i = 1; i < argc; i++) {
+    // -l オプション: デバイス一覧表示
+    if (!strcmp(argv[i], "-l")) {
+      options->listDevices = true;
+      continue;
+    }
+
+    // -h オプション: ヘルプ表示
+    if (!strcmp(argv[i], "-h")) {
+      return 1;
+    }
+
+    // -test オプション: テストモード有効化
+    if (!strcmp(argv[i], "-test")) {
+      options->isTest = true;
+      continue;
+    }
+
+    // -textonly オプション: テキストのみモード有効化
+    if (!strcmp(argv[i], "-textonly")) {
+      options->textOnly = true;
+      continue;
+    }
+
+    // -vad オプション: 音声区間だけを認識器に渡す
+    if (!strcmp(argv[i], "-vad")) {
+      options->vad = true;
+      continue;
+    }
+
+    // -partial-delta オプション: 部分認識結果を差分で出力
+    if (!strcmp(argv[i], "-partial-delta")) {
+      options->partialDelta = true;
+      continue;
+    }
+
+    // -words オプション: 最終結果に単語ごとの時刻を付ける
+    if (!strcmp(argv[i], "-words")) {
+      options->words = true;
       continue;
     }
-    // -m オプション: モデルパスの設定
-    if (!strcmp(argv[i], "-m")) {
-      if (i + 1 >= argc) {
-        outputJsonError("No value specified for option " +
-                        std::string(argv[i]));
-        return 1;
-      }
 
-      *modelPath = argv[i + 1];
-      i++;
+    // -partial-words オプション: 部分認識結果に単語ごとの時刻を付ける
+    if (!strcmp(argv[i], "-partial-words")) {
+      options->partialWords = true;
       continue;
     }
-    // 不明なオプション
-    else {
+
+    // -warmup オプション: 認識の前に合成音声で慣らし運転
+    if (!strcmp(argv[i], "-warmup")) {
+      options->warmup = true;
+      continue;
+    }
+
+    // -prefetch オプション: モデルのファイルをページキャッシュへ先読み
+    if (!strcmp(argv[i], "-prefetch")) {
+      options->prefetch = true;
+      continue;
+    }
+
+    // -preload-check オプション: 音声を開かずにモデルを確認・計測
+    if (!strcmp(argv[i], "-preload-check")) {
+      options->preloadCheck = true;
+      continue;
+    }
+
+    // -control オプション: 標準入力から制御コマンドを読む
+    if (!strcmp(argv[i], "-control")) {
+      options->control = true;
+      continue;
+    }
+
+    // -bench-text オプション: 結果の後処理のベンチマーク
+    if (!strcmp(argv[i], "-bench-text")) {
+      options->benchText = true;
+      continue;
+    }
+
+    // ここから先は値を取るオプション
+    if (!takesValue(argv[i])) {
       outputJsonError("Unknown option: " + std::string(argv[i]));
       return 1;
     }
+    if (i + 1 >= argc) {
+      outputJsonError("No value specified for option " + std::string(argv[i]));
+      return 1;
+    }
+    const char *value = argv[i + 1];
+
+    // -d オプション: デバイスインデックスの設定（カンマ区切りで複数指定可）
+    if (!strcmp(argv[i], "-d")) {
+      options->deviceIndices.clear();
+      for (const char *p = value; *p;) {
+        // 数値変換
+        size_t length = strcspn(p, ",");
+        int index = -1;
+        try {
+          index = std::stoi(std::string(p, length));
+        } catch (const std::exception &) {
+          index = -1;  // 数値でない
+        }
+        if (index < 0 || std::find(options->deviceIndices.begin(),
+                                   options->deviceIndices.end(),
+                                   index) != options->deviceIndices.end()) {
+          outputJsonError("Invalid device index: " + std::string(value));
+          return 1;
+        }
+        options->deviceIndices.push_back(index);
+        p += length;
+        if (*p == ',') p++;
+      }
+      if (options->deviceIndices.empty()) {
+        outputJsonError("Invalid device index: " + std::string(value));
+        return 1;
+      }
+    }
+    // -f オプション: 認識するWAVファイルの追加
+    else if (!strcmp(argv[i], "-f")) {
+      options->inputFiles.push_back(value);
+    }
+    // -batch オプション: ディレクトリ内のWAVファイルをすべて追加
+    else if (!strcmp(argv[i], "-batch")) {
+      std::vector<std::string> files = EnumerateWavFiles(value);
+      if (files.empty()) {
+        outputJsonError("No WAV files found in: " + std::string(value));
+        return 1;
+      }
+      options->inputFiles.insert(options->inputFiles.end(), files.begin(),
+                                 files.end());
+    }
+    // -j オプション: ファイル認識のワーカースレッド数
+    else if (!strcmp(argv[i], "-j")) {
+      if (!parsePositiveInt(value, &options->numWorkers)) {
+        outputJsonError("Invalid thread count: " + std::string(value));
+        return 1;
+      }
+    }
+    // -i オプション: デバイスの代わりにファイル・パイプ・標準入力から読む
+    else if (!strcmp(argv[i], "-i")) {
+      options->inputPath = value;
+    }
+    // -format オプション: -i の入力形式
+    else if (!strcmp(argv[i], "-format")) {
+      if (!strcmp(value, "wav")) {
+        options->inputFormat = StreamFormat::Wav;
+      } else if (!strcmp(value, "s16le")) {
+        options->inputFormat = StreamFormat::S16le;
+      } else if (!strcmp(value, "f32le")) {
+        options->inputFormat = StreamFormat::F32le;
+      } else {
+        outputJsonError("Invalid input format: " + std::string(value));
+        return 1;
+      }
+    }
+    // -rate オプション: 生PCM入力のサンプリングレート
+    else if (!strcmp(argv[i], "-rate")) {
+      if (!parsePositiveInt(value, &options->inputRate)) {
+        outputJsonError("Invalid sample rate: " + std::string(value));
+        return 1;
+      }
+    }
+    // -channels オプション: 生PCM入力のチャンネル数
+    else if (!strcmp(argv[i], "-channels")) {
+      if (!parsePositiveInt(value, &options->inputChannels)) {
+        outputJsonError("Invalid channel count: " + std::string(value));
+        return 1;
+      }
+    }
+    // -partial-ms オプション: 部分認識結果の最小出力間隔
+    else if (!strcmp(argv[i], "-partial-ms")) {
+      if (!parsePositiveInt(value, &options->partialIntervalMs)) {
+        outputJsonError("Invalid partial interval: " + std::string(value));
+        return 1;
+      }
+    }
+    // -vad-threshold オプション: 雑音レベルからの音声判定の閾値（dB）
+    else if (!strcmp(argv[i], "-vad-threshold")) {
+      try {
+        options->vadSettings.marginDb = std::stof(value);
+      } catch (const std::exception &) {
+        options->vadSettings.marginDb = 0.0f;
+      }
+      if (options->vadSettings.marginDb <= 0.0f) {
+        outputJsonError("Invalid VAD threshold: " + std::string(value));
+        return 1;
+      }
+      options->vad = true;
+    }
+    // -vad-hangover / -vad-preroll オプション: ゲートを閉じるまでの時間と先読み
+    else if (!strcmp(argv[i], "-vad-hangover") ||
+             !strcmp(argv[i], "-vad-preroll")) {
+      int *target = !strcmp(argv[i], "-vad-hangover")
+                        ? &options->vadSettings.hangoverMs
+                        : &options->vadSettings.preRollMs;
+      if (!parsePositiveInt(value, target)) {
+        outputJsonError("Invalid VAD duration: " + std::string(value));
+        return 1;
+      }
+      options->vad = true;
+    }
+    // -flush-ms / -flush-lines オプション: 結果行をまとめて書き出す
+    else if (!strcmp(argv[i], "-flush-ms") ||
+             !strcmp(argv[i], "-flush-lines")) {
+      if (!parsePositiveInt(value, &options->flushValue)) {
+        outputJsonError("Invalid flush setting: " + std::string(value));
+        return 1;
+      }
+      options->flushPolicy = !strcmp(argv[i], "-flush-ms")
+                                 ? FlushPolicy::Interval
+                                 : FlushPolicy::Lines;
+    }
+    // -server オプション: 常駐サーバーモードのポート
+    else if (!strcmp(argv[i], "-server")) {
+      try {
+        options->serverPort = std::stoi(value);
+      } catch (const std::exception &) {
+        options->serverPort = -1;
+      }
+      if (options->serverPort < 0 || options->serverPort > 65535) {
+        outputJsonError("Invalid server port: " + std::string(value));
+        return 1;
+      }
+    }
+    // -sessions オプション: サーバーモードの同時セッション数
+    else if (!strcmp(argv[i], "-sessions")) {
+      if (!parsePositiveInt(value, &options->maxSessions)) {
+        outputJsonError("Invalid session count: " + std::string(value));
+        return 1;
+      }
+    }
+    // -pool-min / -pool-max オプション: 認識器プールの大きさ
+    else if (!strcmp(argv[i], "-pool-min") || !strcmp(argv[i], "-pool-max")) {
+      int *target = !strcmp(argv[i], "-pool-min") ? &options->poolMin
+                                                  : &options->poolMax;
+      if (!parsePositiveInt(value, target)) {
+        outputJsonError("Invalid pool size: " + std::string(value));
+        return 1;
+      }
+    }
+    // -bench オプション: WAVファイル・ディレクトリで性能を計測
+    else if (!strcmp(argv[i], "-bench")) {
+      options->benchPath = value;
+    }
+    // -bench-mode オプション: ベンチマークでの音声の渡し方
+    else if (!strcmp(argv[i], "-bench-mode")) {
+      if (!strcmp(value, "fast")) {
+        options->benchMode = BenchMode::Fast;
+      } else if (!strcmp(value, "realtime")) {
+        options->benchMode = BenchMode::Realtime;
+      } else if (!strcmp(value, "both")) {
+        options->benchMode = BenchMode::Both;
+      } else {
+        outputJsonError("Invalid bench mode: " + std::string(value));
+        return 1;
+      }
+    }
+    // -grammar オプション: 認識するフレーズの一覧
+    else if (!strcmp(argv[i], "-grammar")) {
+      options->grammarPath = value;
+    }
+    // -pcm オプション: 認識器に渡すサンプルの型
+    else if (!strcmp(argv[i], "-pcm")) {
+      options->floatSamples = !strcmp(value, "float");
+      options->comparePcm = !strcmp(value, "both");
+      if (!options->floatSamples && !options->comparePcm &&
+          strcmp(value, "int16") != 0) {
+        outputJsonError("Invalid sample type: " + std::string(value));
+        return 1;
+      }
+    }
+    // -spk オプション: 話者モデルのパス
+    else if (!strcmp(argv[i], "-spk")) {
+      options->spkPath = value;
+    }
+    // -spk-threshold オプション: 同じ話者とみなすコサイン類似度
+    else if (!strcmp(argv[i], "-spk-threshold")) {
+      try {
+        options->spkThreshold = std::stof(value);
+      } catch (const std::exception &) {
+        options->spkThreshold = -2.0f;
+      }
+      if (options->spkThreshold < -1.0f || options->spkThreshold > 1.0f) {
+        outputJsonError("Invalid speaker threshold: " + std::string(value));
+        return 1;
+      }
+    }
+    // -spk-enroll オプション: 登録する話者の一覧
+    else if (!strcmp(argv[i], "-spk-enroll")) {
+      options->spkEnrollPath = value;
+    }
+    // -m オプション: モデルパスの設定
+    else if (!strcmp(argv[i], "-m")) {
+      options->modelPath = value;
+    }
+    i++;
   }
 
   return 0;  // 成功
@@ -731,28 +3203,176 @@ int main(int argc, char *argv[]) {
   // UTF-8ロケールを明示的に指定
   setlocale(LC_ALL, ".UTF8");
 
-  char *modelPath =
-      _strdup("model/vosk-model-small-ja-0.22");  // 音声認識モデルのパス
-  bool listDevices = false;                       // デバイス一覧表示フラグ
-  int deviceIndex = 0;    // オーディオデバイスのインデックス
-  bool isTest = false;    // テストモードフラグ
-  bool textOnly = false;  // テキストのみフラグ（部分結果を表示しない）
+  CommandLineOptions options;
 
   // 引数の解析
-  if (parseArguments(argc, argv, &modelPath, &listDevices, &deviceIndex,
-                     &isTest, &textOnly) != 0) {
+  if (parseArguments(argc, argv, &options) != 0) {
     printUsage();
     return 1;
   }
+  g_output.setPolicy(options.flushPolicy,
+                     static_cast<unsigned>(options.flushValue));
+
+  if (options.benchText) {
+    RunTextBenchmark();
+    return 0;
+  }
 
   // listDevicesがtrueの場合はデバイス一覧をJSON形式で出力して終了
-  if (listDevices) {
+  if (options.listDevices) {
     OutputDevicesAsJson();
     return 0;
   }
 
-  // モデルパスとデバイスインデックスを指定して音声ストリームを開始
-  StartAudioStream(deviceIndex, modelPath, isTest, textOnly);
+  // 文法はモデルの読み込みより前に読み、誤りがあれば起動しない
+  std::string grammar;
+  if (options.grammarPath) {
+    std::string json;
+    size_t phrases = 0;
+    if (!ReadTextFile(options.grammarPath, &json) ||
+        !ParseGrammar(json, &grammar, &phrases)) {
+      outputJsonError("Invalid grammar file: " +
+                      std::string(options.grammarPath));
+      return 1;
+    }
+  }
+
+  // 話者の識別はキャプチャの認識結果にだけ付ける
+  if (options.spkPath &&
+      (options.preloadCheck || !options.inputFiles.empty() ||
+       options.serverPort >= 0 || options.benchPath)) {
+    outputJsonError("-spk can only be used with audio capture");
+    return 1;
+  }
+
+  // モデルの先読みはバックグラウンドで始め、読み込みの直前に完了を待つ
+  std::unique_ptr<ModelPrefetcher> prefetcher;
+  if (options.prefetch) {
+    prefetcher.reset(new ModelPrefetcher(options.modelPath));
+    prefetcher->start();
+  }
+
+  if (options.preloadCheck) {
+    int result = RunPreloadCheck(options.modelPath, prefetcher.get());
+    g_output.flush();
+    return result;
+  }
+
+  // ファイルが指定された場合はマイクを使わずにファイルを認識して終了
+  if (!options.inputFiles.empty()) {
+    TranscribeFiles(options.inputFiles, options.modelPath,
+                    options.numWorkers > 0
+                        ? static_cast<size_t>(options.numWorkers)
+                        : 1,
+                    prefetcher.get(), options.words);
+    g_output.flush();
+    return 0;
+  }
+
+  // サーバーモードではモデルを読み込んだまま接続を待つ
+  if (options.serverPort >= 0) {
+    ServerSettings settings;
+    settings.port = options.serverPort;
+    settings.maxSessions = options.maxSessions;
+    settings.partialIntervalMs =
+        static_cast<unsigned>(options.partialIntervalMs);
+    settings.partialDelta = options.partialDelta;
+    settings.textOnly = options.textOnly;
+    settings.grammar = grammar;
+    RunServer(options.modelPath, settings, options.poolMin, options.poolMax,
+              options.warmup, prefetcher.get());
+    g_output.flush();
+    return 0;
+  }
+
+  StreamSettings settings;
+  settings.isTest = options.isTest;
+  settings.textOnly = options.textOnly;
+  settings.partialIntervalMs = static_cast<unsigned>(options.partialIntervalMs);
+  settings.partialDelta = options.partialDelta;
+  settings.vad = options.vad ? &options.vadSettings : nullptr;
+  settings.poolMin = options.poolMin;
+  settings.poolMax = options.poolMax;
+  settings.warmup = options.warmup;
+  settings.prefetcher = prefetcher.get();
+  settings.floatSamples = options.floatSamples;
+  settings.grammar = grammar;
+  settings.words = options.words;
+  settings.partialWords = options.partialWords;
+
+  // 話者モデルは音声認識モデルと並行して読み込む
+  std::unique_ptr<SpeakerModelLoader> speakerModel;
+  std::unique_ptr<SpeakerTable> speakers;
+  if (options.spkPath) {
+    speakerModel.reset(new SpeakerModelLoader(options.spkPath));
+    speakerModel->start();
+    const size_t kMaxSpeakers = 32;  // 登録する話者の上限
+    speakers.reset(new SpeakerTable(options.spkThreshold, kMaxSpeakers));
+    std::string error;
+    if (options.spkEnrollPath &&
+        !LoadSpeakerEnrollment(options.spkEnrollPath, speakers.get(),
+                               &error)) {
+      outputJsonError(error);
+      return 1;
+    }
+    settings.speakerModel = speakerModel.get();
+    settings.speakers = speakers.get();
+  }
+
+  // ベンチマーク（ディレクトリの場合は中のWAVファイルをすべて使う）
+  if (options.benchPath) {
+    std::vector<std::string> files = EnumerateWavFiles(options.benchPath);
+    if (files.empty()) files.push_back(options.benchPath);
+    int result = RunBenchmark(files, options.modelPath, options.benchMode,
+                              settings, options.comparePcm);
+    g_output.flush();
+    return result;
+  }
+  if (options.comparePcm) {
+    outputJsonError("-pcm both can only be used with -bench");
+    return 1;
+  }
+
+  // 標準入力の制御チャネル（音声を標準入力から読む場合は使えない）
+  std::unique_ptr<ControlChannel> control;
+  if (options.control) {
+    if (options.inputPath && !strcmp(options.inputPath, "-")) {
+      outputJsonError("-control cannot be used with -i -");
+      return 1;
+    }
+    control.reset(new ControlChannel(
+        &g_output, {"grammar", "pause", "resume", "finalize", "reset",
+                    "partials", "max_alternatives", "device"}));
+    control->start(stdin);
+    settings.control = control.get();
+  }
+
+  // 入力元を選んで音声ストリームを開始（デバイスは複数を同時に認識できる）
+  std::vector<std::unique_ptr<AudioSource>> sources;
+  if (options.inputPath) {
+    sources.emplace_back(new StreamAudioSource(
+        options.inputPath, options.inputFormat, options.inputRate,
+        options.inputChannels));
+  } else {
+    // 先読みの間にデバイスを列挙し、COMとオーディオAPIの初回の初期化を
+    // 済ませておく（モデルの読み込み後のデバイスを開く時間が短くなる）
+    if (prefetcher) {
+      auto enumerateStart = std::chrono::steady_clock::now();
+      EnumerateInputDevices();
+      OutputStartupPhase("device_enumerate", -1,
+                         MillisecondsSince(enumerateStart));
+    }
+    for (int index : options.deviceIndices)
+      sources.emplace_back(new WasapiAudioSource(index));
+    settings.openDevice = [](int index) {
+      return std::unique_ptr<AudioSource>(new WasapiAudioSource(index));
+    };
+  }
+  std::vector<AudioSource *> sourcePointers;
+  for (auto &source : sources) sourcePointers.push_back(source.get());
+  StartAudioStreams(sourcePointers, options.deviceIndices, options.modelPath,
+                    settings);
+  g_output.flush();
 
   return 0;
 }
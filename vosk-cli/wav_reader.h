@@ -0,0 +1,271 @@
+﻿//-----------------------------------------------------------------------------
+// WAVファイルの逐次読み出し
+// RIFFチャンクを解析し、dataチャンクのPCMをフレーム単位で読み出します
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "downmix.h"
+
+// リトルエンディアンの整数を読む
+inline uint16_t WavReadLe16(const uint8_t *p) {
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+inline uint32_t WavReadLe32(const uint8_t *p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+         (static_cast<uint32_t>(p[2]) << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+/**
+ * @brief fmt チャンクの内容からサンプル形式を判定する関数
+ *
+ * @param fmt fmt チャンクの本体（16バイト以上）
+ * @param size fmt チャンクの本体のバイト数
+ * @param format サンプル形式の格納先（未対応ならUnknown）
+ * @param channels チャンネル数の格納先
+ * @param sampleRate サンプリングレートの格納先
+ * @param frameBytes 1フレームのバイト数の格納先
+ * @return bool 対応する形式であればtrue
+ */
+inline bool ParseWavFormatChunk(const uint8_t *fmt, size_t size,
+                                SampleFormat *format, int *channels,
+                                int *sampleRate, size_t *frameBytes) {
+  uint16_t tag = WavReadLe16(fmt);
+  *channels = WavReadLe16(fmt + 2);
+  *sampleRate = static_cast<int>(WavReadLe32(fmt + 4));
+  uint16_t blockAlign = WavReadLe16(fmt + 12);
+  uint16_t bits = WavReadLe16(fmt + 14);
+
+  // WAVE_FORMAT_EXTENSIBLE はサブフォーマットGUIDの先頭2バイトが実際の形式
+  if (tag == 0xFFFE && size >= 26) tag = WavReadLe16(fmt + 24);
+
+  *format = SampleFormat::Unknown;
+  if (tag == 3 && bits == 32) {
+    *format = SampleFormat::Float32;
+  } else if (tag == 1) {
+    switch (bits) {
+      case 8:
+        *format = SampleFormat::UInt8;
+        break;
+      case 16:
+        *format = SampleFormat::Int16;
+        break;
+      case 24:
+        *format = SampleFormat::Int24;
+        break;
+      case 32:
+        *format = SampleFormat::Int32;
+        break;
+    }
+  }
+
+  *frameBytes = blockAlign;
+  // 24bit in 32bit コンテナなどブロック長が合わない形式は扱わない
+  if (*channels == 0 || *sampleRate <= 0 ||
+      blockAlign != *channels * (bits / 8))
+    *format = SampleFormat::Unknown;
+  return *format != SampleFormat::Unknown;
+}
+
+/**
+ * @brief WAVファイルを先頭から順に読み出すクラス
+ *
+ * fmt チャンクからサンプル形式・チャンネル数・レートを取得し、
+ * read() で data チャンクのインターリーブされたフレームをそのまま返します。
+ * 変換は呼び出し側で AudioConverter を使って行います。
+ */
+class WavFileReader {
+ public:
+  WavFileReader()
+      : fp(nullptr), ownsFile(false), format(SampleFormat::Unknown),
+        channels(0), sampleRate(0), frameBytes(0), remainingBytes(0),
+        dataBytes(0), dataOffset(0), seekable(false) {}
+
+  ~WavFileReader() { close(); }
+
+  WavFileReader(const WavFileReader &) = delete;
+  WavFileReader &operator=(const WavFileReader &) = delete;
+
+  /**
+   * @brief ファイルを開いてヘッダーを解析する
+   *
+   * @param path WAVファイルのパス
+   * @return bool 対応する形式のWAVファイルであればtrue
+   */
+  bool open(const char *path) {
+    close();
+#ifdef _MSC_VER
+    if (fopen_s(&fp, path, "rb") != 0) fp = nullptr;
+#else
+    fp = fopen(path, "rb");
+#endif
+    if (fp == nullptr) return false;
+    ownsFile = true;
+    if (!parseHeader()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief 開いているストリーム（標準入力やパイプ）からヘッダーを解析する
+   *
+   * シークできないストリームでも先頭から順に読むだけで解析できます。
+   * ストリームは閉じません。
+   *
+   * @param stream 読み出すストリーム
+   * @return bool 対応する形式のWAVデータであればtrue
+   */
+  bool attach(FILE *stream) {
+    close();
+    fp = stream;
+    ownsFile = false;
+    if (!parseHeader()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (fp && ownsFile) fclose(fp);
+    fp = nullptr;
+  }
+
+  SampleFormat sampleFormat() const { return format; }
+  int numChannels() const { return channels; }
+  int rate() const { return sampleRate; }
+  size_t frameSize() const { return frameBytes; }
+
+  // dataチャンクの総フレーム数（サイズ不明のファイルでは0）
+  uint64_t totalFrames() const {
+    return frameBytes ? dataBytes / frameBytes : 0;
+  }
+
+  /**
+   * @brief dataチャンク内の指定フレームへ移動する
+   *
+   * @param frame 移動先のフレーム番号（先頭が0）
+   * @return bool 成功時はtrue
+   */
+  bool seek(uint64_t frame) {
+    if (fp == nullptr || frameBytes == 0 || !seekable) return false;
+    uint64_t offset = frame * frameBytes;
+    if (dataBytes != 0 && offset > dataBytes) return false;
+    if (!seekAbsolute(dataOffset + offset)) return false;
+    remainingBytes = dataBytes != 0 ? dataBytes - offset : UINT64_MAX;
+    return true;
+  }
+
+  /**
+   * @brief 次のフレームを読み出す
+   *
+   * @param dst 読み出し先（maxFrames * frameSize() バイト以上）
+   * @param maxFrames 読み出す最大フレーム数
+   * @return size_t 読み出したフレーム数（終端では0）
+   */
+  size_t read(uint8_t *dst, size_t maxFrames) {
+    if (fp == nullptr || frameBytes == 0) return 0;
+    uint64_t want = static_cast<uint64_t>(maxFrames) * frameBytes;
+    if (want > remainingBytes)
+      want = remainingBytes - remainingBytes % frameBytes;
+    size_t got = fread(dst, 1, static_cast<size_t>(want), fp);
+    size_t frames = got / frameBytes;
+    remainingBytes -= got;
+    return frames;
+  }
+
+ private:
+  // RIFFヘッダーとチャンクを読み、dataチャンクの先頭まで進める
+  bool parseHeader() {
+    uint8_t riff[12];
+    if (fread(riff, 1, sizeof(riff), fp) != sizeof(riff)) return false;
+    if (memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0)
+      return false;
+
+    bool hasFormat = false;
+    for (;;) {
+      uint8_t chunk[8];
+      if (fread(chunk, 1, sizeof(chunk), fp) != sizeof(chunk)) return false;
+      uint32_t size = WavReadLe32(chunk + 4);
+
+      if (memcmp(chunk, "fmt ", 4) == 0) {
+        uint8_t fmt[40] = {};
+        size_t n = size < sizeof(fmt) ? size : sizeof(fmt);
+        if (n < 16 || fread(fmt, 1, n, fp) != n) return false;
+        if (!parseFormat(fmt, n)) return false;
+        hasFormat = true;
+        if (!skip(static_cast<uint64_t>(size) - n + (size & 1))) return false;
+      } else if (memcmp(chunk, "data", 4) == 0) {
+        if (!hasFormat) return false;
+        // 録音中のファイルなどサイズが未確定の場合は終端まで読む
+        remainingBytes = size == 0xFFFFFFFFu ? UINT64_MAX : size;
+        dataBytes = size == 0xFFFFFFFFu ? 0 : size;
+        // パイプでは位置を取れないが、先頭から読む分には問題ない
+        seekable = tellAbsolute(&dataOffset);
+        return true;
+      } else {
+        if (!skip(static_cast<uint64_t>(size) + (size & 1))) return false;
+      }
+    }
+  }
+
+  bool parseFormat(const uint8_t *fmt, size_t size) {
+    return ParseWavFormatChunk(fmt, size, &format, &channels, &sampleRate,
+                               &frameBytes);
+  }
+
+  // 2GBを超えるファイルでも位置を扱えるよう64ビット版を使う
+  bool seekAbsolute(uint64_t position) {
+#ifdef _MSC_VER
+    return _fseeki64(fp, static_cast<__int64>(position), SEEK_SET) == 0;
+#else
+    return fseeko(fp, static_cast<off_t>(position), SEEK_SET) == 0;
+#endif
+  }
+
+  bool tellAbsolute(uint64_t *position) {
+#ifdef _MSC_VER
+    __int64 p = _ftelli64(fp);
+#else
+    off_t p = ftello(fp);
+#endif
+    if (p < 0) return false;
+    *position = static_cast<uint64_t>(p);
+    return true;
+  }
+
+  // シークできないストリームでは読み捨てて進める
+  bool skip(uint64_t bytes) {
+    while (bytes > 0) {
+      long step = bytes > 0x40000000 ? 0x40000000 : static_cast<long>(bytes);
+      if (fseek(fp, step, SEEK_CUR) != 0) {
+        uint8_t discard[4096];
+        size_t n = bytes < sizeof(discard) ? static_cast<size_t>(bytes)
+                                           : sizeof(discard);
+        if (fread(discard, 1, n, fp) != n) return false;
+        step = static_cast<long>(n);
+      }
+      bytes -= step;
+    }
+    return true;
+  }
+
+  FILE *fp;
+  bool ownsFile;  // close() でファイルを閉じるか
+  SampleFormat format;
+  int channels;
+  int sampleRate;
+  size_t frameBytes;
+  uint64_t remainingBytes;  // dataチャンクの未読バイト数
+  uint64_t dataBytes;       // dataチャンクの総バイト数
+  uint64_t dataOffset;      // dataチャンク先頭のファイル内位置
+  bool seekable;            // seek() を使えるか
+};
@@ -0,0 +1,90 @@
+﻿//-----------------------------------------------------------------------------
+// ワーカースレッド間で仕事を分け合うワークスティーリング・キュー
+// 各ワーカーは自分の両端キューの先頭から取り、空になったら他のワーカーの末尾から奪います
+//-----------------------------------------------------------------------------
+#pragma once
+
+#include <stddef.h>
+//--
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief ワーカーごとの両端キューを持つワークスティーリング・キュー
+ *
+ * 仕事はあらかじめ push() で各ワーカーに割り振っておきます。
+ * 自分のキューは先頭から、他のワーカーのキューは末尾から取り出すため、
+ * 持ち主と奪う側がぶつかるのはキューが残り少ないときだけです。
+ * ロックはワーカーごとに分かれており、全体を止めるロックはありません。
+ */
+template <typename T>
+class WorkStealingQueue {
+ public:
+  /**
+   * @param workers ワーカー数
+   */
+  explicit WorkStealingQueue(size_t workers) : queues(workers ? workers : 1) {}
+
+  size_t workerCount() const { return queues.size(); }
+
+  /**
+   * @brief 仕事をワーカーのキューに追加する
+   *
+   * @param worker 割り当てるワーカーの番号
+   * @param item 追加する仕事
+   */
+  void push(size_t worker, const T &item) {
+    WorkerQueue &q = queues[worker % queues.size()];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    q.items.push_back(item);
+  }
+
+  /**
+   * @brief 次の仕事を取り出す
+   *
+   * 自分のキューが空の場合は他のワーカーのキューから奪います。
+   *
+   * @param worker 呼び出し元のワーカー番号
+   * @param item 取り出した仕事の格納先
+   * @param stolen 他のワーカーから奪った場合にtrueを格納（nullptr可）
+   * @return bool 仕事が残っていなければfalse
+   */
+  bool pop(size_t worker, T *item, bool *stolen = nullptr) {
+    const size_t n = queues.size();
+    if (stolen) *stolen = false;
+
+    {
+      WorkerQueue &own = queues[worker % n];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.items.empty()) {
+        *item = own.items.front();
+        own.items.pop_front();
+        return true;
+      }
+    }
+
+    // 隣のワーカーから順に末尾を奪う
+    for (size_t i = 1; i < n; i++) {
+      WorkerQueue &victim = queues[(worker + i) % n];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.items.empty()) {
+        *item = victim.items.back();
+        victim.items.pop_back();
+        if (stolen) *stolen = true;
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<T> items;
+    // 隣のワーカーのロックとキャッシュラインを共有しないよう間隔をあける
+    char padding[64];
+  };
+
+  std::vector<WorkerQueue> queues;
+};